@@ -431,14 +431,81 @@ int64_t gyro_mul_pos = 763300LL<<16;
 
 int gyro_avgd = 0;
 
-void correct_location_without_moving(pos_t corr)
+/*
+	Expected robot pose error, Q8 like corr_cov_t, that lidar corrections are weighed against in
+	correct_location_without_moving(). Covariances are clamped to CORR_COV_MAX.
+*/
+#define CORR_PRIOR_VAR_XY  (400<<8) // (20 mm)^2
+#define CORR_PRIOR_VAR_ANG (76<<8)  // (0.5 deg)^2, in mrad^2
+#define CORR_COV_MAX       (1<<24)
+
+static int64_t clamp_cov(int32_t v)
+{
+	if(v > CORR_COV_MAX) return CORR_COV_MAX;
+	if(v < -CORR_COV_MAX) return -CORR_COV_MAX;
+	return v;
+}
+
+/*
+	The part of corr that correct_location_without_moving() applies, given its covariance: corr*P/(P+R) for
+	the angle, P*(P*I+R)^-1*corr for x,y; the angle-translation covariance is ignored. Parts without an
+	estimate (COV_UNKNOWN) are applied as they are.
+*/
+void weigh_correction(pos_t* corr, corr_cov_t* cov)
+{
+	if(cov->aa != COV_UNKNOWN)
+	{
+		int64_t aa = clamp_cov(cov->aa);
+		if(aa < 0) aa = 0;
+		corr->ang = ((int64_t)corr->ang*CORR_PRIOR_VAR_ANG)/(CORR_PRIOR_VAR_ANG + aa);
+	}
+
+	if(cov->xx == COV_UNKNOWN || cov->yy == COV_UNKNOWN)
+		return;
+
+	int64_t p = CORR_PRIOR_VAR_XY;
+	int64_t xx = p + clamp_cov(cov->xx);
+	int64_t yy = p + clamp_cov(cov->yy);
+	int64_t xy = clamp_cov(cov->xy);
+	int64_t det = xx*yy - xy*xy;
+	if(xx <= 0 || yy <= 0 || det <= 0)
+		return;
+
+	int64_t x = corr->x, y = corr->y;
+	corr->x = (p*(yy*x - xy*y))/det;
+	corr->y = (p*(xx*y - xy*x))/det;
+}
+
+/*
+	Rotation by corr.ang around *mid (around the robot if mid is NULL), then translation by (corr.x, corr.y).
+	cov is the covariance of corr (can be NULL): the correction is weighed against CORR_PRIOR_VAR_*, so that
+	axes the measurement says little about (along a corridor) get corrected less.
+*/
+void correct_location_without_moving(pos_t corr, pos_t* mid, corr_cov_t* cov)
 {
    dbg_teleportation_bug(106);
 
-//	cur_x += corr.x<<16;
-//	cur_y += corr.y<<16;
-//	cur_pos.ang += corr.ang;
-//	aim_angle += corr.ang;
+	if(cov)
+		weigh_correction(&corr, cov);
+
+	int32_t sin_a = sin_lut[((uint32_t)corr.ang)>>SIN_LUT_SHIFT];
+	int32_t cos_a = sin_lut[(1073741824-(uint32_t)corr.ang)>>SIN_LUT_SHIFT];
+
+	__disable_irq();
+	if(mid)
+	{
+		int32_t dx = cur_pos.x - mid->x;
+		int32_t dy = cur_pos.y - mid->y;
+		corr.x += ((dx*cos_a - dy*sin_a + (1<<14))>>15) - dx;
+		corr.y += ((dx*sin_a + dy*cos_a + (1<<14))>>15) - dy;
+	}
+	cur_x += corr.x<<16;
+	cur_y += corr.y<<16;
+	cur_pos.x = cur_x>>16; // Don't wait for the next 10k tick: the lidar takes pos_at_start right after.
+	cur_pos.y = cur_y>>16;
+	cur_pos.ang += corr.ang;
+	aim_angle += corr.ang;
+	__enable_irq();
 
 	if(gyro_avgd < -300)
 	{
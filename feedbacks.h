@@ -79,6 +79,24 @@ typedef struct
 
 #define COPY_POS(to, from) { (to).ang = (from).ang; (to).x = (from).x; (to).y = (from).y; }
 
+/*
+	Covariance of a pose correction, fixed point Q8: translation in mm, angle in mrad.
+	COV_UNKNOWN on the diagonal means there's no information on that axis. A scan match that can't tell the
+	position along a corridor gives the variance COV_UNOBSERVED along it, and no correction along it.
+*/
+typedef struct __attribute__((packed))
+{
+	int32_t aa;
+	int32_t ax;
+	int32_t ay;
+	int32_t xx;
+	int32_t xy;
+	int32_t yy;
+} corr_cov_t;
+
+#define COV_UNKNOWN INT32_MAX
+#define COV_UNOBSERVED (1<<24) // (256 mm)^2
+
 extern volatile pos_t cur_pos;
 
 void zero_angle();
@@ -88,7 +106,8 @@ void allow_angular(int yes);
 void allow_straight(int yes);
 void auto_disallow(int yes);
 
-void correct_location_without_moving(pos_t corr);
+void correct_location_without_moving(pos_t corr, pos_t* mid, corr_cov_t* cov);
+void weigh_correction(pos_t* corr, corr_cov_t* cov);
 void correct_location_without_moving_external(pos_t corr);
 void set_location_without_moving_external(pos_t new_pos);
 
@@ -0,0 +1,86 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+
+#include "corpus.h"
+
+#define CORPUS_MAGIC "LIDCORP3"
+
+static int read_scan(FILE* f, lidar_scan_t* scan)
+{
+	memset(scan, 0, sizeof(*scan));
+	if(fread(scan, offsetof(lidar_scan_t, scan), 1, f) != 1)
+		return -1;
+	if(scan->n_points < 0 || scan->n_points > LIDAR_MAX_POINTS)
+		return -2;
+	if(scan->n_points && fread(scan->scan, sizeof(xy_i16_t), scan->n_points, f) != (size_t)scan->n_points)
+		return -1;
+	return 0;
+}
+
+int corpus_read(const char* fname, corpus_pair_t** pairs)
+{
+	FILE* f = fopen(fname, "rb");
+	if(!f)
+	{
+		printf("Cannot open %s\n", fname);
+		return -1;
+	}
+
+	char magic[8];
+	if(fread(magic, 8, 1, f) != 1 || memcmp(magic, CORPUS_MAGIC, 8))
+	{
+		printf("%s is not a scan pair corpus\n", fname);
+		fclose(f);
+		return -1;
+	}
+
+	int n = 0, alloced = 0;
+	corpus_pair_t* p = NULL;
+	while(1)
+	{
+		pos_t truth;
+		if(fread(&truth, sizeof(truth), 1, f) != 1)
+			break; // end of file
+
+		if(n >= alloced)
+		{
+			alloced = alloced?alloced*2:64;
+			p = realloc(p, alloced*sizeof(corpus_pair_t));
+			if(!p)
+			{
+				printf("Out of memory\n");
+				fclose(f);
+				return -1;
+			}
+		}
+
+		p[n].truth = truth;
+		if(read_scan(f, &p[n].scan1) || read_scan(f, &p[n].scan2))
+		{
+			printf("%s: record %d is truncated or broken\n", fname, n);
+			free(p);
+			fclose(f);
+			return -1;
+		}
+		n++;
+	}
+
+	fclose(f);
+	*pairs = p;
+	return n;
+}
+
+int corpus_write_header(FILE* f)
+{
+	return (fwrite(CORPUS_MAGIC, 8, 1, f) == 1) ? 0 : -1;
+}
+
+int corpus_write_pair(FILE* f, corpus_pair_t* pair)
+{
+	if(fwrite(&pair->truth, sizeof(pos_t), 1, f) != 1 ||
+	   fwrite(&pair->scan1, LIDAR_SIZEOF(pair->scan1), 1, f) != 1 ||
+	   fwrite(&pair->scan2, LIDAR_SIZEOF(pair->scan2), 1, f) != 1)
+		return -1;
+	return 0;
+}
@@ -0,0 +1,35 @@
+#ifndef CORPUS_H
+#define CORPUS_H
+
+/*
+	Scan pair corpus for the host-side tools.
+
+	File format (little endian, like the MCU):
+	8	"LIDCORP3"
+	Then, until the end of the file, records of:
+	12	pos_t truth: the correction do_lidar_corr(&scan1, &scan2, &corr) should find
+	n	scan1, LIDAR_SIZEOF(scan1) bytes of lidar_scan_t as is - exactly the payload of the 0x84 UART message
+	n	scan2, same
+
+	So scans recorded from the robot's UART output can be stored without any conversion; only the ground
+	truth needs to come from elsewhere.
+*/
+
+#include <stdio.h>
+#include "../lidar.h"
+
+typedef struct
+{
+	pos_t truth;
+	lidar_scan_t scan1;
+	lidar_scan_t scan2;
+} corpus_pair_t;
+
+// Returns the number of pairs read into a malloc'd *pairs, or -1 on error (message printed).
+int corpus_read(const char* fname, corpus_pair_t** pairs);
+
+// Call corpus_write_header() once, then corpus_write_pair() for each pair. Return 0 on success.
+int corpus_write_header(FILE* f);
+int corpus_write_pair(FILE* f, corpus_pair_t* pair);
+
+#endif
@@ -0,0 +1,66 @@
+/*
+	Stand-ins for the MCU-side symbols the matcher refers to, so that lidar_corr.c links on a workstation.
+*/
+
+#include <stdint.h>
+#include <time.h>
+
+#include "../uart.h"
+#include "../lidar.h"
+
+uint8_t txbuf[TX_BUFFER_LEN];
+
+volatile int dbg[10];
+volatile int dbg_error_num;
+volatile int us100;
+volatile int lidar_collision_avoidance_new;
+
+// The scan buffers of lidar.c, for lidar_reproject()
+lidar_scan_t lidar_scans[LIDAR_N_SCANS];
+lidar_raw_t lidar_raws[LIDAR_N_SCANS];
+
+int send_uart(void* buf, uint8_t header, int len)
+{
+	return 0;
+}
+
+int uart_busy()
+{
+	return 0;
+}
+
+void delay_ms(uint32_t i)
+{
+}
+
+uint32_t timestamp_us()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint32_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+// Corrections are "applied" right away; the benchmark scans never miss any. The latest one is kept for the
+// benchmark to apply to its simulated robot pose. Per thread, like the matcher state.
+static CORR_TLS int corr_cnt;
+CORR_TLS pos_t host_corr_mid, host_corr;
+CORR_TLS int host_corr_new;
+
+int lidar_correct_pose(pos_t* mid, pos_t* corr, corr_cov_t* cov)
+{
+	corr_cnt++;
+	host_corr_mid = *mid;
+	host_corr = *corr;
+	host_corr_new = 1;
+	return 0;
+}
+
+int lidar_scan_corr_seq(lidar_scan_t* scan)
+{
+	return corr_cnt;
+}
+
+// The benchmark looks at the matcher output as it is.
+void weigh_correction(pos_t* corr, corr_cov_t* cov)
+{
+}
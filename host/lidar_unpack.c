@@ -0,0 +1,66 @@
+#include <string.h>
+#include <stddef.h>
+
+#include "lidar_unpack.h"
+#include "../lidar_pack.h"
+
+// Next code at *pos; -1 if it runs past end or is longer than any code the encoder writes.
+static int get_code(const uint8_t* buf, int end, int* pos, uint32_t* v)
+{
+	*v = 0;
+	for(int shift = 0; shift < 21; shift += 7)
+	{
+		if(*pos >= end)
+			return -1;
+		uint8_t b = buf[(*pos)++];
+		*v |= (uint32_t)(b & 0x7f) << shift;
+		if(!(b & 0x80))
+			return 0;
+	}
+	return -1;
+}
+
+int lidar_unpack(const uint8_t* buf, int len, lidar_scan_t* out)
+{
+	lidar_pack_t hdr;
+
+	if(len < (int)LIDAR_PACK_HEADER_SIZE)
+		return -1;
+	memcpy(&hdr, buf, LIDAR_PACK_HEADER_SIZE);
+	if(hdr.n_points < 0 || hdr.n_points > LIDAR_MAX_POINTS || len != (int)LIDAR_PACK_SIZEOF(hdr))
+		return -1;
+
+	out->status = hdr.status;
+	out->id = hdr.id;
+	out->n_points = hdr.n_points;
+	out->version = hdr.version;
+	out->pos_at_start = hdr.pos_at_start;
+	out->pos_at_end = hdr.pos_at_end;
+	out->corr = hdr.corr;
+	out->corr_cov = hdr.corr_cov;
+	out->refxy = hdr.refxy;
+
+	int pos = LIDAR_PACK_HEADER_SIZE;
+	int32_t x = 0, y = 0, sx = 0, sy = 0;
+	for(int i = 0; i < hdr.n_points; i++)
+	{
+		uint32_t zx, zy;
+		if(get_code(buf, len, &pos, &zx) || get_code(buf, len, &pos, &zy))
+			return -1;
+		int32_t nx = x + sx + ((int32_t)(zx >> 1) ^ -(int32_t)(zx & 1));
+		int32_t ny = y + sy + ((int32_t)(zy >> 1) ^ -(int32_t)(zy & 1));
+		if(nx < INT16_MIN || nx > INT16_MAX || ny < INT16_MIN || ny > INT16_MAX)
+			return -1;
+		if(i > 0)
+		{
+			sx = nx - x;
+			sy = ny - y;
+		}
+		x = nx;
+		y = ny;
+		out->scan[i].x = x;
+		out->scan[i].y = y;
+	}
+
+	return (pos == len) ? 0 : -1;
+}
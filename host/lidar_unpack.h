@@ -0,0 +1,14 @@
+#ifndef LIDAR_UNPACK_H
+#define LIDAR_UNPACK_H
+
+/*
+	Reference decoder for the compressed lidar scans (lidar_pack_t, see lidar_pack.c): the payload of the UART
+	message as received, to a lidar_scan_t.
+*/
+
+#include "../lidar.h"
+
+// Returns 0, or -1 if buf (len bytes) is not a complete, valid packed scan.
+int lidar_unpack(const uint8_t* buf, int len, lidar_scan_t* out);
+
+#endif
@@ -0,0 +1,720 @@
+/*
+	Host-side scan matcher benchmark.
+
+	Runs do_lidar_corr() over scan pairs with known pose errors in each scoring mode (and do_lidar_corr_bnb()
+	when built with LIDAR_CORR_BNB), and the on-MCU live matcher (livelidar_start/run/finish), both to completion
+	and with a time budget. Reports time per match, time per candidate pose (evaluation), and the error of the
+	resulting correction, next to the standard deviations predicted by lidar_corr_cov (means of the known ones).
+
+	do_lidar_corr() runs coarse-to-fine (lidar_corr_coarse) and with every candidate fully scored ("-full").
+	"saved" is the number of full 256-point evaluations the subsampling and the early rejection saved per match:
+	candidates scored minus image points visited / 256 (the few Gauss-Newton iterations count as evaluations too).
+
+	Line segment extraction (lidar_segments()) is run on the error-free scans of each set: size of the segment
+	message vs the scan message, and how far the segment end points are from the true walls.
+
+	The live kernels (one per search window, see LIVE_KERNEL()) are timed alone, on the room scans.
+
+	lidar_pack_scan() is checked to decode back exactly (host/lidar_unpack.c), and its message size compared to the
+	scan message; "raw" counts the scans the firmware would send unpacked, as the packed one isn't smaller.
+
+	lidar_reproject() is checked against a floating point reference, under known pose corrections.
+
+	A drift run follows the live matcher over a sequence of scans, the robot driving laps in the room with a
+	drifting gyro, and reports how far the believed pose ends up from the truth in each LIVELIDAR_MODE.
+
+	match_bench                  Synthetic scenes (scan_sim.c)
+	match_bench corpus.bin       Scan pairs from a corpus file (see corpus.h)
+	match_bench -w corpus.bin    Write the synthetic pairs as a corpus file
+
+	Cycle counts are TSC ticks on x86 hosts - only useful for comparing the kernels with each other, not for
+	predicting Cortex-M3 cycles.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC
+#endif
+
+#include "../lidar.h"
+#include "../lidar_corr.h"
+#include "../feedbacks.h"
+#include "../lidar_segs.h"
+#include "../lidar_pack.h"
+#include "../lidar_reproject.h"
+#include "../sin_lut.h"
+#include "lidar_unpack.h"
+#include "scan_sim.h"
+#include "corpus.h"
+
+#define N_CASES 20
+#define N_SAMPLES 400 // 2 Hz sweep, sample mode 2
+
+static int64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec*1000000000LL + ts.tv_nsec;
+}
+
+static uint64_t now_cycles()
+{
+#ifdef HAVE_TSC
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+static const char* mode_names[] = {"points", "lines", "grid"};
+
+typedef int (*matcher_t)(lidar_scan_t*, lidar_scan_t*, pos_t*);
+
+static void run_matcher(corpus_pair_t* pairs, int n_pairs, const char* name, matcher_t matcher)
+{
+	int64_t total_ns = 0;
+	uint64_t total_cycles = 0;
+	int64_t total_evals = 0;
+	int64_t total_pts = 0;
+	double sum_err_x = 0.0, sum_err_y = 0.0, sum_err_a = 0.0;
+	double sum_sd_x = 0.0, sum_sd_y = 0.0, sum_sd_a = 0.0;
+	int n_sd_xy = 0, n_sd_a = 0;
+	int n_ok = 0, n_fail = 0, n_degen = 0;
+
+	for(int c = 0; c < n_pairs; c++)
+	{
+		corpus_pair_t* p = &pairs[c];
+		pos_t corr;
+		int64_t t0 = now_ns();
+		uint64_t c0 = now_cycles();
+		lidar_corr_pts = 0;
+		int ret = matcher(&p->scan1, &p->scan2, &corr);
+		total_cycles += now_cycles() - c0;
+		total_ns += now_ns() - t0;
+		total_evals += lidar_corr_evals;
+		total_pts += lidar_corr_pts;
+
+		if(ret)
+		{
+			n_fail++;
+			continue;
+		}
+
+		n_ok++;
+		n_degen += lidar_corr_degen;
+		sum_err_x += abs(corr.x - p->truth.x);
+		sum_err_y += abs(corr.y - p->truth.y);
+		sum_err_a += fabs((double)(int32_t)((uint32_t)corr.ang - (uint32_t)p->truth.ang)/4294967296.0*360.0);
+
+		// Q8 mm^2 and mrad^2
+		corr_cov_t* cov = &lidar_corr_cov;
+		if(cov->xx != COV_UNKNOWN && cov->yy != COV_UNKNOWN)
+		{
+			sum_sd_x += sqrt(cov->xx/256.0);
+			sum_sd_y += sqrt(cov->yy/256.0);
+			n_sd_xy++;
+		}
+		if(cov->aa != COV_UNKNOWN)
+		{
+			sum_sd_a += sqrt(cov->aa/256.0)/1000.0/M_PI*180.0;
+			n_sd_a++;
+		}
+	}
+
+	double evals = total_evals ? (double)total_evals : 1.0;
+	char saved[16] = "-";
+	if(total_pts)
+		snprintf(saved, sizeof(saved), "%.0f", ((double)total_evals*256.0 - total_pts)/256.0/n_pairs);
+	printf("%-12s %10.1f %8.0f %10.1f %12.0f %8.1f %8.1f %8.3f %6.1f %6.1f %7.3f %6d %6s %6d\n",
+		name,
+		(double)total_ns/1000.0/n_pairs,
+		(double)total_evals/n_pairs,
+		(double)total_ns/evals,
+		(double)total_cycles/evals,
+		n_ok?sum_err_x/n_ok:0.0,
+		n_ok?sum_err_y/n_ok:0.0,
+		n_ok?sum_err_a/n_ok:0.0,
+		n_sd_xy?sum_sd_x/n_sd_xy:0.0,
+		n_sd_xy?sum_sd_y/n_sd_xy:0.0,
+		n_sd_a?sum_sd_a/n_sd_a:0.0,
+		n_fail, saved, n_degen);
+}
+
+/*
+	The live matcher keeps its own reference scan: after a reset, the first scan is dropped and the second one
+	becomes the reference, so scan1 is fed twice. The correction is around scan2's middle position, like
+	do_lidar_corr() gives it. Only the angle is searched, like on the robot, except in "live-xy" (livelidar_xy).
+
+	scan2 is searched for live_budget_us in total, in LIVE_BENCH_SLICE_US slices; 0 = to completion.
+*/
+#define LIVE_BENCH_SLICE_US 20
+static int live_budget_us;
+
+static int live_one(lidar_scan_t* scan, int budget_us)
+{
+	livelidar_start(scan);
+	if(budget_us == 0)
+	{
+		while(livelidar_run(1000000));
+	}
+	else
+	{
+		int64_t end = now_ns() + budget_us*1000LL;
+		while(now_ns() < end && livelidar_run(LIVE_BENCH_SLICE_US));
+	}
+	return livelidar_finish();
+}
+
+static int live_matcher(lidar_scan_t* scan1, lidar_scan_t* scan2, pos_t* corr)
+{
+	reset_lidar_corr_images();
+	live_one(scan1, 0);
+	live_one(scan1, 0);
+	int ret = live_one(scan2, live_budget_us);
+	*corr = livelidar_report.corr;
+	return (ret == 0 || ret == 100) ? 0 : ret;
+}
+
+static void run_set(const char* name, corpus_pair_t* pairs, int n_pairs)
+{
+	printf("\n%s: %d scan pairs\n", name, n_pairs);
+	printf("%-12s %10s %8s %10s %12s %8s %8s %8s %6s %6s %7s %6s %6s %6s\n",
+		"mode", "us/match", "evals", "ns/eval", "cycles/eval", "err_x", "err_y", "err_ang", "sd_x", "sd_y", "sd_ang", "fails",
+		"saved", "degen");
+
+	for(int mode = LIDAR_CORR_MODE_POINTS; mode <= LIDAR_CORR_MODE_GRID; mode++)
+	{
+		char name[16];
+		lidar_corr_mode = mode;
+		run_matcher(pairs, n_pairs, mode_names[mode], do_lidar_corr);
+		lidar_corr_coarse = 0;
+		snprintf(name, sizeof(name), "%s-full", mode_names[mode]);
+		run_matcher(pairs, n_pairs, name, do_lidar_corr);
+		lidar_corr_coarse = 1;
+	}
+
+#ifdef LIDAR_CORR_BNB
+	// Bound evaluations are counted as evals, too.
+	run_matcher(pairs, n_pairs, "grid-bnb", do_lidar_corr_bnb);
+#endif
+
+	live_budget_us = 0;
+	run_matcher(pairs, n_pairs, "live", live_matcher);
+
+	// Late match: the best pose after the stages finished in time.
+	live_budget_us = 40;
+	run_matcher(pairs, n_pairs, "live-40us", live_matcher);
+
+	live_budget_us = 0;
+	livelidar_xy = 1;
+	run_matcher(pairs, n_pairs, "live-xy", live_matcher);
+	livelidar_xy = 0;
+}
+
+/*
+	Live kernels alone, on 360-bin images made of the scan points in order (all valid), at LK_OFFS x LK_OFFS
+	offsets per pair.
+*/
+#define LK_OFFS 5
+
+extern int32_t calc_match_lvl_live(img_t* img1, img_t* img2, int32_t off_x, int32_t off_y);
+extern int32_t calc_match_lvl_live_high_movement(img_t* img1, img_t* img2, int32_t off_x, int32_t off_y);
+
+static const struct
+{
+	const char* name;
+	int32_t (*f)(img_t*, img_t*, int32_t, int32_t);
+} live_kernels[] =
+{
+	{"live",    calc_match_lvl_live},
+	{"live-hi", calc_match_lvl_live_high_movement},
+};
+
+static void scan_to_bins(lidar_scan_t* in, img_t* out)
+{
+	memset(out->valid, 0xff, sizeof(out->valid));
+	for(int b = 0; b < 360; b++)
+	{
+		int k = b*in->n_points/360;
+		out->x[b] = in->scan[k].x;
+		out->y[b] = in->scan[k].y;
+	}
+}
+
+static void run_live_kernels(corpus_pair_t* pairs, int n_pairs)
+{
+	static img_t img1, img2;
+
+	for(int v = 0; v < (int)(sizeof(live_kernels)/sizeof(live_kernels[0])); v++)
+	{
+		int64_t total_ns = 0;
+		uint64_t total_cycles = 0;
+		int64_t score = 0;
+		int calls = 0;
+
+		for(int c = 0; c < n_pairs; c++)
+		{
+			scan_to_bins(&pairs[c].scan1, &img1);
+			scan_to_bins(&pairs[c].scan2, &img2);
+
+			int64_t t0 = now_ns();
+			uint64_t c0 = now_cycles();
+			for(int xi = 0; xi < LK_OFFS; xi++)
+			{
+				for(int yi = 0; yi < LK_OFFS; yi++)
+				{
+					score += live_kernels[v].f(&img1, &img2, (xi-LK_OFFS/2)*20, (yi-LK_OFFS/2)*20);
+					calls++;
+				}
+			}
+			total_cycles += now_cycles() - c0;
+			total_ns += now_ns() - t0;
+		}
+
+		printf("%-8s %10.1f %12.0f %10.1f %10.0f\n", live_kernels[v].name, (double)total_ns/calls, (double)total_cycles/calls,
+			(double)total_cycles/calls/360.0, (double)score/calls);
+	}
+}
+
+/*
+	Drift run: DRIFT_SCANS scans around an ellipse in the room. The believed pose is the truth plus err; between
+	scans, the odometry moves it by the true displacement as seen with the believed heading, and the gyro adds
+	DRIFT_GYRO_DEG. The live matcher's corrections are applied to it at the end of each scan (no pipelining).
+	mode < 0 runs without matching.
+*/
+#define DRIFT_SCANS    120 // 3 laps
+#define DRIFT_LAP      40
+#define DRIFT_GYRO_DEG 0.1
+
+extern CORR_TLS pos_t host_corr_mid, host_corr;
+extern CORR_TLS int host_corr_new;
+
+static sim_pose_t drift_traj(int k)
+{
+	double t = 2.0*M_PI*k/DRIFT_LAP;
+	sim_pose_t p = {atan2(1000.0*cos(t), -2000.0*sin(t)), 2000.0*cos(t), 1000.0*sin(t) - 500.0};
+	return p;
+}
+
+static void run_drift(sim_scene_t* scene, const char* name, int mode)
+{
+	static lidar_scan_t scan;
+	sim_pose_t err = {0.0, 0.0, 0.0};
+	double sum_a = 0.0, sum_xy = 0.0;
+	int64_t total_ns = 0;
+	int n_ok = 0;
+
+	sim_seed(4321);
+	if(mode >= 0)
+		livelidar_mode = mode;
+	reset_lidar_corr_images();
+
+	for(int k = 0; k < DRIFT_SCANS; k++)
+	{
+		sim_pose_t s = drift_traj(k), e = drift_traj(k+1);
+		// Unwrapped heading
+		while(e.ang - s.ang > M_PI) e.ang -= 2.0*M_PI;
+		while(e.ang - s.ang < -M_PI) e.ang += 2.0*M_PI;
+
+		sim_scan(scene, &scan, s, e, err, N_SAMPLES, 10.0);
+
+		if(mode >= 0)
+		{
+			host_corr_new = 0;
+			int64_t t0 = now_ns();
+			live_one(&scan, 0);
+			total_ns += now_ns() - t0;
+			if(livelidar_report.ret == 0 || livelidar_report.ret == 100)
+				n_ok++;
+
+			if(host_corr_new)
+			{
+				// Belief at the end of the scan, corrected around mid like lidar_apply_pending_corr() does it.
+				double ca = (double)host_corr.ang/4294967296.0*2.0*M_PI;
+				double bx = e.x + err.x - host_corr_mid.x, by = e.y + err.y - host_corr_mid.y;
+				err.x = host_corr_mid.x + host_corr.x + cos(ca)*bx - sin(ca)*by - e.x;
+				err.y = host_corr_mid.y + host_corr.y + sin(ca)*bx + cos(ca)*by - e.y;
+				err.ang += ca;
+			}
+		}
+
+		sum_a += fabs(err.ang)/M_PI*180.0;
+		sum_xy += sqrt(err.x*err.x + err.y*err.y);
+		if(k == DRIFT_SCANS-1)
+			break;
+
+		sim_pose_t n = drift_traj(k+2);
+		double dx = n.x - e.x, dy = n.y - e.y;
+		err.x += cos(err.ang)*dx - sin(err.ang)*dy - dx;
+		err.y += sin(err.ang)*dx + cos(err.ang)*dy - dy;
+		err.ang += (DRIFT_GYRO_DEG + 0.05*sim_rand())/180.0*M_PI;
+	}
+
+	printf("%-8s %10.1f %8d %10.3f %10.1f %10.3f %10.1f\n",
+		name,
+		mode >= 0 ? (double)total_ns/1000.0/DRIFT_SCANS : 0.0,
+		n_ok,
+		sum_a/DRIFT_SCANS, sum_xy/DRIFT_SCANS,
+		fabs(err.ang)/M_PI*180.0, sqrt(err.x*err.x + err.y*err.y));
+}
+
+static double wall_dist(sim_scene_t* scene, double x, double y)
+{
+	double best = 1e9;
+	for(int w = 0; w < scene->n_walls; w++)
+	{
+		sim_wall_t* l = &scene->walls[w];
+		double dx = l->x2 - l->x1, dy = l->y2 - l->y1;
+		double t = ((x - l->x1)*dx + (y - l->y1)*dy)/(dx*dx + dy*dy);
+		if(t < 0.0) t = 0.0;
+		if(t > 1.0) t = 1.0;
+		double d = hypot(x - l->x1 - t*dx, y - l->y1 - t*dy);
+		if(d < best)
+			best = d;
+	}
+	return best;
+}
+
+static void run_segs(sim_scene_t* scene, const char* name, corpus_pair_t* pairs, int n_pairs)
+{
+	int64_t total_ns = 0;
+	double sum_segs = 0.0, sum_loose = 0.0, sum_bytes = 0.0, sum_scan_bytes = 0.0, sum_rms = 0.0, sum_end = 0.0;
+	int n_segs = 0;
+
+	for(int c = 0; c < n_pairs; c++)
+	{
+		lidar_scan_t* scan = &pairs[c].scan1;
+		int64_t t0 = now_ns();
+		int n = lidar_segments(scan, &lidar_segs);
+		total_ns += now_ns() - t0;
+
+		sum_segs += n;
+		sum_loose += lidar_segs.n_loose;
+		sum_bytes += LIDAR_SEGS_SIZEOF(lidar_segs);
+		sum_scan_bytes += LIDAR_SIZEOF(*scan);
+		for(int i = 0; i < n; i++)
+		{
+			lidar_seg_t* s = &lidar_segs.segs[i];
+			sum_rms += s->rms/16.0;
+			sum_end += wall_dist(scene, scan->refxy.x + s->p1.x, scan->refxy.y + s->p1.y);
+			sum_end += wall_dist(scene, scan->refxy.x + s->p2.x, scan->refxy.y + s->p2.y);
+			n_segs++;
+		}
+	}
+
+	printf("%-8s %10.1f %8.1f %8.1f %10.0f %10.0f %8.1f %8.1f\n",
+		name,
+		(double)total_ns/1000.0/n_pairs,
+		sum_segs/n_pairs, sum_loose/n_pairs,
+		sum_bytes/n_pairs, sum_scan_bytes/n_pairs,
+		n_segs?sum_rms/n_segs:0.0, n_segs?sum_end/(2*n_segs):0.0);
+}
+
+// Packs and unpacks every scan; fails counts the ones that don't come back exactly the same.
+static void run_pack(const char* name, corpus_pair_t* pairs, int n_pairs)
+{
+	static lidar_scan_t dec;
+	int64_t total_ns = 0;
+	double sum_bytes = 0.0, sum_scan_bytes = 0.0, sum_points = 0.0;
+	int fails = 0, raw = 0, n = 0;
+
+	for(int c = 0; c < 2*n_pairs; c++)
+	{
+		lidar_scan_t* scan = (c&1) ? &pairs[c/2].scan2 : &pairs[c/2].scan1;
+		int64_t t0 = now_ns();
+		lidar_pack_scan(scan, &lidar_pack);
+		total_ns += now_ns() - t0;
+
+		memset(&dec, 0x55, sizeof(dec));
+		if(lidar_unpack((uint8_t*)&lidar_pack, LIDAR_PACK_SIZEOF(lidar_pack), &dec) ||
+		   memcmp(&dec, scan, LIDAR_SIZEOF(*scan)))
+			fails++;
+
+		if(LIDAR_PACK_SIZEOF(lidar_pack) >= LIDAR_SIZEOF(*scan))
+			raw++;
+		sum_bytes += LIDAR_PACK_SIZEOF(lidar_pack);
+		sum_scan_bytes += LIDAR_SIZEOF(*scan);
+		sum_points += scan->n_points;
+		n++;
+	}
+
+	printf("%-8s %10.1f %8.0f %10.0f %8.2f %6d %6d\n", name, (double)total_ns/1000.0/n, sum_bytes/n, sum_scan_bytes/n,
+		(sum_bytes - n*LIDAR_PACK_HEADER_SIZE)/sum_points, raw, fails);
+}
+
+// The extremes: no points, and a full scan jumping between the corners of the coordinate range.
+static void run_pack_extremes()
+{
+	static corpus_pair_t p;
+	memset(&p, 0, sizeof(p));
+	p.scan1.id = 7;
+	p.scan1.refxy.x = -1234567;
+	p.scan2.n_points = LIDAR_MAX_POINTS;
+	for(int i = 0; i < LIDAR_MAX_POINTS; i++)
+	{
+		p.scan2.scan[i].x = (i&1) ? 30000 : -30000;
+		p.scan2.scan[i].y = (i&2) ? INT16_MAX : INT16_MIN;
+	}
+	run_pack("extremes", &p, 1);
+}
+
+/*
+	lidar_reproject() under a known correction: a scan is recorded along a straight, turning trajectory (heading
+	from ang0 to ang1 deg, 300 mm forward), and reprojected with a correction going from cs to ce, rotating
+	around the scan's middle pose (or around the robot with mid_null). Each point is compared with the sample
+	projected from the corrected pose worked out in floating point; fails counts points further than the sine
+	table resolution at their range (plus 2 mm), and scan end poses off by more than 2 mm or 0.01 deg.
+*/
+#define REPROJ_N 400
+
+static double reproj_wrap_deg(double d)
+{
+	while(d > 180.0) d -= 360.0;
+	while(d < -180.0) d += 360.0;
+	return d;
+}
+
+// The corrected pose at tick t, in deg and mm.
+static void reproj_expected(double ang0, double ang1, pos_t* cs, pos_t* ce, pos_t* mid, int t, double* a, double* x, double* y)
+{
+	double f = (double)t/(REPROJ_N-1);
+	double ra = ang0 + (ang1-ang0)*f;
+	double rx = 1000.0 + 300.0*f;
+	double ry = -500.0;
+
+	double ca = ((double)cs->ang + ((double)(int32_t)((uint32_t)ce->ang - (uint32_t)cs->ang))*f)/4294967296.0*360.0;
+	double cx = cs->x + (ce->x - cs->x)*f;
+	double cy = cs->y + (ce->y - cs->y)*f;
+	if(mid)
+	{
+		double r = ca/180.0*M_PI;
+		double dx = rx - mid->x, dy = ry - mid->y;
+		rx = mid->x + dx*cos(r) - dy*sin(r);
+		ry = mid->y + dx*sin(r) + dy*cos(r);
+	}
+	*a = ra + ca;
+	*x = rx + cx;
+	*y = ry + cy;
+}
+
+static void reproj_pos(double a, double x, double y, pos_t* out)
+{
+	out->ang = (int32_t)(uint32_t)(int64_t)llround(reproj_wrap_deg(a)/360.0*4294967296.0);
+	out->x = lround(x);
+	out->y = lround(y);
+}
+
+static void run_reproject(const char* name, double ang0, double ang1, pos_t cs, pos_t ce, int mid_null)
+{
+	lidar_scan_t* scan = &lidar_scans[0];
+	lidar_raw_t* raw = &lidar_raws[0];
+	double a, x, y;
+	pos_t p;
+
+	memset(scan, 0, sizeof(*scan));
+	memset(raw, 0, sizeof(*raw));
+	scan->n_points = REPROJ_N;
+	reproj_expected(ang0, ang1, &(pos_t){0}, &(pos_t){0}, 0, 0, &a, &x, &y);
+	reproj_pos(a, x, y, &scan->pos_at_start);
+	reproj_expected(ang0, ang1, &(pos_t){0}, &(pos_t){0}, 0, REPROJ_N-1, &a, &x, &y);
+	reproj_pos(a, x, y, &scan->pos_at_end);
+	scan->refxy.x = scan->pos_at_start.x;
+	scan->refxy.y = scan->pos_at_start.y;
+
+	for(int t = 0; t < REPROJ_N; t++)
+	{
+		reproj_expected(ang0, ang1, &(pos_t){0}, &(pos_t){0}, 0, t, &a, &x, &y);
+		if((t & (LIDAR_POSE_EVERY-1)) == 0 || t == REPROJ_N-1)
+		{
+			lidar_raw_pose_t* rp = &raw->poses[raw->n_poses & (LIDAR_POSE_RING-1)];
+			reproj_pos(a, x, y, &rp->pos);
+			rp->tick = t;
+			raw->n_poses++;
+		}
+		raw->samples[t].degper16 = t*(360*16)/REPROJ_N;
+		raw->samples[t].len = 800 + (t*37)%1200;
+		raw->samples[t].tick = t;
+		reproj_pos(a, x, y, &p);
+		lidar_project(p.ang, p.x, p.y, raw->samples[t].degper16, raw->samples[t].len, &scan->refxy, &scan->scan[t]);
+	}
+
+	// Middle of the uncorrected scan, like the live matcher's corrections.
+	pos_t mid;
+	reproj_expected(ang0, ang1, &(pos_t){0}, &(pos_t){0}, 0, (REPROJ_N-1)/2, &a, &x, &y);
+	reproj_pos(a, x, y, &mid);
+	pos_t* pmid = mid_null ? 0 : &mid;
+
+	int64_t t0 = now_ns();
+	lidar_reproject(scan, pmid, &cs, &ce);
+	int64_t ns = now_ns() - t0;
+
+	int fails = 0;
+	double sum_err = 0.0, max_err = 0.0;
+	for(int t = 0; t < REPROJ_N; t++)
+	{
+		xy_i16_t e;
+		reproj_expected(ang0, ang1, &cs, &ce, pmid, t, &a, &x, &y);
+		reproj_pos(a, x, y, &p);
+		lidar_project(p.ang, p.x, p.y, raw->samples[t].degper16, raw->samples[t].len, &scan->refxy, &e);
+		double err = hypot(scan->scan[t].x - e.x, scan->scan[t].y - e.y);
+		sum_err += err;
+		if(err > max_err) max_err = err;
+		if(err > 2.0 + raw->samples[t].len*2.0*M_PI/SIN_LUT_POINTS)
+			fails++;
+	}
+
+	for(int end = 0; end < 2; end++)
+	{
+		pos_t* got = end ? &scan->pos_at_end : &scan->pos_at_start;
+		reproj_expected(ang0, ang1, &cs, &ce, pmid, end ? REPROJ_N-1 : 0, &a, &x, &y);
+		double da = reproj_wrap_deg((double)got->ang/4294967296.0*360.0 - a);
+		if(fabs(da) > 0.01 || hypot(got->x - x, got->y - y) > 2.0)
+			fails++;
+	}
+	if(!(scan->status & LIDAR_REPROJECTED))
+		fails++;
+
+	printf("%-10s %10.1f %8.2f %8.2f %6d\n", name, ns/1000.0, sum_err/REPROJ_N, max_err, fails);
+}
+
+// N_CASES pairs in the scene, the second scan with a random pose error (up to max_ang_deg); truth is the correction that cancels it.
+static void sim_pairs(sim_scene_t* scene, int along_axis_free, double max_ang_deg, corpus_pair_t* out)
+{
+	sim_seed(1234);
+	for(int c = 0; c < N_CASES; c++)
+	{
+		sim_pose_t s1 = {0.10, 0.0, 0.0};
+		sim_pose_t e1 = {0.12, 100.0, 0.0};
+		sim_pose_t s2 = {0.12, 100.0, 0.0};
+		sim_pose_t e2 = {0.14, 200.0, 10.0};
+		sim_pose_t no_err = {0.0, 0.0, 0.0};
+		sim_pose_t err = {sim_rand()*max_ang_deg/180.0*M_PI, along_axis_free?0.0:round(sim_rand()*80.0), round(sim_rand()*80.0)};
+		sim_pose_t truth = {-err.ang, -err.x, -err.y};
+
+		sim_scan(scene, &out[c].scan1, s1, e1, no_err, N_SAMPLES, 10.0);
+		sim_scan(scene, &out[c].scan2, s2, e2, err, N_SAMPLES, 10.0);
+		sim_pose_to_pos(truth, &out[c].truth);
+	}
+}
+
+int main(int argc, char** argv)
+{
+	static sim_scene_t scene;
+	static corpus_pair_t room[N_CASES], corridor[N_CASES], room_rot[N_CASES];
+
+	if(argc == 2)
+	{
+		corpus_pair_t* pairs;
+		int n = corpus_read(argv[1], &pairs);
+		if(n < 0)
+			return 1;
+		if(n == 0)
+		{
+			printf("%s: no scan pairs\n", argv[1]);
+			return 1;
+		}
+
+		printf("do_lidar_corr() benchmark. Errors are mean absolute (mm, deg).\n");
+		run_set(argv[1], pairs, n);
+
+		printf("\npacked scans: mean per scan.\n");
+		printf("%-8s %10s %8s %10s %8s %6s %6s\n", "corpus", "us/scan", "bytes", "scan_bytes", "B/point", "raw", "fails");
+		run_pack("corpus", pairs, n);
+		free(pairs);
+		return 0;
+	}
+
+	sim_scene_room(&scene);
+	sim_pairs(&scene, 0, 1.5, room);
+	sim_pairs(&scene, 0, 8.0, room_rot);
+
+	// No error along the corridor: any x correction found there is injected by the matcher.
+	sim_scene_corridor(&scene);
+	sim_pairs(&scene, 1, 1.5, corridor);
+
+	if(argc == 3 && !strcmp(argv[1], "-w"))
+	{
+		FILE* f = fopen(argv[2], "wb");
+		if(!f || corpus_write_header(f))
+		{
+			printf("Cannot write %s\n", argv[2]);
+			return 1;
+		}
+		for(int c = 0; c < N_CASES; c++)
+		{
+			if(corpus_write_pair(f, &room[c]) || corpus_write_pair(f, &corridor[c]))
+			{
+				printf("Cannot write %s\n", argv[2]);
+				return 1;
+			}
+		}
+		fclose(f);
+		printf("Wrote %d scan pairs to %s\n", 2*N_CASES, argv[2]);
+		return 0;
+	}
+
+	if(argc != 1)
+	{
+		printf("Usage: match_bench [corpus.bin | -w corpus.bin]\n");
+		return 1;
+	}
+
+	printf("do_lidar_corr() benchmark, %d samples per scan. Errors are mean absolute (mm, deg).\n", N_SAMPLES);
+	livelidar_mode = LIVELIDAR_MODE_SCAN;
+	run_set("room", room, N_CASES);
+	run_set("corridor", corridor, N_CASES);
+
+	// Angle errors beyond the first angle pass: recovered only through the orientation histogram estimate.
+	run_set("room, up to 8 deg", room_rot, N_CASES);
+	lidar_corr_orient_hist = 0;
+	run_set("room, up to 8 deg, no orientation histogram", room_rot, N_CASES);
+	lidar_corr_orient_hist = 1;
+
+	printf("\nlive kernels: %d room scan pairs, %d offsets each\n", N_CASES, LK_OFFS*LK_OFFS);
+	printf("%-8s %10s %12s %10s %10s\n", "kernel", "ns/call", "cycles/call", "cycles/bin", "score");
+	run_live_kernels(room, N_CASES);
+
+	printf("\nsegments: mean per scan; rms and end point distance from the walls in mm.\n");
+	printf("%-8s %10s %8s %8s %10s %10s %8s %8s\n", "scene", "us/scan", "segs", "loose", "bytes", "scan_bytes", "rms", "end_err");
+	sim_scene_room(&scene);
+	run_segs(&scene, "room", room, N_CASES);
+	sim_scene_corridor(&scene);
+	run_segs(&scene, "corridor", corridor, N_CASES);
+
+	printf("\npacked scans: mean per scan; fails = not decoded back exactly.\n");
+	printf("%-8s %10s %8s %10s %8s %6s %6s\n", "scene", "us/scan", "bytes", "scan_bytes", "B/point", "raw", "fails");
+	run_pack("room", room, N_CASES);
+	run_pack("corridor", corridor, N_CASES);
+	run_pack_extremes();
+
+	printf("\nreprojection: %d samples; point errors in mm from the floating point reference.\n", REPROJ_N);
+	printf("%-10s %10s %8s %8s %6s\n", "case", "us/scan", "mean", "max", "fails");
+	{
+		pos_t none = {0, 0, 0};
+		pos_t rigid = {2*ANG_1_DEG, 30, -20};
+		pos_t grown = {3*ANG_1_DEG, 40, 10};
+		pos_t back = {-2*ANG_1_DEG, -15, 25};
+		run_reproject("none", 30.0, 40.0, none, none, 0);
+		run_reproject("rigid", 30.0, 40.0, rigid, rigid, 0);
+		run_reproject("growing", 30.0, 40.0, none, grown, 0);
+		run_reproject("robot", 30.0, 40.0, back, grown, 1);
+		run_reproject("wrap", 175.0, 185.0, back, grown, 0);
+	}
+
+	printf("\nlive drift: %d scans, laps in the room, gyro drift %.2f deg/scan. Pose errors in deg, mm.\n",
+		DRIFT_SCANS, DRIFT_GYRO_DEG);
+	printf("%-8s %10s %8s %10s %10s %10s %10s\n", "mode", "us/scan", "matched", "mean_ang", "mean_xy", "end_ang", "end_xy");
+	sim_scene_room(&scene);
+	run_drift(&scene, "none", -1);
+	run_drift(&scene, "scan", LIVELIDAR_MODE_SCAN);
+	run_drift(&scene, "submap", LIVELIDAR_MODE_SUBMAP);
+
+	return 0;
+}
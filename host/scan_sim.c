@@ -0,0 +1,123 @@
+#include <math.h>
+#include <string.h>
+
+#include "scan_sim.h"
+
+static uint32_t sim_rand_state = 12345;
+
+void sim_seed(uint32_t seed)
+{
+	sim_rand_state = seed;
+}
+
+double sim_rand()
+{
+	sim_rand_state = sim_rand_state*1664525UL + 1013904223UL;
+	return ((double)(sim_rand_state>>8) / (double)(1UL<<23)) - 1.0;
+}
+
+static void add_wall(sim_scene_t* s, double x1, double y1, double x2, double y2)
+{
+	if(s->n_walls >= SIM_MAX_WALLS)
+		return;
+	sim_wall_t* w = &s->walls[s->n_walls++];
+	w->x1 = x1; w->y1 = y1; w->x2 = x2; w->y2 = y2;
+}
+
+static void add_box(sim_scene_t* s, double x, double y, double w, double h)
+{
+	add_wall(s, x,   y,   x+w, y);
+	add_wall(s, x+w, y,   x+w, y+h);
+	add_wall(s, x+w, y+h, x,   y+h);
+	add_wall(s, x,   y+h, x,   y);
+}
+
+// 8 m x 6 m room with some furniture, robot around the origin.
+void sim_scene_room(sim_scene_t* s)
+{
+	memset(s, 0, sizeof(*s));
+	s->name = "room";
+	add_box(s, -4000, -3000, 8000, 6000);
+	add_box(s, 1500, 1200, 800, 600);
+	add_box(s, -2800, -2500, 500, 500);
+	add_box(s, -1000, 2000, 1600, 400);
+	add_wall(s, 2500, -3000, 2500, -1800);
+	add_wall(s, -4000, 0, -3200, 0);
+}
+
+// 2.4 m wide, 40 m long smooth corridor along the x axis. This is the case the point-to-point matcher fails in.
+void sim_scene_corridor(sim_scene_t* s)
+{
+	memset(s, 0, sizeof(*s));
+	s->name = "corridor";
+	add_wall(s, -20000, -1200, 20000, -1200);
+	add_wall(s, -20000,  1200, 20000,  1200);
+	add_wall(s, -20000, -1200, -20000, 1200);
+	add_wall(s,  20000, -1200,  20000, 1200);
+}
+
+static double raycast(sim_scene_t* s, double ox, double oy, double dx, double dy)
+{
+	double nearest = 1e9;
+	for(int i = 0; i < s->n_walls; i++)
+	{
+		sim_wall_t* w = &s->walls[i];
+		double ex = w->x2 - w->x1, ey = w->y2 - w->y1;
+		double den = dx*ey - dy*ex;
+		if(fabs(den) < 1e-12) continue;
+		double t = ((w->x1-ox)*ey - (w->y1-oy)*ex) / den; // along the ray
+		double u = ((w->x1-ox)*dy - (w->y1-oy)*dx) / den; // along the wall
+		if(t > 0.0 && u >= 0.0 && u <= 1.0 && t < nearest)
+			nearest = t;
+	}
+	return nearest;
+}
+
+void sim_pose_to_pos(sim_pose_t in, pos_t* out)
+{
+	out->ang = (int32_t)(uint32_t)(int64_t)llround(in.ang/(2.0*M_PI)*4294967296.0);
+	out->x = lround(in.x);
+	out->y = lround(in.y);
+}
+
+void sim_scan(sim_scene_t* s, lidar_scan_t* out, sim_pose_t true_start, sim_pose_t true_end, sim_pose_t err,
+              int n_samples, double noise_mm)
+{
+	memset(out, 0, sizeof(*out));
+
+	sim_pose_t bel_start = {true_start.ang+err.ang, true_start.x+err.x, true_start.y+err.y};
+	sim_pose_t bel_end   = {true_end.ang+err.ang,   true_end.x+err.x,   true_end.y+err.y};
+	sim_pose_to_pos(bel_start, &out->pos_at_start);
+	sim_pose_to_pos(bel_end, &out->pos_at_end);
+	out->version = LIDAR_SCAN_VERSION;
+	out->refxy.x = out->pos_at_start.x;
+	out->refxy.y = out->pos_at_start.y;
+
+	int n = 0;
+	for(int i = 0; i < n_samples && n < LIDAR_MAX_POINTS; i++)
+	{
+		double f = (double)i/(double)n_samples;
+		double sensor_ang = 2.0*M_PI*f;
+
+		double ta = true_start.ang + f*(true_end.ang-true_start.ang);
+		double tx = true_start.x   + f*(true_end.x-true_start.x);
+		double ty = true_start.y   + f*(true_end.y-true_start.y);
+
+		double len = raycast(s, tx, ty, cos(ta+sensor_ang), sin(ta+sensor_ang));
+		if(len > 15000.0 || len < 200.0)
+			continue;
+		len += noise_mm*sim_rand();
+
+		double ba = ta + err.ang, bx = tx + err.x, by = ty + err.y;
+		double x = bx + cos(ba+sensor_ang)*len - out->refxy.x;
+		double y = by + sin(ba+sensor_ang)*len - out->refxy.y;
+
+		if(x < -30000 || x > 30000 || y < -30000 || y > 30000)
+			continue;
+
+		out->scan[n].x = lround(x);
+		out->scan[n].y = lround(y);
+		n++;
+	}
+	out->n_points = n;
+}
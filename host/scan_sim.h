@@ -0,0 +1,53 @@
+#ifndef SCAN_SIM_H
+#define SCAN_SIM_H
+
+/*
+	Synthetic lidar scans for the host-side tools.
+
+	Scenes are sets of wall segments; scans are generated by ray casting from a robot moving linearly from
+	one pose to another during the revolution, and stored in lidar_scan_t exactly like lidar.c does it:
+	in angular order, refxy = believed pose at the start, points in mm relative to refxy.
+*/
+
+#include <stdint.h>
+#include "../lidar.h"
+
+typedef struct
+{
+	double x1, y1, x2, y2;
+} sim_wall_t;
+
+#define SIM_MAX_WALLS 64
+
+typedef struct
+{
+	const char* name;
+	int n_walls;
+	sim_wall_t walls[SIM_MAX_WALLS];
+} sim_scene_t;
+
+typedef struct
+{
+	double ang; // radians
+	double x;   // mm
+	double y;   // mm
+} sim_pose_t;
+
+void sim_scene_room(sim_scene_t* s);
+void sim_scene_corridor(sim_scene_t* s);
+
+// Uniform random in [-1, 1], deterministic sequence.
+void sim_seed(uint32_t seed);
+double sim_rand();
+
+/*
+	Generates a scan taken while the robot moved from true_start to true_end, with the robot believing it was
+	at (true pose + err) all the time. n_samples is the number of lidar samples per revolution, noise_mm is the
+	maximum range noise.
+*/
+void sim_scan(sim_scene_t* s, lidar_scan_t* out, sim_pose_t true_start, sim_pose_t true_end, sim_pose_t err,
+              int n_samples, double noise_mm);
+
+void sim_pose_to_pos(sim_pose_t in, pos_t* out);
+
+#endif
@@ -0,0 +1,370 @@
+/*
+	Parameter sweep of the scan matcher over a scan pair corpus, for retuning the scoring and search constants
+	(lidar_corr_tune_t) without the robot.
+
+	Every parameter set of the grid below is run over every pair of the corpus: do_lidar_corr() in each scoring
+	mode, and the live matcher (to completion, LIVELIDAR_MODE_SCAN). For each matcher, a table of the parameter
+	sets follows, best first (fewest failures, then the smallest mean translation error); the built-in values
+	are marked with *. Times are thread CPU time per match, so they stay comparable however many threads run.
+
+	The jobs (one parameter set on one pair) are spread over the threads with work stealing: each thread starts
+	with an equal share of the job list, and when it runs out, takes the later half of what is left of the
+	thread with the most left. The matcher state is per thread (LIDAR_CORR_THREADS), and so is
+	lidar_corr_tune.
+
+	sweep corpus.bin [threads]    threads defaults to the number of cores
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "../lidar.h"
+#include "../lidar_corr.h"
+#include "corpus.h"
+
+#define MAX_THREADS 256
+
+static const int match_divs[]   = {200, 400, 800, 1200, 1600, 3200, 6400};
+static const int grid_divs[]    = {800, 1600, 3200, 6400, 12800};
+static const int live_divs[]    = {100, 200, 400, 800, 1600, 3200};
+static const int pass1_steps[]  = {75, 100, 125, 150};
+static const int pass1_weighs[] = {0, 1};
+
+#define N_OF(a) ((int)(sizeof(a)/sizeof((a)[0])))
+
+#define M_POINTS 0
+#define M_LINES  1
+#define M_GRID   2
+#define M_LIVE   3
+#define N_MATCHERS 4
+
+static const char* matcher_names[N_MATCHERS] = {"points", "lines", "grid", "live"};
+
+typedef struct
+{
+	int matcher;
+	lidar_corr_tune_t tune;
+} param_set_t;
+
+typedef struct
+{
+	int ret;
+	double err_xy; // mm
+	double err_ang; // deg
+	int64_t ns;
+} job_result_t;
+
+typedef struct
+{
+	pthread_mutex_t lock;
+	int head, tail; // Jobs head..tail-1 are left
+} deque_t;
+
+static param_set_t* sets;
+static int n_sets;
+static corpus_pair_t* pairs;
+static int n_pairs;
+static job_result_t* results; // [set*n_pairs + pair]
+
+static deque_t deques[MAX_THREADS];
+static int n_threads;
+
+// The built-in values: the main thread's copy is never changed.
+static lidar_corr_tune_t default_tune()
+{
+	return lidar_corr_tune;
+}
+
+static void add_set(int matcher, lidar_corr_tune_t* tune)
+{
+	sets = realloc(sets, (n_sets+1)*sizeof(param_set_t));
+	sets[n_sets].matcher = matcher;
+	sets[n_sets].tune = *tune;
+	n_sets++;
+}
+
+static void make_sets()
+{
+	for(int m = M_POINTS; m <= M_GRID; m++)
+	{
+		int n_divs = (m == M_GRID) ? N_OF(grid_divs) : N_OF(match_divs);
+		for(int d = 0; d < n_divs; d++)
+		{
+			for(int s = 0; s < N_OF(pass1_steps); s++)
+			{
+				for(int w = 0; w < N_OF(pass1_weighs); w++)
+				{
+					lidar_corr_tune_t t = default_tune();
+					if(m == M_GRID)
+						t.grid_div = grid_divs[d];
+					else
+						t.match_div = match_divs[d];
+					t.pass1_step = pass1_steps[s];
+					t.pass1_weigh = pass1_weighs[w];
+					add_set(m, &t);
+				}
+			}
+		}
+	}
+
+	for(int d = 0; d < N_OF(live_divs); d++)
+	{
+		lidar_corr_tune_t t = default_tune();
+		t.live_div = t.live_div_hi = live_divs[d];
+		add_set(M_LIVE, &t);
+	}
+}
+
+static int64_t thread_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return (int64_t)ts.tv_sec*1000000000LL + ts.tv_nsec;
+}
+
+// Like the live matcher in match_bench.c: the first scan is fed twice to become the reference.
+static int live_matcher(lidar_scan_t* scan1, lidar_scan_t* scan2, pos_t* corr)
+{
+	lidar_scan_t* scans[3] = {scan1, scan1, scan2};
+	int ret = 0;
+
+	reset_lidar_corr_images();
+	for(int i = 0; i < 3; i++)
+	{
+		livelidar_start(scans[i]);
+		while(livelidar_run(1000000));
+		ret = livelidar_finish();
+	}
+	*corr = livelidar_report.corr;
+	return (ret == 0 || ret == 100) ? 0 : ret;
+}
+
+static void run_job(int job)
+{
+	param_set_t* set = &sets[job / n_pairs];
+	corpus_pair_t* p = &pairs[job % n_pairs];
+	job_result_t* r = &results[job];
+	pos_t corr;
+
+	lidar_corr_tune = set->tune;
+
+	int64_t t0 = thread_ns();
+	if(set->matcher == M_LIVE)
+	{
+		livelidar_mode = LIVELIDAR_MODE_SCAN;
+		r->ret = live_matcher(&p->scan1, &p->scan2, &corr);
+	}
+	else
+	{
+		lidar_corr_mode = set->matcher;
+		r->ret = do_lidar_corr(&p->scan1, &p->scan2, &corr);
+	}
+	r->ns = thread_ns() - t0;
+
+	if(r->ret)
+		return;
+
+	r->err_xy = hypot(corr.x - p->truth.x, corr.y - p->truth.y);
+	r->err_ang = fabs((double)(int32_t)((uint32_t)corr.ang - (uint32_t)p->truth.ang)/4294967296.0*360.0);
+}
+
+// Next job of thread t, stolen if need be; -1 when there's nothing left anywhere.
+static int next_job(int t)
+{
+	deque_t* own = &deques[t];
+
+	for(;;)
+	{
+		pthread_mutex_lock(&own->lock);
+		if(own->head < own->tail)
+		{
+			int job = own->head++;
+			pthread_mutex_unlock(&own->lock);
+			return job;
+		}
+		pthread_mutex_unlock(&own->lock);
+
+		// The count may change before the victim is locked again; it's checked again then.
+		int victim = -1, most = 0;
+		for(int v = 0; v < n_threads; v++)
+		{
+			if(v == t) continue;
+			pthread_mutex_lock(&deques[v].lock);
+			int left = deques[v].tail - deques[v].head;
+			pthread_mutex_unlock(&deques[v].lock);
+			if(left > most)
+			{
+				most = left;
+				victim = v;
+			}
+		}
+		if(victim < 0)
+			return -1;
+
+		deque_t* d = &deques[victim];
+		pthread_mutex_lock(&d->lock);
+		int left = d->tail - d->head;
+		if(left > 0)
+		{
+			int mid = d->tail - (left+1)/2;
+			int end = d->tail;
+			d->tail = mid;
+			pthread_mutex_unlock(&d->lock);
+
+			pthread_mutex_lock(&own->lock);
+			own->head = mid;
+			own->tail = end;
+			pthread_mutex_unlock(&own->lock);
+		}
+		else
+			pthread_mutex_unlock(&d->lock);
+	}
+}
+
+static void* worker(void* arg)
+{
+	int t = (int)(intptr_t)arg;
+	int job;
+	while((job = next_job(t)) >= 0)
+		run_job(job);
+	return NULL;
+}
+
+typedef struct
+{
+	int set;
+	int fails;
+	double err_xy, max_xy, err_ang;
+	double us;
+} set_summary_t;
+
+static int cmp_summary(const void* a, const void* b)
+{
+	const set_summary_t* sa = a;
+	const set_summary_t* sb = b;
+	if(sa->fails != sb->fails)
+		return sa->fails - sb->fails;
+	if(sa->err_xy != sb->err_xy)
+		return (sa->err_xy < sb->err_xy) ? -1 : 1;
+	return (sa->us < sb->us) ? -1 : (sa->us > sb->us);
+}
+
+static void summarize(int set, set_summary_t* out)
+{
+	int64_t ns = 0;
+	int n_ok = 0;
+
+	memset(out, 0, sizeof(*out));
+	out->set = set;
+	for(int c = 0; c < n_pairs; c++)
+	{
+		job_result_t* r = &results[set*n_pairs + c];
+		ns += r->ns;
+		if(r->ret)
+		{
+			out->fails++;
+			continue;
+		}
+		n_ok++;
+		out->err_xy += r->err_xy;
+		out->err_ang += r->err_ang;
+		if(r->err_xy > out->max_xy)
+			out->max_xy = r->err_xy;
+	}
+	if(n_ok)
+	{
+		out->err_xy /= n_ok;
+		out->err_ang /= n_ok;
+	}
+	out->us = (double)ns/1000.0/n_pairs;
+}
+
+static void print_tables()
+{
+	set_summary_t* sums = malloc(n_sets*sizeof(set_summary_t));
+	lidar_corr_tune_t def = default_tune();
+
+	for(int m = 0; m < N_MATCHERS; m++)
+	{
+		int n = 0;
+		for(int s = 0; s < n_sets; s++)
+		{
+			if(sets[s].matcher == m)
+				summarize(s, &sums[n++]);
+		}
+		qsort(sums, n, sizeof(set_summary_t), cmp_summary);
+
+		printf("\n%s: %d parameter sets, %d scan pairs. Errors are mean absolute (mm, deg).\n", matcher_names[m], n, n_pairs);
+		printf("  %6s %6s %6s %10s %8s %8s %8s %6s\n", "div", "step%", "weigh", "us/match", "err_xy", "max_xy", "err_ang",
+			"fails");
+		for(int i = 0; i < n; i++)
+		{
+			lidar_corr_tune_t* t = &sets[sums[i].set].tune;
+			int div = (m == M_GRID) ? t->grid_div : (m == M_LIVE) ? t->live_div : t->match_div;
+			int def_div = (m == M_GRID) ? def.grid_div : (m == M_LIVE) ? def.live_div : def.match_div;
+			int is_def = div == def_div && t->pass1_step == def.pass1_step && t->pass1_weigh == def.pass1_weigh;
+			printf("%c %6d %6d %6d %10.1f %8.1f %8.1f %8.3f %6d\n", is_def ? '*' : ' ', div, t->pass1_step, t->pass1_weigh,
+				sums[i].us, sums[i].err_xy, sums[i].max_xy, sums[i].err_ang, sums[i].fails);
+		}
+	}
+	free(sums);
+}
+
+int main(int argc, char** argv)
+{
+	if(argc < 2 || argc > 3)
+	{
+		printf("Usage: sweep corpus.bin [threads]\n");
+		return 1;
+	}
+
+	n_pairs = corpus_read(argv[1], &pairs);
+	if(n_pairs < 0)
+		return 1;
+	if(n_pairs == 0)
+	{
+		printf("%s: no scan pairs\n", argv[1]);
+		return 1;
+	}
+
+	n_threads = (argc == 3) ? atoi(argv[2]) : sysconf(_SC_NPROCESSORS_ONLN);
+	if(n_threads < 1) n_threads = 1;
+	if(n_threads > MAX_THREADS) n_threads = MAX_THREADS;
+
+	make_sets();
+	int n_jobs = n_sets*n_pairs;
+	results = calloc(n_jobs, sizeof(job_result_t));
+
+	for(int t = 0; t < n_threads; t++)
+	{
+		pthread_mutex_init(&deques[t].lock, NULL);
+		deques[t].head = (int64_t)n_jobs*t/n_threads;
+		deques[t].tail = (int64_t)n_jobs*(t+1)/n_threads;
+	}
+
+	struct timespec w0, w1;
+	clock_gettime(CLOCK_MONOTONIC, &w0);
+
+	pthread_t threads[MAX_THREADS];
+	for(int t = 0; t < n_threads; t++)
+		pthread_create(&threads[t], NULL, worker, (void*)(intptr_t)t);
+	for(int t = 0; t < n_threads; t++)
+		pthread_join(threads[t], NULL);
+
+	clock_gettime(CLOCK_MONOTONIC, &w1);
+
+	printf("%s: %d parameter sets x %d scan pairs on %d threads, %.1f s\n", argv[1], n_sets, n_pairs, n_threads,
+		(w1.tv_sec - w0.tv_sec) + (w1.tv_nsec - w0.tv_nsec)/1e9);
+	print_tables();
+
+	free(results);
+	free(sets);
+	free(pairs);
+	return 0;
+}
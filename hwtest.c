@@ -553,13 +553,14 @@ void hwtest_main()
 					lidar_fsm();
 					p_buf = buffer;
 
-					p_buf = o_str_append(p_buf, (acq_lidar_scan == &lidar_scans[0])?" *":"  ");
-					p_buf = o_str_append(p_buf, "SCAN0 = ");
-					p_buf = o_utoa16_fixed(lidar_scans[0].n_points, p_buf);
-
-					p_buf = o_str_append(p_buf, (acq_lidar_scan == &lidar_scans[1])?" *":"  ");
-					p_buf = o_str_append(p_buf, "SCAN1 = ");
-					p_buf = o_utoa16_fixed(lidar_scans[1].n_points, p_buf);
+					for(int s = 0; s < LIDAR_N_SCANS; s++)
+					{
+						p_buf = o_str_append(p_buf, (acq_lidar_scan == &lidar_scans[s])?" *":"  ");
+						p_buf = o_str_append(p_buf, "SCAN");
+						p_buf = o_utoa8_fixed(s, p_buf);
+						p_buf = o_str_append(p_buf, " = ");
+						p_buf = o_utoa16_fixed(lidar_scans[s].n_points, p_buf);
+					}
 
 					uart_print_string_blocking(buffer);
 					lidar_fsm();
@@ -567,6 +568,10 @@ void hwtest_main()
 
 					p_buf = o_str_append(p_buf, " PREV IMG = ");
 
+					static lidar_scan_t* prev_lidar_scan = &lidar_scans[0];
+					lidar_scan_t* newest = lidar_acquire_scan(NULL);
+					if(newest)
+						prev_lidar_scan = newest;
 
 					for(int i = 0; i < 4; i++)
 					{
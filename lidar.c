@@ -222,8 +222,11 @@ Send composite scan                    XXXX    XXXX
 #include "uart.h" // temporary debug
 #include "main.h"
 #include "lidar.h"
+#include "lidar_corr.h"
+#include "lidar_reproject.h"
 #include "sin_lut.h"
 #include "comm.h"
+#include "settings.h"
 
 #include "navig.h" // to inject points in micronavigation
 
@@ -263,9 +266,77 @@ extern void delay_ms(uint32_t i);
 
 void lidar_mark_invalid()
 {
+	acq_lidar_scan->status |= LIVELIDAR_INVALID;
 }
 
-point_t lidar_collision_avoidance[360];
+/*
+	Live matcher corrections are applied to the robot pose at the scan boundary, so that every scan is taken
+	with one pose correction. lidar_corr_seq_at_start[] tells how many had been applied when each scan started.
+*/
+static volatile int lidar_corr_pending;
+static volatile pos_t lidar_corr_mid;
+static volatile pos_t lidar_corr_corr;
+static volatile corr_cov_t lidar_corr_corr_cov;
+static int lidar_corr_applied;
+static int lidar_corr_seq_at_start[LIDAR_N_SCANS];
+
+/*
+	Gives a live matcher result to be applied at the start of the next scan: rotation by corr->ang around mid,
+	then translation by (corr->x, corr->y), the same way the matcher corrects the scans. cov is its covariance.
+	Returns 1 (and does nothing) if the previous correction hasn't been applied yet.
+*/
+int lidar_correct_pose(pos_t* mid, pos_t* corr, corr_cov_t* cov)
+{
+	int ret = 1;
+	__disable_irq();
+	if(!lidar_corr_pending)
+	{
+		COPY_POS(lidar_corr_mid, *mid);
+		COPY_POS(lidar_corr_corr, *corr);
+		lidar_corr_corr_cov = *cov;
+		lidar_corr_pending = 1;
+		ret = 0;
+	}
+	__enable_irq();
+	return ret;
+}
+
+// Number of lidar_correct_pose() corrections applied to the robot pose before the scan was started.
+int lidar_scan_corr_seq(lidar_scan_t* scan)
+{
+	return lidar_corr_seq_at_start[scan - lidar_scans];
+}
+
+lidar_raw_t lidar_raws[LIDAR_N_SCANS];
+static lidar_raw_t *acq_lidar_raw; // Goes with acq_lidar_scan
+static int32_t lidar_tick;
+
+static void lidar_record_pose(lidar_raw_t* raw)
+{
+	lidar_raw_pose_t* p = &raw->poses[raw->n_poses & (LIDAR_POSE_RING-1)];
+	COPY_POS(p->pos, cur_pos);
+	p->tick = lidar_tick;
+	raw->n_poses++;
+}
+
+// From the lidar interrupt, at the scan boundary, for the new acq_lidar_scan.
+static void lidar_apply_pending_corr()
+{
+	if(lidar_corr_pending)
+	{
+		pos_t mid, corr;
+		corr_cov_t cov = lidar_corr_corr_cov;
+		COPY_POS(mid, lidar_corr_mid);
+		COPY_POS(corr, lidar_corr_corr);
+		correct_location_without_moving(corr, &mid, &cov);
+		acq_lidar_scan->corr = corr;
+		acq_lidar_scan->corr_cov = cov;
+		acq_lidar_scan->status |= LIVELIDAR_CORR_APPLIED;
+		lidar_corr_applied++;
+		lidar_corr_pending = 0;
+	}
+	lidar_corr_seq_at_start[acq_lidar_scan - lidar_scans] = lidar_corr_applied;
+}
 
 
 
@@ -287,20 +358,67 @@ lidar_error_t lidar_error_code;
 
 int sweep_idx;
 
-int prev_lidar_scan_idx;
-
 /*
-Double buffer of processed lidar scans in the world coordinate frame.
-ack_lidar_scan is actively written to all the time.
-prev_lidar_scan points to the finished buffer. Take a local copy of the pointer: even if you start reading
-it just before the buffer swap happens, you'll likely read it faster than the new data comes in, so it's ok :-).
+Triple buffer of processed lidar scans in the world coordinate frame.
+acq_lidar_scan is actively written to all the time. When it's finished, it's published: it becomes the ready
+scan, and the previous ready scan is written next. lidar_acquire_scan() swaps the ready scan with the one the
+consumer held, so the consumer's scan stays as it is for as long as it needs (sending over the UART takes
+about a revolution), however the acquisition goes on.
+
+A published scan that's replaced by the next one before anybody acquired it is counted in lidar_scans_dropped;
+the sequence numbers tell the consumer the same.
 
 The buffers are never zeroed out, but written over.
 */
 
-lidar_scan_t lidar_scans[2];
+lidar_scan_t lidar_scans[LIDAR_N_SCANS];
 lidar_scan_t *acq_lidar_scan;
-lidar_scan_t *prev_lidar_scan;
+
+static volatile int lidar_ready_idx, lidar_held_idx;
+static volatile int lidar_ready_fresh; // lidar_ready_idx not acquired yet
+static uint32_t lidar_scan_seq, lidar_scan_seq_of[LIDAR_N_SCANS];
+volatile uint32_t lidar_scans_dropped;
+
+// From lidar_process_inthandler(), when acq_lidar_scan is finished.
+static void lidar_publish_scan()
+{
+	int acq = acq_lidar_scan - lidar_scans;
+	lidar_scan_seq_of[acq] = ++lidar_scan_seq;
+	if(lidar_ready_fresh)
+		lidar_scans_dropped++;
+	acq_lidar_scan = &lidar_scans[lidar_ready_idx];
+	lidar_ready_idx = acq;
+	lidar_ready_fresh = 1;
+}
+
+// 1 if a scan has been published after the one lidar_acquire_scan() gave last.
+int lidar_scan_published()
+{
+	return lidar_ready_fresh;
+}
+
+/*
+	Gives the latest published scan, held for the caller until the next call, and its sequence number (seq can
+	be NULL). Returns NULL if there's nothing newer than the one already held; that one stays held.
+	For one consumer (the main loop) only.
+*/
+lidar_scan_t* lidar_acquire_scan(uint32_t* seq)
+{
+	lidar_scan_t* ret = 0;
+	__disable_irq();
+	if(lidar_ready_fresh)
+	{
+		int held = lidar_held_idx;
+		lidar_held_idx = lidar_ready_idx;
+		lidar_ready_idx = held;
+		lidar_ready_fresh = 0;
+		ret = &lidar_scans[lidar_held_idx];
+		if(seq)
+			*seq = lidar_scan_seq_of[lidar_held_idx];
+	}
+	__enable_irq();
+	return ret;
+}
 
 
 void lidar_start_acq();
@@ -309,10 +427,14 @@ void lidar_rx_done_inthandler();
 
 int lidar_fps = 2;
 int lidar_smp = 2;
+static int lidar_run_fps; // What the sensor is actually running at, set when the acquisition starts
+static uint8_t lidar_run_status;
 
 /*
 	Controls the state machine to turn lidar on, stabilize, configure, and start acquiring.
-	If called during acquisition, motor speed / sampling is changed on the fly.
+	If called during acquisition, motor speed / sampling is changed on the fly. Changing the sampling only
+	is quick (the data stops for some tens of ms); changing the motor speed waits for the motor to stabilize again,
+	which takes seconds.
 */
 void lidar_on(int fps, int smp)
 {
@@ -354,6 +476,112 @@ void set_lidar_id(int id)
 	cur_lidar_id = id;
 }
 
+/*
+	Picks the sample rate from how the robot moves, once per scan (from the main loop):
+
+	- Moving or turning fast with something near: the medium sample rate, for more points on the obstacles.
+	- Standing still: the highest sample rate the UART budget allows, for dense scans to map with.
+	- Otherwise: the lowest sample rate, like before.
+
+	Only the sampling is reconfigured on the fly (the motor keeps its speed, so the scans hardly stall). The motor
+	rate is set back to LIDAR_RATE_FPS only while standing still, after LIDAR_RATE_MOTOR_SCANS scans of it: a
+	motor change waits for the speed to settle, without scans.
+
+	The robot speed comes from the scan's own poses, the nearest obstacle from its raw samples (the ignored
+	angles, the robot itself, are not there). uart_bytes is what was sent of the scan; the bytes per second of
+	another mode are estimated from it, as the number of points goes with the sample rate.
+
+	The change is requested from lidar_fsm(), which owns the lidar state; the request is dropped if the lidar
+	isn't running by then.
+*/
+
+volatile int lidar_auto_rate_on = 1;
+
+#define LIDAR_RATE_FPS           2
+#define LIDAR_RATE_FAST_SPEED    300  // mm/s
+#define LIDAR_RATE_FAST_ANGSPEED 60   // deg/s
+#define LIDAR_RATE_FAST_NEAR     1500 // mm
+#define LIDAR_RATE_STILL_SPEED   20   // mm/s
+#define LIDAR_RATE_STILL_ANGSPEED 2   // deg/s
+#define LIDAR_RATE_UART_BUDGET   3500 // lidar bytes/s, of about 10 kB/s of the link
+#define LIDAR_RATE_SMP_SCANS      2
+#define LIDAR_RATE_MOTOR_SCANS    5
+
+static const int lidar_smp_hz[4] = {0, 600, 800, 1075}; // Upper ends of the sample rates of the codes
+
+static volatile int lidar_rate_req; // Set by lidar_auto_rate(), cleared by lidar_fsm()
+static int lidar_ignore_calib_on;   // generate_lidar_ignore() is gathering: the rate must stay as it is
+static volatile int lidar_rate_req_fps, lidar_rate_req_smp;
+
+void lidar_auto_rate(lidar_scan_t* scan, int uart_bytes)
+{
+	static int want_fps, want_smp, want_cnt;
+
+	int fps = LIDAR_STATUS_FPS(scan->status);
+	int smp = LIDAR_STATUS_SMP(scan->status);
+
+	if(!lidar_auto_rate_on || lidar_rate_req || lidar_ignore_calib_on || cur_lidar_state != S_LIDAR_RUNNING || (scan->status & LIVELIDAR_INVALID) ||
+	   fps < 1 || smp < 1 || fps != lidar_fps || smp != lidar_smp)
+	{
+		want_cnt = 0; // Nothing to decide on, or the previous change is still under way.
+		return;
+	}
+
+	pos_t start, end;
+	COPY_POS(start, scan->pos_at_start);
+	COPY_POS(end, scan->pos_at_end);
+	int64_t dx = (end.x - start.x)*fps, dy = (end.y - start.y)*fps; // mm/s
+	int64_t speed_sq = dx*dx + dy*dy;
+	int angspeed = ((int32_t)((uint32_t)end.ang - (uint32_t)start.ang) / ANG_1_DEG) * fps;
+	if(angspeed < 0) angspeed = -angspeed;
+
+	lidar_raw_t* raw = &lidar_raws[scan - lidar_scans];
+	int nearest = 65535;
+	for(int i = 0; i < scan->n_points; i++)
+	{
+		if(raw->samples[i].len < nearest)
+			nearest = raw->samples[i].len;
+	}
+
+	int still = speed_sq < LIDAR_RATE_STILL_SPEED*LIDAR_RATE_STILL_SPEED && angspeed < LIDAR_RATE_STILL_ANGSPEED;
+	int new_fps = fps, new_smp = 1;
+	if((speed_sq > LIDAR_RATE_FAST_SPEED*LIDAR_RATE_FAST_SPEED || angspeed > LIDAR_RATE_FAST_ANGSPEED) && nearest < LIDAR_RATE_FAST_NEAR)
+	{
+		new_smp = 2;
+	}
+	else if(still)
+	{
+		new_fps = LIDAR_RATE_FPS;
+		new_smp = 3;
+	}
+
+	// Points per scan go with smp_hz/fps: the bytes per second only with the sample rate.
+	while(new_smp > 1 && uart_bytes*fps*lidar_smp_hz[new_smp]/lidar_smp_hz[smp] > LIDAR_RATE_UART_BUDGET)
+		new_smp--;
+
+	if(new_fps == fps && new_smp == smp)
+	{
+		want_cnt = 0;
+		return;
+	}
+
+	if(new_fps != want_fps || new_smp != want_smp)
+	{
+		want_fps = new_fps;
+		want_smp = new_smp;
+		want_cnt = 0;
+	}
+
+	want_cnt++;
+	if(want_cnt >= ((new_fps != fps) ? LIDAR_RATE_MOTOR_SCANS : LIDAR_RATE_SMP_SCANS))
+	{
+		want_cnt = 0;
+		lidar_rate_req_fps = new_fps;
+		lidar_rate_req_smp = new_smp;
+		lidar_rate_req = 1;
+	}
+}
+
 
 typedef struct  // These angles in 1/16th degrees!
 {
@@ -363,7 +591,7 @@ typedef struct  // These angles in 1/16th degrees!
 
 #define IGN(mid, width) {(int32_t)(((mid)-((width)/2.0))*16.0), (int32_t)(((mid)+((width)/2.0))*16.0)}
 
-// too many ignore areas could slow down the ISR too much... Sensible amount is 6.
+// The built-in mask, used until generate_lidar_ignore() has been run on the robot.
 #define N_IGNORE_AREAS 6
 const ignore_area_t ignore_areas[N_IGNORE_AREAS] =
 {
@@ -375,6 +603,272 @@ const ignore_area_t ignore_areas[N_IGNORE_AREAS] =
 	IGN(301.20, 6.80+5.0)
 };
 
+/*
+	The samples are masked with settings.lidar_ignore, one bit per 1/16 degree of the sensor angle: a single
+	lookup, however many masked areas there are.
+*/
+#define LIDAR_ANG_UNITS     (360*16)
+#define LIDAR_IGNORE_MAGIC  0x16a0e5ed
+#define LIDAR_IGNORED(map, degper16) ((map)[(degper16)>>5] & (1UL<<((degper16)&31)))
+#define LIDAR_SET_IGNORED(map, degper16) do{ (map)[(degper16)>>5] |= 1UL<<((degper16)&31); } while(0)
+
+static void lidar_default_ignore()
+{
+	for(int i=0; i<LIDAR_ANG_UNITS/32; i++)
+		settings.lidar_ignore[i] = 0;
+
+	for(int i=0; i<N_IGNORE_AREAS; i++)
+	{
+		for(int a = ignore_areas[i].start+1; a < ignore_areas[i].end; a++)
+		{
+			if(a >= 0 && a < LIDAR_ANG_UNITS)
+				LIDAR_SET_IGNORED(settings.lidar_ignore, a);
+		}
+	}
+}
+
+/*
+	Self-occlusion calibration, see generate_lidar_ignore(). Every sample nearer than LIDAR_IGNORE_LEN
+	(LIDAR_IGNORE_LEN_FRONT within 45 degrees of straight ahead) is the robot itself: it's masked, with
+	LIDAR_IGNORE_MARGIN on both sides, because the samples of the next revolutions fall at other angles.
+*/
+#define LIDAR_IGNORE_SCANS  10
+#define LIDAR_IGNORE_MARGIN (5*16/2) // 2.5 deg, like the built-in areas
+
+#ifdef PROD1
+	#define LIDAR_FRONT_DEGPER16 (180*16)
+#else
+	#define LIDAR_FRONT_DEGPER16 0
+#endif
+
+static uint32_t lidar_ignore_calib[LIDAR_ANG_UNITS/32];
+static volatile int lidar_ignore_calib_scans; // Revolutions left to gather
+
+static void lidar_ignore_calib_sample(int32_t degper16, int32_t len_mm)
+{
+	int32_t off = degper16 - LIDAR_FRONT_DEGPER16;
+	if(off < -LIDAR_ANG_UNITS/2) off += LIDAR_ANG_UNITS;
+	if(off >= LIDAR_ANG_UNITS/2) off -= LIDAR_ANG_UNITS;
+	int front = off > -45*16 && off < 45*16;
+
+	if(len_mm >= (front ? LIDAR_IGNORE_LEN_FRONT : LIDAR_IGNORE_LEN))
+		return;
+
+	for(int a = degper16-LIDAR_IGNORE_MARGIN; a <= degper16+LIDAR_IGNORE_MARGIN; a++)
+	{
+		int w = (a < 0) ? (a + LIDAR_ANG_UNITS) : (a >= LIDAR_ANG_UNITS) ? (a - LIDAR_ANG_UNITS) : a;
+		LIDAR_SET_IGNORED(lidar_ignore_calib, w);
+	}
+}
+
+static pos_t lidar_ignore_calib_pos;
+
+/*
+	Starts building the ignore mask from what the lidar sees of the robot itself. The robot must stand still
+	with nothing else within LIDAR_IGNORE_LEN for LIDAR_IGNORE_SCANS revolutions; lidar_ignore_calib_run()
+	does the rest; lidar_auto_rate() leaves the lidar alone meanwhile, as a reconfiguration would abort it.
+	Returns 1 when started, -1 if the lidar isn't running (or is about to change its rate).
+*/
+int generate_lidar_ignore()
+{
+	if(cur_lidar_state != S_LIDAR_RUNNING || lidar_rate_req)
+		return -1;
+
+	COPY_POS(lidar_ignore_calib_pos, cur_pos);
+
+	for(int i=0; i<LIDAR_ANG_UNITS/32; i++)
+		lidar_ignore_calib[i] = 0;
+
+	// The first, partial revolution is fine: every sample counts.
+	lidar_ignore_calib_on = 1;
+	lidar_ignore_calib_scans = LIDAR_IGNORE_SCANS;
+	return 1;
+}
+
+/*
+	Call from the main loop once per acquired scan. When the revolutions are in, stops the motors and stores
+	the new mask in the flash settings (save_settings()).
+
+	Returns 1 while gathering (or idle), 0 when the mask was saved. Leaves the old mask as it was otherwise:
+	-2 if the lidar stopped, -3 if the robot moved, -4 if nothing was near enough to be masked.
+*/
+int lidar_ignore_calib_run()
+{
+	if(!lidar_ignore_calib_on)
+		return 1;
+
+	int ret;
+	int32_t dx = cur_pos.x - lidar_ignore_calib_pos.x;
+	int32_t dy = cur_pos.y - lidar_ignore_calib_pos.y;
+	int32_t da = (int32_t)((uint32_t)cur_pos.ang - (uint32_t)lidar_ignore_calib_pos.ang);
+	if(cur_lidar_state != S_LIDAR_RUNNING)
+		ret = -2;
+	else if(dx < -10 || dx > 10 || dy < -10 || dy > 10 || da < -ANG_1_DEG || da > ANG_1_DEG)
+		ret = -3;
+	else if(lidar_ignore_calib_scans)
+		return 1;
+	else
+	{
+		int any = 0;
+		for(int i=0; i<LIDAR_ANG_UNITS/32; i++)
+			any |= lidar_ignore_calib[i] != 0;
+
+		if(any)
+		{
+			for(int i=0; i<LIDAR_ANG_UNITS/32; i++)
+				settings.lidar_ignore[i] = lidar_ignore_calib[i];
+			settings.lidar_ignore_magic = LIDAR_IGNORE_MAGIC;
+			// The sector erase stalls everything running from flash, ISRs included, for hundreds of ms: stop the
+			// motors first (like before flashing), and give the motor controllers the time to get the stop.
+			// The robot stays stopped until the host sends the next command.
+			host_dead();
+			delay_ms(10);
+			save_settings();
+			ret = 0;
+		}
+		else
+			ret = -4;
+	}
+
+	lidar_ignore_calib_scans = 0;
+	lidar_ignore_calib_on = 0;
+	return ret;
+}
+
+
+/*
+	In the running state, the DMA ISR only checks each packet and queues it here, then pends PendSV:
+	lidar_process_inthandler() does the rest (filters, projection, micronavi) for as many packets as there are.
+	One producer (the DMA ISR) and one consumer (PendSV); each only writes its own index.
+
+	cnt counts all packets, failed ones included, so the ticks of the raw samples stay time. The projection uses
+	cur_pos when the packet is processed, normally right after the DMA ISR - PendSV only waits for the
+	higher-priority interrupts and the 10 kHz timebase handler.
+*/
+#define LIDAR_RING_LEN 64 // power of two
+
+typedef struct
+{
+	uint8_t sync;
+	uint16_t cnt;
+	uint16_t degper16;
+	uint16_t len; // cm
+} lidar_pkt_t;
+
+static volatile lidar_pkt_t lidar_ring[LIDAR_RING_LEN];
+static volatile uint32_t lidar_ring_head, lidar_ring_tail;
+static uint16_t lidar_pkt_cnt;
+static uint16_t lidar_scan_start_cnt;
+volatile int lidar_ring_overruns;
+
+static int chk_err_cnt;
+
+/*
+	Checks a 7-byte data packet and queues it for lidar_process_inthandler(). Returns 0 if there was nothing
+	to queue.
+*/
+static int lidar_queue_pkt(const uint8_t* p)
+{
+	lidar_pkt_cnt++; // Failed packets take their time, too.
+
+	int chk = (p[0]+p[1]+p[2]+p[3]+p[4]+p[5]) % 255;
+	if(chk != p[6] /*checksum fail*/ || (p[0]&0b11111110) /* any error bit*/)
+	{
+		chk_err_cnt+=20;
+
+		if(chk_err_cnt > 100)
+		{
+			// In the long run, 1/20th of the data is allowed to fail the checksum / error flag tests.
+			// In the short run, 5 successive samples are allowed to fail.
+			cur_lidar_state = S_LIDAR_ERROR;
+			lidar_error_code = LIDAR_ERR_CHKSUM_OR_ERRFLAGS;
+			lidar_error_flags = p[0];
+		}
+		// Else: just ignore this data.
+
+		return 0;
+	}
+
+	if(chk_err_cnt) chk_err_cnt--;
+
+	uint32_t head = lidar_ring_head;
+	if(head - lidar_ring_tail >= LIDAR_RING_LEN)
+	{
+		// lidar_process_inthandler() hasn't had the time to run for LIDAR_RING_LEN samples.
+		lidar_ring_overruns++;
+		return 0;
+	}
+
+	volatile lidar_pkt_t* pkt = &lidar_ring[head & (LIDAR_RING_LEN-1)];
+	pkt->sync = p[0]; // non-zero = sync. (error flags have been handled already)
+	pkt->cnt = lidar_pkt_cnt;
+	pkt->degper16 = (p[2]<<8) | p[1];
+	pkt->len = (p[4]<<8) | p[3];
+	lidar_ring_head = head+1;
+	return 1;
+}
+
+/*
+	Streaming acquisition (lidar_stream_on): instead of one 7-byte transfer (and one interrupt) per packet, the DMA
+	runs around lidar_dmabuf, interrupting at its half and its end, and lidar_fsm() pends PendSV every
+	LIDAR_DRAIN_MS in between so the samples don't wait for a half buffer. lidar_stream_parse() takes the packets
+	from where it left off to the DMA write position.
+
+	Packets can be anywhere in the buffer, so the parser checks the checksum of each 7 bytes it takes. If one
+	fails, the byte stream may have lost a byte: the failure is counted like in the packet mode, and the parser
+	then slides a byte at a time until 7 bytes make a valid packet again.
+
+	The buffer holds 36 packets, 33 ms at the highest sample rate.
+*/
+#define LIDAR_DMABUF_LEN 256 // power of two
+#define LIDAR_DRAIN_MS   4
+
+volatile int lidar_stream_on = 0; // Not validated on the robot yet. Takes effect at the next lidar_start_acq()
+
+static volatile uint8_t lidar_dmabuf[LIDAR_DMABUF_LEN] __attribute__((aligned(4)));
+static int lidar_streaming;
+static uint32_t lidar_dma_rd;
+static int lidar_dma_synced;
+static int lidar_dma_skipped;
+
+static void lidar_stream_parse()
+{
+	uint32_t wr = (LIDAR_DMABUF_LEN - DMA2_Stream2->NDTR) & (LIDAR_DMABUF_LEN-1);
+	uint32_t avail = (wr - lidar_dma_rd) & (LIDAR_DMABUF_LEN-1);
+
+	while(avail >= 7)
+	{
+		uint8_t p[7];
+		for(int i=0; i<7; i++)
+			p[i] = lidar_dmabuf[(lidar_dma_rd+i) & (LIDAR_DMABUF_LEN-1)];
+
+		int chk = (p[0]+p[1]+p[2]+p[3]+p[4]+p[5]) % 255;
+		int ok = chk == p[6];
+		// While searching, also require what a valid data packet looks like, to lock on a wrong offset less often.
+		if(!lidar_dma_synced && ok && ((p[0]&0b11111110) || ((p[2]<<8) | p[1]) >= 360*16))
+			ok = 0;
+
+		if(ok || lidar_dma_synced)
+		{
+			// In sync, a failing packet is counted (and may be a lost byte: search from the next one).
+			lidar_queue_pkt(p);
+			lidar_dma_synced = ok;
+			lidar_dma_skipped = 0;
+			lidar_dma_rd += ok ? 7 : 1;
+			avail -= ok ? 7 : 1;
+		}
+		else
+		{
+			lidar_dma_rd++;
+			avail--;
+			if(++lidar_dma_skipped == 7)
+			{
+				lidar_dma_skipped = 0;
+				lidar_pkt_cnt++;
+			}
+		}
+	}
+}
 
 int wait_ready_poll_cnt;
 
@@ -383,10 +877,12 @@ void lidar_fsm()
 	static int powerwait_cnt;
 	static int reconfwait_cnt;
 	static int errorwait_cnt;
+	static int drain_cnt;
 
 	if(cur_lidar_state != S_LIDAR_WAITPOWERED) powerwait_cnt = 0;
 	if(cur_lidar_state != S_LIDAR_RECONF) reconfwait_cnt = 0;
 	if(cur_lidar_state != S_LIDAR_ERROR) errorwait_cnt = 0;
+	if(cur_lidar_state != S_LIDAR_RUNNING) lidar_rate_req = 0;
 
 	switch(cur_lidar_state)
 	{
@@ -421,16 +917,47 @@ void lidar_fsm()
 				UART_DMA_TX();
 				// Data flow has surely stopped, and RX DMA has been happily shut down - we can reconfigure whatever we want.
 				// Configure everything again - since we were running just fine, the motor should be stable to accept the commands.
-				lidar_txbuf[0] = 'M';
-				lidar_txbuf[1] = 'I';
-				lidar_txbuf[2] = 10;
-				lidar_send_cmd(3, 5);
-				cur_lidar_state = S_LIDAR_PRECONF_CHECK_SPEED;
+				if(lidar_fps == lidar_run_fps)
+				{
+					// Only the sampling changes: no need to ask the speed.
+					lidar_txbuf[0] = 'L';
+					lidar_txbuf[1] = 'R';
+					lidar_txbuf[2] = '0';
+					lidar_txbuf[3] = '0'+lidar_smp;
+					lidar_txbuf[4] = 10;
+					cur_lidar_state = S_LIDAR_CONF_SAMPLING;
+					lidar_send_cmd(5, 9);
+				}
+				else
+				{
+					lidar_txbuf[0] = 'M';
+					lidar_txbuf[1] = 'I';
+					lidar_txbuf[2] = 10;
+					lidar_send_cmd(3, 5);
+					cur_lidar_state = S_LIDAR_PRECONF_CHECK_SPEED;
+				}
 			}
 
 		}
 		break;
 
+		case S_LIDAR_RUNNING:
+		{
+			if(lidar_rate_req)
+			{
+				lidar_rate_req = 0;
+				lidar_on(lidar_rate_req_fps, lidar_rate_req_smp);
+				break;
+			}
+
+			if(lidar_streaming && ++drain_cnt >= LIDAR_DRAIN_MS)
+			{
+				drain_cnt = 0;
+				SCB->ICSR = SCB_ICSR_PENDSVSET_Msk;
+			}
+		}
+		break;
+
 		case S_LIDAR_ERROR:
 		{
 			LIDAR_DIS(); // Turn it off, back on later.
@@ -503,14 +1030,10 @@ int dbg_prev_len;
 volatile int lidar_near_filter_on = 1;
 volatile int lidar_midlier_filter_on = 1;
 
-volatile int lidar_scan_ready;
-
 // Undocumented bug in Scanse Sweep: while the motor is stabilizing / calibrating, it also ignores the "Adjust LiDAR Sample rate" command (completely, no reply).
 
 void lidar_rx_done_inthandler()
 {
-	int starttime = TIM6->CNT;
-
 	DMA2->LIFCR = 0b111101UL<<16; // Clear DMA interrupt flags
 	USART1->SR = 0;
 
@@ -535,7 +1058,6 @@ void lidar_rx_done_inthandler()
 //	uart_print_string_blocking("|\r\n");
 
 
-	static int chk_err_cnt;
 	switch(cur_lidar_state)
 	{
 		case S_LIDAR_PRECONF_WAIT_READY:
@@ -683,6 +1205,8 @@ void lidar_rx_done_inthandler()
 				// Start data acquisition acknowledged OK. Reconfigure the DMA to circular doublebuffer without reconfig, to minimize time
 				// spent in this ISR in the RUNNING state.
 				lidar_start_acq();
+				lidar_run_fps = lidar_fps;
+				lidar_run_status = LIDAR_STATUS_MODE(lidar_fps, lidar_smp);
 				cur_lidar_state = S_LIDAR_RUNNING;
 				chk_err_cnt = 0;
 			}
@@ -700,257 +1224,274 @@ void lidar_rx_done_inthandler()
 
    dbg_teleportation_bug(301);
 
-			int buf_idx = (DMA2_Stream2->CR&(1UL<<19))?0:1; // We want to read the previous buffer, not the one the DMA is now writing to.
-			// Actual data packet is 7 bytes of binary instead of ASCII.
-			int chk = (lidar_rxbuf[buf_idx][0]+lidar_rxbuf[buf_idx][1]+lidar_rxbuf[buf_idx][2]+
-				  lidar_rxbuf[buf_idx][3]+lidar_rxbuf[buf_idx][4]+lidar_rxbuf[buf_idx][5]) % 255;
-			if(chk != lidar_rxbuf[buf_idx][6] /*checksum fail*/ || (lidar_rxbuf[buf_idx][0]&0b11111110) /* any error bit*/)
+			if(lidar_streaming)
 			{
-				chk_err_cnt+=20;
-
-				if(chk_err_cnt > 100)
-				{
-					// In the long run, 1/20th of the data is allowed to fail the checksum / error flag tests.
-					// In the short run, 5 successive samples are allowed to fail.
-					cur_lidar_state = S_LIDAR_ERROR;
-					lidar_error_code = LIDAR_ERR_CHKSUM_OR_ERRFLAGS;
-					lidar_error_flags = lidar_rxbuf[buf_idx][0];
-				}
-				// Else: just ignore this data.
-
+				// Half of lidar_dmabuf filled: lidar_stream_parse() finds the packets.
+				SCB->ICSR = SCB_ICSR_PENDSVSET_Msk;
 				break;
 			}
 
-			if(chk_err_cnt) chk_err_cnt--;
-			if(lidar_rxbuf[buf_idx][0]) // non-zero = sync. (error flags have been handled already)
-			{
+			int buf_idx = (DMA2_Stream2->CR&(1UL<<19))?0:1; // We want to read the previous buffer, not the one the DMA is now writing to.
+			if(lidar_queue_pkt(lidar_rxbuf[buf_idx]))
+				SCB->ICSR = SCB_ICSR_PENDSVSET_Msk;
+		}
+		break;
 
-				acq_lidar_scan->n_points = lidar_cur_n_samples;
-				COPY_POS(acq_lidar_scan->pos_at_end, cur_pos);
-				lidar_scan_t* swptmp;
-				swptmp = prev_lidar_scan;
-				prev_lidar_scan = acq_lidar_scan;
-				acq_lidar_scan = swptmp;
-				lidar_scan_ready = 1;
-				COPY_POS(acq_lidar_scan->pos_at_start, cur_pos);
-				// Right now, refxy is simply the robot pose at the start of the scan.
-				acq_lidar_scan->refxy.x = cur_pos.x;
-				acq_lidar_scan->refxy.y = cur_pos.y;
-				lidar_cur_n_samples = 0;
-				acq_lidar_scan->id = cur_lidar_id;
-				acq_lidar_scan->status = 0;
-				acq_lidar_scan->n_points = 0;
-			}
 
-			if(lidar_cur_n_samples > LIDAR_MAX_POINTS-1)
-			{
-				break; // Ignore excess data - wait for the sync data.
-			}
+		default:
+		break;
 
+	}
+}
 
-			// optimization todo: we are little endian like the sensor: align rxbuf properly and directly access as uint16
-			int32_t degper16 = (lidar_rxbuf[buf_idx][2]<<8) | lidar_rxbuf[buf_idx][1];
-			int32_t len      = (lidar_rxbuf[buf_idx][4]<<8) | lidar_rxbuf[buf_idx][3];
-			//int snr      = lidar_rxbuf[buf_idx][5];
-			/*
-				Filtering low-snr results was tested:
-				Seems useless. When high-noise near-field results are looked at, snr thresholding seems to reduce
-				the number of points quite a bit, but mostly in the middle; the worst case wrong points are still there!
-				So, having a high number of noisy points is better. -> no snr-based filtering
-			*/
+// One queued packet, in the order they came.
+static void lidar_process_pkt(lidar_pkt_t* pkt)
+{
+	int32_t tick = (uint16_t)(pkt->cnt - lidar_scan_start_cnt);
+	if(pkt->sync)
+	{
+		lidar_tick = tick;
+		if(lidar_ignore_calib_scans)
+			lidar_ignore_calib_scans--;
+		acq_lidar_scan->n_points = lidar_cur_n_samples;
+		COPY_POS(acq_lidar_scan->pos_at_end, cur_pos);
+		lidar_record_pose(acq_lidar_raw);
+		lidar_publish_scan();
+		acq_lidar_raw = &lidar_raws[acq_lidar_scan - lidar_scans];
+		acq_lidar_scan->status = lidar_run_status;
+		acq_lidar_scan->version = LIDAR_SCAN_VERSION;
+		lidar_apply_pending_corr();
+		COPY_POS(acq_lidar_scan->pos_at_start, cur_pos);
+		// Right now, refxy is simply the robot pose at the start of the scan.
+		acq_lidar_scan->refxy.x = cur_pos.x;
+		acq_lidar_scan->refxy.y = cur_pos.y;
+		lidar_cur_n_samples = 0;
+		acq_lidar_scan->id = cur_lidar_id;
+		acq_lidar_scan->n_points = 0;
+		acq_lidar_raw->n_poses = 0;
+		lidar_scan_start_cnt = pkt->cnt;
+		lidar_tick = 0;
+		lidar_record_pose(acq_lidar_raw);
+	}
+	else
+	{
+		int32_t prev_tick = lidar_tick;
+		lidar_tick = tick;
+		// Failed packets take their time, too: tick may have skipped over the pose recording point.
+		if((tick & ~(LIDAR_POSE_EVERY-1)) != (prev_tick & ~(LIDAR_POSE_EVERY-1)))
+			lidar_record_pose(acq_lidar_raw);
+	}
 
-			/*
-				Remove "midliers", erroneous average points between two readings:
+	if(lidar_cur_n_samples > LIDAR_MAX_POINTS-1)
+	{
+		return; // Ignore excess data - wait for the sync data.
+	}
 
-				#############################################
 
-				                      <-- at least 25cm gap
+	int32_t degper16 = pkt->degper16;
+	int32_t len      = pkt->len;
 
-				                 .    <-- midlier
+	if(degper16 >= LIDAR_ANG_UNITS)
+		return;
 
-				                      <-- at least 25cm gap
+	// "1 cm" is no signal; the robot itself is near enough to be seen.
+	if(lidar_ignore_calib_scans && len > 1)
+		lidar_ignore_calib_sample(degper16, len*10);
+	//int snr      = lidar_rxbuf[buf_idx][5];
+	/*
+		Filtering low-snr results was tested:
+		Seems useless. When high-noise near-field results are looked at, snr thresholding seems to reduce
+		the number of points quite a bit, but mostly in the middle; the worst case wrong points are still there!
+		So, having a high number of noisy points is better. -> no snr-based filtering
+	*/
 
-				##################
+	/*
+		Remove "midliers", erroneous average points between two readings:
 
+		#############################################
 
-				                   O
+		                      <-- at least 25cm gap
 
-			*/
+		                 .    <-- midlier
 
-			if(len < 20)
-			{
-				// "1 cm" signifies no signal. "0 cm" is undefined.
-				// Points too near are garbage anyway, just ignore them and hope that a small obstacle near
-				// the front is not unseen by this.
-				break;
-			}
+		                      <-- at least 25cm gap
 
-			#define MIDLIER_LEN 25 // in cm
-			if(lidar_midlier_filter_on)
-			{
+		##################
 
-				static int midlier_prev3_len, midlier_prev2_len, midlier_prev_len;
 
-				if(midlier_prev2_len > 1 && midlier_prev_len > 1 && len > 1)  //  -VxV       -=invalid, V=valid, x=potential midlier
-				{
-					if( (midlier_prev_len > midlier_prev2_len+MIDLIER_LEN && midlier_prev_len < len-MIDLIER_LEN) ||
-					    (midlier_prev_len < midlier_prev2_len-MIDLIER_LEN && midlier_prev_len > len+MIDLIER_LEN))
-					{
-						// Remove (overwrite) the previous point as a midlier.
-						if(lidar_cur_n_samples) lidar_cur_n_samples--;
-					}
-				}
-				else if(midlier_prev3_len > 1 && midlier_prev_len > 1 && len > 1)  // V-xV
-				{
-					if( (midlier_prev_len > midlier_prev3_len+MIDLIER_LEN && midlier_prev_len < len-MIDLIER_LEN) ||
-					    (midlier_prev_len < midlier_prev3_len-MIDLIER_LEN && midlier_prev_len > len+MIDLIER_LEN))
-					{
-						// Remove (overwrite) the previous point as a midlier.
-						if(lidar_cur_n_samples) lidar_cur_n_samples--;
-					}
-				}
-				else if(midlier_prev3_len > 1 && midlier_prev2_len > 1 && midlier_prev_len > 1) // VxV-
-				{
-					if( (midlier_prev2_len > midlier_prev3_len+MIDLIER_LEN && midlier_prev2_len < midlier_prev_len-MIDLIER_LEN) ||
-					    (midlier_prev2_len < midlier_prev3_len-MIDLIER_LEN && midlier_prev2_len > midlier_prev_len+MIDLIER_LEN))
-					{
-						// Remove the point before the previous point as a midlier.
-						if(lidar_cur_n_samples > 1)
-						{
-							acq_lidar_scan->scan[lidar_cur_n_samples-2].x = acq_lidar_scan->scan[lidar_cur_n_samples-1].x;
-							acq_lidar_scan->scan[lidar_cur_n_samples-2].y = acq_lidar_scan->scan[lidar_cur_n_samples-1].y;
-							lidar_cur_n_samples--;
-						}
-					}
-				}
-				else if(midlier_prev3_len > 1 && midlier_prev2_len > 1 && len > 1) // Vx-V
-				{
-					if( (midlier_prev2_len > midlier_prev3_len+MIDLIER_LEN && midlier_prev2_len < len-MIDLIER_LEN) ||
-					    (midlier_prev2_len < midlier_prev3_len-MIDLIER_LEN && midlier_prev2_len > len+MIDLIER_LEN))
-					{
-						// Remove the point before the previous point as a midlier.
-						if(lidar_cur_n_samples > 1)
-						{
-							acq_lidar_scan->scan[lidar_cur_n_samples-2].x = acq_lidar_scan->scan[lidar_cur_n_samples-1].x;
-							acq_lidar_scan->scan[lidar_cur_n_samples-2].y = acq_lidar_scan->scan[lidar_cur_n_samples-1].y;
-							lidar_cur_n_samples--;
-						}
-					}
-				}
+		                   O
 
-				midlier_prev3_len = midlier_prev2_len;
-				midlier_prev2_len = midlier_prev_len;
-				midlier_prev_len = len;
+	*/
 
-			}
+	if(len < 20)
+	{
+		// "1 cm" signifies no signal. "0 cm" is undefined.
+		// Points too near are garbage anyway, just ignore them and hope that a small obstacle near
+		// the front is not unseen by this.
+		return;
+	}
+
+	#define MIDLIER_LEN 25 // in cm
+	if(lidar_midlier_filter_on)
+	{
+
+		static int midlier_prev3_len, midlier_prev2_len, midlier_prev_len;
 
-			for(int i=0; i<N_IGNORE_AREAS; i++)
+		if(midlier_prev2_len > 1 && midlier_prev_len > 1 && len > 1)  //  -VxV       -=invalid, V=valid, x=potential midlier
+		{
+			if( (midlier_prev_len > midlier_prev2_len+MIDLIER_LEN && midlier_prev_len < len-MIDLIER_LEN) ||
+			    (midlier_prev_len < midlier_prev2_len-MIDLIER_LEN && midlier_prev_len > len+MIDLIER_LEN))
+			{
+				// Remove (overwrite) the previous point as a midlier.
+				if(lidar_cur_n_samples) lidar_cur_n_samples--;
+			}
+		}
+		else if(midlier_prev3_len > 1 && midlier_prev_len > 1 && len > 1)  // V-xV
+		{
+			if( (midlier_prev_len > midlier_prev3_len+MIDLIER_LEN && midlier_prev_len < len-MIDLIER_LEN) ||
+			    (midlier_prev_len < midlier_prev3_len-MIDLIER_LEN && midlier_prev_len > len+MIDLIER_LEN))
+			{
+				// Remove (overwrite) the previous point as a midlier.
+				if(lidar_cur_n_samples) lidar_cur_n_samples--;
+			}
+		}
+		else if(midlier_prev3_len > 1 && midlier_prev2_len > 1 && midlier_prev_len > 1) // VxV-
+		{
+			if( (midlier_prev2_len > midlier_prev3_len+MIDLIER_LEN && midlier_prev2_len < midlier_prev_len-MIDLIER_LEN) ||
+			    (midlier_prev2_len < midlier_prev3_len-MIDLIER_LEN && midlier_prev2_len > midlier_prev_len+MIDLIER_LEN))
 			{
-				if(degper16 > ignore_areas[i].start && degper16 < ignore_areas[i].end)
+				// Remove the point before the previous point as a midlier.
+				if(lidar_cur_n_samples > 1)
 				{
-					goto IGNORE_SAMPLE;
+					acq_lidar_scan->scan[lidar_cur_n_samples-2].x = acq_lidar_scan->scan[lidar_cur_n_samples-1].x;
+					acq_lidar_scan->scan[lidar_cur_n_samples-2].y = acq_lidar_scan->scan[lidar_cur_n_samples-1].y;
+					acq_lidar_raw->samples[lidar_cur_n_samples-2] = acq_lidar_raw->samples[lidar_cur_n_samples-1];
+					lidar_cur_n_samples--;
 				}
 			}
+		}
+		else if(midlier_prev3_len > 1 && midlier_prev2_len > 1 && len > 1) // Vx-V
+		{
+			if( (midlier_prev2_len > midlier_prev3_len+MIDLIER_LEN && midlier_prev2_len < len-MIDLIER_LEN) ||
+			    (midlier_prev2_len < midlier_prev3_len-MIDLIER_LEN && midlier_prev2_len > len+MIDLIER_LEN))
+			{
+				// Remove the point before the previous point as a midlier.
+				if(lidar_cur_n_samples > 1)
+				{
+					acq_lidar_scan->scan[lidar_cur_n_samples-2].x = acq_lidar_scan->scan[lidar_cur_n_samples-1].x;
+					acq_lidar_scan->scan[lidar_cur_n_samples-2].y = acq_lidar_scan->scan[lidar_cur_n_samples-1].y;
+					acq_lidar_raw->samples[lidar_cur_n_samples-2] = acq_lidar_raw->samples[lidar_cur_n_samples-1];
+					lidar_cur_n_samples--;
+				}
+			}
+		}
 
-			len *= 10; // cm --> mm
+		midlier_prev3_len = midlier_prev2_len;
+		midlier_prev2_len = midlier_prev_len;
+		midlier_prev_len = len;
 
-			/*
-				Data of nearby points is very noisy, and gets noisier the nearer we see. In addition,
-				we don't need so many points packed near each other -> average them together.
-			*/
+	}
 
-			int flt_len;
-			static int prev_len, prev2_len, prev3_len, skip_averaging;
+	if(LIDAR_IGNORED(settings.lidar_ignore, degper16))
+		return;
 
-			if(lidar_near_filter_on && skip_averaging == 0)
-			{
-				if(len < 600 && (prev_len < 600 || prev2_len < 600 || prev3_len < 600))
-				{
-					// Average the four:
-					flt_len = (len + prev_len + prev2_len + prev3_len)>>2;
+	len *= 10; // cm --> mm
 
-					// Overwrite the previous, 4->1
-					if(lidar_cur_n_samples > 2) lidar_cur_n_samples-=3;
-					skip_averaging = 3;
-				}
-				else if(len < 800 && (prev_len < 800 || prev2_len < 800))
-				{
-					// Average the three:
-					flt_len = (len + prev_len + prev2_len)/3;
+	/*
+		Data of nearby points is very noisy, and gets noisier the nearer we see. In addition,
+		we don't need so many points packed near each other -> average them together.
+	*/
 
-					// Overwrite the previous, 3->1
-					if(lidar_cur_n_samples > 1) lidar_cur_n_samples-=2;
-					skip_averaging = 2;
-				}
-				else if(len < 1100)
-				{
-					// Average the two.
-					flt_len = (len+prev_len)>>1;
-					// 2->1
-					if(lidar_cur_n_samples) lidar_cur_n_samples--;
-					skip_averaging = 1;
-				}
-				else
-				{
-					flt_len = len;
-					if(skip_averaging) skip_averaging--;
-				}
-			}
-			else
-			{
-				flt_len = len;
-				if(skip_averaging) skip_averaging--;
-			}
+	int flt_len;
+	static int prev_len, prev2_len, prev3_len, skip_averaging;
 
-			prev3_len = prev2_len;
-			prev2_len = prev_len;
-			prev_len = len;
+	if(lidar_near_filter_on && skip_averaging == 0)
+	{
+		if(len < 600 && (prev_len < 600 || prev2_len < 600 || prev3_len < 600))
+		{
+			// Average the four:
+			flt_len = (len + prev_len + prev2_len + prev3_len)>>2;
 
+			// Overwrite the previous, 4->1
+			if(lidar_cur_n_samples > 2) lidar_cur_n_samples-=3;
+			skip_averaging = 3;
+		}
+		else if(len < 800 && (prev_len < 800 || prev2_len < 800))
+		{
+			// Average the three:
+			flt_len = (len + prev_len + prev2_len)/3;
 
-			#ifdef PROD1
-				uint32_t ang32 = (uint32_t)cur_pos.ang + ANG_180_DEG - degper16*ANG_1PER16_DEG;
-			#else
-				uint32_t ang32 = (uint32_t)cur_pos.ang - degper16*ANG_1PER16_DEG;
-			#endif
-			int32_t y_idx = (ang32)>>SIN_LUT_SHIFT;
-			int32_t x_idx = (1073741824-ang32)>>SIN_LUT_SHIFT;
+			// Overwrite the previous, 3->1
+			if(lidar_cur_n_samples > 1) lidar_cur_n_samples-=2;
+			skip_averaging = 2;
+		}
+		else if(len < 1100)
+		{
+			// Average the two.
+			flt_len = (len+prev_len)>>1;
+			// 2->1
+			if(lidar_cur_n_samples) lidar_cur_n_samples--;
+			skip_averaging = 1;
+		}
+		else
+		{
+			flt_len = len;
+			if(skip_averaging) skip_averaging--;
+		}
+	}
+	else
+	{
+		flt_len = len;
+		if(skip_averaging) skip_averaging--;
+	}
 
-			int32_t x = cur_pos.x + (((int32_t)sin_lut[x_idx] * (int32_t)flt_len)>>15) - acq_lidar_scan->refxy.x;
-			int32_t y = cur_pos.y + (((int32_t)sin_lut[y_idx] * (int32_t)flt_len)>>15) - acq_lidar_scan->refxy.y;
+	prev3_len = prev2_len;
+	prev2_len = prev_len;
+	prev_len = len;
 
-			if(x < -30000 || x > 30000 || y < -30000 || y > 30000)
-				break;
 
-			acq_lidar_scan->scan[lidar_cur_n_samples].x = x;
-			acq_lidar_scan->scan[lidar_cur_n_samples].y = y;
-			
-			lidar_cur_n_samples++;
-
-
-			#ifdef PROD1
-				uint32_t ang32_robot_frame = ANG_180_DEG - degper16*ANG_1PER16_DEG;
-			#else
-				uint32_t ang32_robot_frame = -1*degper16*ANG_1PER16_DEG;
-			#endif
-			int32_t y_idx_robot_frame = (ang32_robot_frame)>>SIN_LUT_SHIFT;
-			int32_t x_idx_robot_frame = (1073741824-ang32_robot_frame)>>SIN_LUT_SHIFT;
-			int32_t x_robot_frame =	((int32_t)sin_lut[x_idx_robot_frame] * (int32_t)flt_len)>>15;
-			int32_t y_robot_frame =	((int32_t)sin_lut[y_idx_robot_frame] * (int32_t)flt_len)>>15;
-			micronavi_point_in(x_robot_frame, y_robot_frame, 150, 1, 0);
-   dbg_teleportation_bug(302);
+	if(lidar_project(cur_pos.ang, cur_pos.x, cur_pos.y, degper16, flt_len, &acq_lidar_scan->refxy,
+	   &acq_lidar_scan->scan[lidar_cur_n_samples]))
+		return;
 
+	lidar_raw_sample_t* raw = &acq_lidar_raw->samples[lidar_cur_n_samples];
+	raw->degper16 = degper16;
+	raw->len = flt_len;
+	raw->tick = lidar_tick;
 
-			IGNORE_SAMPLE: break;
-		}
-		break;
+	lidar_cur_n_samples++;
 
 
-		default:
-		break;
+	#ifdef PROD1
+		uint32_t ang32_robot_frame = ANG_180_DEG - degper16*ANG_1PER16_DEG;
+	#else
+		uint32_t ang32_robot_frame = -1*degper16*ANG_1PER16_DEG;
+	#endif
+	int32_t y_idx_robot_frame = (ang32_robot_frame)>>SIN_LUT_SHIFT;
+	int32_t x_idx_robot_frame = (1073741824-ang32_robot_frame)>>SIN_LUT_SHIFT;
+	int32_t x_robot_frame =	((int32_t)sin_lut[x_idx_robot_frame] * (int32_t)flt_len)>>15;
+	int32_t y_robot_frame =	((int32_t)sin_lut[y_idx_robot_frame] * (int32_t)flt_len)>>15;
+	micronavi_point_in(x_robot_frame, y_robot_frame, 150, 1, 0);
+   dbg_teleportation_bug(302);
+}
 
-	}
+/*
+	PendSV: drains the packets lidar_rx_done_inthandler() or lidar_stream_parse() queued. At the priority of the 10 kHz
+	timebase, so the gyro, motor controller and UART interrupts go before the sample processing, and the timebase and
+	this never preempt each other: both call micronavi_point_in().
+*/
+void lidar_process_inthandler()
+{
+	if(lidar_streaming)
+		lidar_stream_parse();
 
-	int tooktime = TIM6->CNT - starttime;
+	uint32_t tail = lidar_ring_tail;
+	while(tail != lidar_ring_head)
+	{
+		lidar_pkt_t pkt = lidar_ring[tail & (LIDAR_RING_LEN-1)];
+		lidar_ring_tail = ++tail;
+		lidar_process_pkt(&pkt);
+	}
 }
 
 /*
@@ -980,6 +1521,7 @@ void lidar_send_cmd(int tx_len, int rx_len)
 	{
 		rx_dma_off();
 		// Configure for RX:
+		DMA2_Stream2->M0AR = (uint32_t)(lidar_rxbuf[0]); // lidar_start_acq() may have changed it
 		DMA2_Stream2->CR = 4UL<<25 /*Channel*/ | 0b01UL<<16 /*med prio*/ | 0b00UL<<13 /*8-bit mem*/ | 0b00UL<<11 /*8-bit periph*/ |
 			           1UL<<10 /*mem increment*/ | 0b00UL<<6 /*periph-to-memory*/ | 1UL<<4 /*transfer complete interrupt*/;
 		DMA2_Stream2->NDTR = rx_len;
@@ -1016,12 +1558,30 @@ void lidar_send_cmd(int tx_len, int rx_len)
 */
 void lidar_start_acq()
 {
-	DMA2_Stream2->CR = 4UL<<25 /*Channel*/ | 1UL<<18 /*Double Buf mode*/ | 0b01UL<<16 /*med prio*/ | 
-			   0b00UL<<13 /*8-bit mem*/ | 0b00UL<<11 /*8-bit periph*/ |
-	                   1UL<<10 /*mem increment*/ | 1UL<<8 /*circular*/ | 1UL<<4 /*transfer complete interrupt*/;  // Disable
+	lidar_streaming = lidar_stream_on;
+	if(lidar_streaming)
+	{
+		lidar_dma_rd = 0;
+		lidar_dma_synced = 0;
+		lidar_dma_skipped = 0;
+		DMA2_Stream2->M0AR = (uint32_t)(lidar_dmabuf);
+		DMA2_Stream2->CR = 4UL<<25 /*Channel*/ | 0b01UL<<16 /*med prio*/ |
+				   0b00UL<<13 /*8-bit mem*/ | 0b00UL<<11 /*8-bit periph*/ |
+				   1UL<<10 /*mem increment*/ | 1UL<<8 /*circular*/ | 1UL<<4 /*transfer complete interrupt*/ | 1UL<<3 /*half transfer interrupt*/;
+
+		DMA2_Stream2->NDTR = LIDAR_DMABUF_LEN;
+		dbg_prev_len = LIDAR_DMABUF_LEN;
+	}
+	else
+	{
+		DMA2_Stream2->M0AR = (uint32_t)(lidar_rxbuf[0]);
+		DMA2_Stream2->CR = 4UL<<25 /*Channel*/ | 1UL<<18 /*Double Buf mode*/ | 0b01UL<<16 /*med prio*/ | 
+				   0b00UL<<13 /*8-bit mem*/ | 0b00UL<<11 /*8-bit periph*/ |
+		                   1UL<<10 /*mem increment*/ | 1UL<<8 /*circular*/ | 1UL<<4 /*transfer complete interrupt*/;  // Disable
 
-	DMA2_Stream2->NDTR = 7;
-	dbg_prev_len = 7;
+		DMA2_Stream2->NDTR = 7;
+		dbg_prev_len = 7;
+	}
 
 	USART1->SR = 0;
 	USART1->CR3 |= (1UL<<7);
@@ -1032,7 +1592,13 @@ void lidar_start_acq()
 void init_lidar()
 {
 	acq_lidar_scan = &lidar_scans[0];
-	prev_lidar_scan = &lidar_scans[1];
+	lidar_ready_idx = 1;
+	lidar_held_idx = 2;
+	acq_lidar_raw = &lidar_raws[0];
+	for(int i = 0; i < LIDAR_N_SCANS; i++)
+		lidar_scans[i].version = LIDAR_SCAN_VERSION;
+	if(settings.lidar_ignore_magic != LIDAR_IGNORE_MAGIC)
+		lidar_default_ignore();
 	// USART1 (lidar) = APB2 = 60 MHz
 	// 16x oversampling
 	// 115200bps -> Baudrate register = 32.5625 = 32 9/16
@@ -1056,6 +1622,7 @@ void init_lidar()
 	cur_lidar_state = S_LIDAR_OFF;
 	NVIC_SetPriority(DMA2_Stream2_IRQn, 0b0101);
 	NVIC_EnableIRQ(DMA2_Stream2_IRQn);
+	NVIC_SetPriority(PendSV_IRQn, 0b1010); // lidar_process_inthandler(): same as the timebase, see there
 	tx_dma_off();
 	rx_dma_off();
 }
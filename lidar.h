@@ -4,12 +4,12 @@
 #include <stdint.h>
 #include "feedbacks.h" // for pos_t
 
-typedef struct
-{
-	int valid;
-	int32_t x;
-	int32_t y;
-} point_t;
+// Scan matcher (lidar_corr.c) state is per thread in the host build, so that host/sweep.c can run matches in parallel.
+#ifdef LIDAR_CORR_THREADS
+#define CORR_TLS __thread
+#else
+#define CORR_TLS
+#endif
 
 typedef struct
 {
@@ -23,6 +23,31 @@ typedef struct
 	int16_t y;
 } xy_i16_t;
 
+/*
+	Point images used by the scan matcher and the collision avoidance.
+
+	x and y are in separate int16 arrays, so that the kernels can load the coordinates of neighbouring
+	points two at a time (or eight at a time with SSE in the host build). Validness is a bitmask.
+
+	Invalid points have their coordinates parked at IMG_FAR, further away from any valid point (which are
+	within +/- IMG_COORD_MAX) than any distance the matchers look at, but close enough that the differences
+	still fit in int16: the nearest-point searches don't need to test validness at all.
+*/
+#define IMG_MAX_POINTS 360
+#define IMG_COORD_MAX  8000
+#define IMG_FAR        12288
+
+typedef struct
+{
+	int16_t x[IMG_MAX_POINTS];
+	int16_t y[IMG_MAX_POINTS];
+	uint32_t valid[(IMG_MAX_POINTS+31)/32];
+} img_t;
+
+#define IMG_VALID(img, i) ((img)->valid[(i)>>5] & (1UL<<((i)&31)))
+#define IMG_SET_VALID(img, i) do{ (img)->valid[(i)>>5] |= 1UL<<((i)&31); } while(0)
+#define IMG_SET_INVALID(img, i) do{ (img)->valid[(i)>>5] &= ~(1UL<<((i)&31)); (img)->x[i] = IMG_FAR; (img)->y[i] = IMG_FAR; } while(0)
+
 
 #if defined(RN1P4) || defined(RN1P6) || defined(RN1P7)
 	#define LIDAR_IGNORE_LEN 350 // mm, everything below this is marked in ignore list during ignore scan.
@@ -32,6 +57,10 @@ typedef struct
 	#define LIDAR_IGNORE_LEN 250
 	#define LIDAR_IGNORE_LEN_FRONT 120
 #endif
+#ifdef PROD1
+	#define LIDAR_IGNORE_LEN 300
+	#define LIDAR_IGNORE_LEN_FRONT 150
+#endif
 
 /*
 Lidar scan to be transferred to the host computer.
@@ -44,14 +73,23 @@ Make sure the alignment doesn't break when adding/removing variables.
 
 #define LIDAR_MAX_POINTS 720
 
+// 1 = the original layout: no version, corr or corr_cov (pos_at_end was followed by refxy)
+#define LIDAR_SCAN_VERSION 2
+
 typedef struct __attribute__((packed)) __attribute__((aligned(4)))
 {
 	uint8_t status;
 	uint8_t id;
 	int16_t n_points;
+	uint32_t version;   // LIDAR_SCAN_VERSION, so that the host can tell the layout
 	pos_t pos_at_start;
 	pos_t pos_at_end;
 
+	// Live matcher correction applied to the robot pose right before pos_at_start, as given by the matcher
+	// (before weighing, see correct_location_without_moving()), and its covariance. Valid with LIVELIDAR_CORR_APPLIED.
+	pos_t corr;
+	corr_cov_t corr_cov;
+
 	/*
 		All scan points are referenced to refxy instead of the world origin.
 		This has the following benefits:
@@ -67,11 +105,16 @@ typedef struct __attribute__((packed)) __attribute__((aligned(4)))
 	xy_i16_t scan[LIDAR_MAX_POINTS];
 } lidar_scan_t;
 
-#define LIDAR_SIZEOF(scan) (1+1+2+2*sizeof(pos_t)+sizeof(xy_i32_t)+sizeof(xy_i16_t)*((scan).n_points))
+#define LIDAR_SIZEOF(scan) (1+1+2+4+3*sizeof(pos_t)+sizeof(corr_cov_t)+sizeof(xy_i32_t)+sizeof(xy_i16_t)*((scan).n_points))
 
-extern lidar_scan_t lidar_scans[2];
+#define LIDAR_N_SCANS 3
+
+extern lidar_scan_t lidar_scans[LIDAR_N_SCANS];
 extern lidar_scan_t *acq_lidar_scan;
-extern lidar_scan_t *prev_lidar_scan;
+
+int lidar_scan_published();
+lidar_scan_t* lidar_acquire_scan(uint32_t* seq);
+extern volatile uint32_t lidar_scans_dropped;
 
 extern int lidar_cur_n_samples;
 
@@ -114,15 +157,48 @@ extern uint8_t lidar_error_flags;
 extern lidar_error_t lidar_error_code;
 
 
-#define LIVELIDAR_INVALID 1
+// lidar_scan_t status bits
+#define LIVELIDAR_INVALID 1      // Robot pose jumped during the scan (unexpected movement, collision)
+#define LIVELIDAR_CORR_APPLIED 2 // corr, corr_cov are valid
+#define LIDAR_REPROJECTED 4      // scan[] and the poses have been redone by lidar_reproject()
+// Bits 3..5: motor rate (Hz), bits 6..7: sample rate code (1..3) the scan was taken at, as given to lidar_on()
+#define LIDAR_STATUS_MODE(fps, smp) (((fps)<<3) | ((smp)<<6))
+#define LIDAR_STATUS_FPS(status) (((status)>>3) & 7)
+#define LIDAR_STATUS_SMP(status) (((status)>>6) & 3)
+
+/*
+	The raw samples of a scan, kept next to it (lidar_raws[i] belongs to lidar_scans[i]) so that the points can
+	be projected again with a corrected pose trajectory, see lidar_reproject(). samples[i] is scan[i]: they are
+	filtered together.
+
+	The ticks count the data packets since the start of the scan; the sensor sends them at a constant rate, so
+	they are time. poses[] is a ring of the robot pose every LIDAR_POSE_EVERY ticks, plus one at both ends of
+	the scan. At 1000 samples per second, the ring covers a full revolution down to 1 Hz.
+*/
+#define LIDAR_POSE_RING  32
+#define LIDAR_POSE_EVERY 32 // ticks, power of two
+
+typedef struct __attribute__((packed))
+{
+	uint16_t degper16; // Sensor angle, 1/16 deg
+	uint16_t len;      // mm, after the near filter
+	uint16_t tick;
+} lidar_raw_sample_t;
 
 typedef struct
 {
-	int status;
-	int id;
-	pos_t pos[90]; // Each four points share the same position.
-	int16_t scan[360];
-} live_lidar_scan_t;
+	pos_t pos;
+	int32_t tick;
+} lidar_raw_pose_t;
+
+typedef struct
+{
+	int n_poses; // Recorded during the scan; the ring keeps the last LIDAR_POSE_RING
+	lidar_raw_pose_t poses[LIDAR_POSE_RING];
+	lidar_raw_sample_t samples[LIDAR_MAX_POINTS];
+} lidar_raw_t;
+
+extern lidar_raw_t lidar_raws[LIDAR_N_SCANS];
 
 
 void init_lidar();
@@ -130,9 +206,11 @@ void deinit_lidar();
 
 void lidar_on(int fps, int smp);
 void lidar_off();
+void lidar_auto_rate(lidar_scan_t* scan, int uart_bytes);
 void lidar_fsm();
 
-void generate_lidar_ignore();
+int generate_lidar_ignore();
+int lidar_ignore_calib_run();
 void copy_lidar_half1(int16_t* dst_start);
 void copy_lidar_half2(int16_t* dst_start);
 void copy_lidar_full(int16_t* dst_start);
@@ -148,10 +226,24 @@ void lidar_fsm();
 void set_lidar_id(int id);
 
 void lidar_mark_invalid();
+int lidar_correct_pose(pos_t* mid, pos_t* corr, corr_cov_t* cov);
+int lidar_scan_corr_seq(lidar_scan_t* scan);
 
-extern point_t lidar_collision_avoidance[360];
+extern img_t lidar_collision_avoidance;
 
 extern volatile int lidar_near_filter_on;
 extern volatile int lidar_midlier_filter_on;
+extern volatile int lidar_ring_overruns;
+extern volatile int lidar_stream_on;
+extern volatile int lidar_auto_rate_on;
+
+// What the main loop sends of each scan, set by the host (0x8b):
+#define LIDAR_UART_POINTS 0 // lidar_scan_t
+#define LIDAR_UART_SEGS   1 // lidar_segs_t
+#define LIDAR_UART_BOTH   2
+#define LIDAR_UART_PACKED 3 // lidar_pack_t instead of the lidar_scan_t, unless the raw one is smaller
+#define LIDAR_UART_PACKED_SEGS 4
+
+extern volatile int lidar_uart_mode; // in lidar_segs.c
 
 #endif
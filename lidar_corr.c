@@ -17,19 +17,38 @@
 #include "comm.h"
 #include "uart.h"
 
+#ifdef LIDAR_CORR_TUNE
+CORR_TLS lidar_corr_tune_t lidar_corr_tune = {1200, 3200, 800, 800, 100, 1};
+#define TUNE(name, def) (lidar_corr_tune.name)
+#else
+#define TUNE(name, def) (def)
+#endif
+
 extern volatile int dbg[10];
 extern volatile int dbg_error_num;
 
-int latest_corr_ret;
-pos_t latest_corr;
+CORR_TLS int latest_corr_ret;
+CORR_TLS pos_t latest_corr;
 
 
 #define LIDAR_RANGE 5000
+
 #define sq(x) ((x)*(x))
 
+// sin_lut lookup (Q15, a: 2^32 per turn), interpolated between the points, which are 0.09 deg apart.
+static int32_t sin_interp(uint32_t a)
+{
+	int i = a>>SIN_LUT_SHIFT;
+	int32_t frac = (a>>(SIN_LUT_SHIFT-8))&255;
+	int32_t s0 = sin_lut[i];
+	int32_t s1 = sin_lut[(i+1)&(SIN_LUT_POINTS-1)];
+	return s0 + (((s1-s0)*frac + 128)>>8);
+}
 
+
+#ifdef LIDAR_CORR_OFFLINE
 #define PASS1_NUM_A 7
-static int PASS1_A[PASS1_NUM_A] =
+static const int PASS1_A[PASS1_NUM_A] =
 {
 	-3*ANG_1_DEG,
 	-2*ANG_1_DEG,
@@ -39,7 +58,7 @@ static int PASS1_A[PASS1_NUM_A] =
 	2*ANG_1_DEG,
 	3*ANG_1_DEG
 };
-static int PASS1_A_WEIGH[PASS1_NUM_A] =
+static const int PASS1_A_WEIGH[PASS1_NUM_A] =
 {
 	11,
 	13,
@@ -51,9 +70,9 @@ static int PASS1_A_WEIGH[PASS1_NUM_A] =
 };
 
 #define PASS1_NUM_X 13
-static int PASS1_X[PASS1_NUM_X] =
+static const int PASS1_X[PASS1_NUM_X] =
 {
-	-190
+	-190,
 	-150,
 	-120,
 	-90,
@@ -67,7 +86,7 @@ static int PASS1_X[PASS1_NUM_X] =
 	150,
 	190
 };
-static int PASS1_X_WEIGH[PASS1_NUM_X] =
+static const int PASS1_X_WEIGH[PASS1_NUM_X] =
 {
 	10,
 	13,
@@ -86,7 +105,7 @@ static int PASS1_X_WEIGH[PASS1_NUM_X] =
 
 
 #define PASS2_NUM_A 5
-static int PASS2_A[PASS2_NUM_A] =
+static const int PASS2_A[PASS2_NUM_A] =
 {
 	-2*ANG_0_5_DEG,
 	-1*ANG_0_5_DEG,
@@ -96,7 +115,7 @@ static int PASS2_A[PASS2_NUM_A] =
 };
 
 #define PASS2_NUM_X 9
-static int PASS2_X[PASS2_NUM_X] =
+static const int PASS2_X[PASS2_NUM_X] =
 {
 	-40,
 	-30,
@@ -111,7 +130,7 @@ static int PASS2_X[PASS2_NUM_X] =
 
 
 #define PASS3_NUM_A 5
-static int PASS3_A[PASS3_NUM_A] =
+static const int PASS3_A[PASS3_NUM_A] =
 {
 	-2*ANG_0_25_DEG,
 	-1*ANG_0_25_DEG,
@@ -121,7 +140,7 @@ static int PASS3_A[PASS3_NUM_A] =
 };
 
 #define PASS3_NUM_X 7
-static int PASS3_X[PASS3_NUM_X] =
+static const int PASS3_X[PASS3_NUM_X] =
 {
 	-9,
 	-6,
@@ -131,6 +150,7 @@ static int PASS3_X[PASS3_NUM_X] =
 	6,
 	9
 };
+#endif
 
 
 // Use the same tables for X & Y
@@ -142,280 +162,292 @@ static int PASS3_X[PASS3_NUM_X] =
 #define PASS3_NUM_Y PASS3_NUM_X
 #define PASS3_Y PASS3_X
 
+// PASS1 translations and weights as used; see lidar_corr_tune_t.
+#define PASS1_T(v) (((v)*TUNE(pass1_step, 100))/100)
+#define PASS1_W(w) (TUNE(pass1_weigh, 1) ? (w) : 1)
+
+
+
+#ifdef LIDAR_CORR_OFFLINE
+/*
+	Coarse-to-fine evaluation (lidar_corr_coarse), for the do_lidar_corr() kernels.
+
+	With match_stride > 1, the kernels only score every match_stride-th image point. With match_bound != 0, they
+	give up as soon as the partial score plus the best possible score of the valid points left can't reach
+	match_bound anymore (checked every 32 points, with the counts from the validness words); the return value
+	is then below match_bound, which is all the caller needs to know. The bound is only used with stride 1.
+*/
+
+CORR_TLS int lidar_corr_coarse = 1;
+CORR_TLS int lidar_corr_pts; // Image points visited by the kernels during the latest do_lidar_corr()
+
+static CORR_TLS int match_stride = 1;
+static CORR_TLS int32_t match_bound;
+static CORR_TLS int match_rem[(IMG_MAX_POINTS+31)/32]; // Valid points from each validness word on
 
+static void match_rem_counts(img_t* img)
+{
+	int n = 0;
+	for(int w = 256/32-1; w >= 0; w--)
+	{
+		n += __builtin_popcount(img->valid[w]);
+		match_rem[w] = n;
+	}
+}
 
-point_t img1[256];
-point_t img2[256];
+#define MATCH_DIV    TUNE(match_div, 1200) // Score offset of calc_match_lvl() and calc_match_lvl_lines(), mm^2
+#define MATCH_PT_MAX ((256*(400*400+MATCH_DIV))/MATCH_DIV) // Best per-point score of calc_match_lvl() and calc_match_lvl_lines()
 
-// For optimization purposes:
-uint8_t o_starts[256];
-uint8_t o_ranges[256];
 
+/*
+	img1, img2 are 256-point decimated copies of the lidar_scan_t points (which are in angular order, so
+	that index order still roughly follows the angle), in a common coordinate frame: everything is
+	referenced to img_origin (scan1's refxy) to keep the numbers small.
+*/
+static CORR_TLS xy_i32_t img_origin;
 
-// Zeroes out and marks valid points.
-static void scan_to_2d_pre(lidar_scan_t* in, point_t* out)
+// Marks valid points. Decimation of n_points (up to LIDAR_MAX_POINTS) to 256 may pick the same point
+// twice when the scan has less than 256 points; only the first one is marked valid.
+static void scan_to_2d_pre(lidar_scan_t* in, img_t* out)
 {
+	int prev_idx = -1;
 	for(int i = 0; i < 256; i++)
 	{
-		int in_idx = (i*360)>>8;
-		if(in->scan[in_idx] != 0)
-			out[i].valid = 1;
+		int in_idx = (i*in->n_points)>>8;
+		if(in->n_points > 0 && in_idx != prev_idx)
+			IMG_SET_VALID(out, i);
 		else
-			out[i].valid = 0;
+			IMG_SET_INVALID(out, i);
+		prev_idx = in_idx;
 	}
 }
+#endif
+
+// Robot position halfway through the scan. Corrections rotate the scan around this point.
+static void scan_mid_pos(lidar_scan_t* in, pos_t* out)
+{
+	out->ang = (uint32_t)in->pos_at_start.ang + (uint32_t)(((int32_t)((uint32_t)in->pos_at_end.ang - (uint32_t)in->pos_at_start.ang))/2);
+	out->x   = in->pos_at_start.x + (in->pos_at_end.x - in->pos_at_start.x)/2;
+	out->y   = in->pos_at_start.y + (in->pos_at_end.y - in->pos_at_start.y)/2;
+}
 
-static void scan_to_2d(lidar_scan_t* in, point_t* out)
+#ifdef LIDAR_CORR_OFFLINE
+// Converts the scan to img_origin referenced coordinates, with the (corr_a, corr_x, corr_y) pose correction applied.
+// Only valid points are converted; points landing outside +/- IMG_COORD_MAX are marked invalid.
+static void scan_to_2d(lidar_scan_t* in, img_t* out, int32_t corr_a, int32_t corr_x, int32_t corr_y)
 {
-	uint32_t angle = (int32_t)in->pos.ang;
+	pos_t mid;
+	scan_mid_pos(in, &mid);
+	int32_t cx = mid.x - img_origin.x;
+	int32_t cy = mid.y - img_origin.y;
+	int32_t ox = in->refxy.x - img_origin.x - cx;
+	int32_t oy = in->refxy.y - img_origin.y - cy;
+
+	int32_t sin_a = sin_interp(corr_a);
+	int32_t cos_a = sin_interp(1073741824-(uint32_t)corr_a);
 
 	for(int i = 0; i < 256; i++)
 	{
-		int32_t y_idx = (angle)>>SIN_LUT_SHIFT;
-		int32_t x_idx = (1073741824-angle)>>SIN_LUT_SHIFT;
-		int in_idx = (i*360)>>8;
-		out[i].x = in->pos.x + (((int32_t)sin_lut[x_idx] * (int32_t)in->scan[in_idx])>>15);
-		out[i].y = in->pos.y + (((int32_t)sin_lut[y_idx] * (int32_t)in->scan[in_idx])>>15);
-		angle += 16777216;
+		if(!IMG_VALID(out, i)) continue;
+		int in_idx = (i*in->n_points)>>8;
+		int32_t dx = ox + in->scan[in_idx].x;
+		int32_t dy = oy + in->scan[in_idx].y;
+		int32_t x = cx + corr_x + ((dx*cos_a - dy*sin_a + (1<<14))>>15);
+		int32_t y = cy + corr_y + ((dx*sin_a + dy*cos_a + (1<<14))>>15);
+		if(x < -IMG_COORD_MAX || x > IMG_COORD_MAX || y < -IMG_COORD_MAX || y > IMG_COORD_MAX)
+		{
+			IMG_SET_INVALID(out, i);
+			continue;
+		}
+		out->x[i] = x;
+		out->y[i] = y;
 	}
 }
 
-// For lidar scans taken under robot movement, with 360 scan points, and 90 position points.
-// out should already contain valid fields set.
-static void scan_to_2d_live(live_lidar_scan_t* in, point_t* out, int32_t corr_a, int32_t corr_x, int32_t corr_y)
+
+static int scan_num_points(img_t* img)
 {
-	for(int i = 0; i < 360; i++)
+	int n = 0;
+	for(int i = 0; i < 256; i++)
 	{
-		int pos_idx = i>>2;
-		uint32_t angle = (uint32_t)in->pos[pos_idx].ang + (uint32_t)i*(uint32_t)ANG_1_DEG + (uint32_t)corr_a;
-		int y_idx = (angle)>>SIN_LUT_SHIFT;
-		int x_idx = (1073741824-angle)>>SIN_LUT_SHIFT;
-		out[i].x = corr_x + in->pos[pos_idx].x + (((int32_t)sin_lut[x_idx] * (int32_t)in->scan[i])>>15);
-		out[i].y = corr_y + in->pos[pos_idx].y + (((int32_t)sin_lut[y_idx] * (int32_t)in->scan[i])>>15);
+		if(IMG_VALID(img, i)) n++;
 	}
+	return n;
 }
+#endif
+
+/*
+	All calc_match_lvl functions score img2 as if it was moved by (off_x, off_y). This way, the matcher
+	only needs to rotate img2 once per angle candidate; the x,y candidates are just different offsets.
+	Where the kernel loops over img1, img1 is moved the opposite way instead, so the cost is per img1 point,
+	not per compared pair.
+*/
+
+#ifdef __SSE4_1__
+#include <smmintrin.h>
+#endif
 
-// Same, but within the robot coordinate frame for obstacle avoidance.
-static void scan_to_2d_live_robot_coord_frame(live_lidar_scan_t* in, point_t* out)
+typedef uint32_t __attribute__((may_alias)) u32_alias_t;
+
+/*
+	Smallest squared distance from (px,py) to img points first..first+n-1, or smallest if that's smaller.
+	Invalid points are parked at IMG_FAR, so no validness test is needed.
+*/
+static int32_t min_dist_sq(img_t* img, int first, int n, int px, int py, int32_t smallest)
 {
-	for(int i = 0; i < 360; i++)
+	int16_t* xs = &img->x[first];
+	int16_t* ys = &img->y[first];
+
+#if defined(__SSE4_1__)
+	// dx,dy fit in int16 (see IMG_FAR); pmaddwd on interleaved (dx,dy) pairs gives dx^2+dy^2 per 32-bit lane.
+	__m128i vpx = _mm_set1_epi16(px);
+	__m128i vpy = _mm_set1_epi16(py);
+	__m128i vmin = _mm_set1_epi32(smallest);
+	for(; n >= 8; n -= 8, xs += 8, ys += 8)
+	{
+		__m128i dx = _mm_sub_epi16(_mm_loadu_si128((__m128i*)xs), vpx);
+		__m128i dy = _mm_sub_epi16(_mm_loadu_si128((__m128i*)ys), vpy);
+		__m128i lo = _mm_unpacklo_epi16(dx, dy);
+		__m128i hi = _mm_unpackhi_epi16(dx, dy);
+		vmin = _mm_min_epi32(vmin, _mm_min_epi32(_mm_madd_epi16(lo, lo), _mm_madd_epi16(hi, hi)));
+	}
+	vmin = _mm_min_epi32(vmin, _mm_shuffle_epi32(vmin, _MM_SHUFFLE(1,0,3,2)));
+	vmin = _mm_min_epi32(vmin, _mm_shuffle_epi32(vmin, _MM_SHUFFLE(2,3,0,1)));
+	smallest = _mm_cvtsi128_si32(vmin);
+#else
+	// Two points per 32-bit load, once aligned.
+	if(n > 0 && (first&1))
+	{
+		int dist = sq(*xs - px) + sq(*ys - py);
+		if(dist < smallest) smallest = dist;
+		xs++; ys++; n--;
+	}
+	for(; n >= 2; n -= 2, xs += 2, ys += 2)
 	{
-		uint32_t angle = (uint32_t)i*(uint32_t)ANG_1_DEG;
-		int y_idx = (angle)>>SIN_LUT_SHIFT;
-		int x_idx = (1073741824-angle)>>SIN_LUT_SHIFT;
-		out[i].x = (((int32_t)sin_lut[x_idx] * (int32_t)in->scan[i])>>15);
-		out[i].y = (((int32_t)sin_lut[y_idx] * (int32_t)in->scan[i])>>15);
+		uint32_t xx = *(u32_alias_t*)xs;
+		uint32_t yy = *(u32_alias_t*)ys;
+		int dist0 = sq((int16_t)xx - px) + sq((int16_t)yy - py);
+		int dist1 = sq(((int32_t)xx>>16) - px) + sq(((int32_t)yy>>16) - py);
+		if(dist0 < smallest) smallest = dist0;
+		if(dist1 < smallest) smallest = dist1;
 	}
+#endif
+	for(; n > 0; n--, xs++, ys++)
+	{
+		int dist = sq(*xs - px) + sq(*ys - py);
+		if(dist < smallest) smallest = dist;
+	}
+	return smallest;
 }
 
+#define LINE_MAX_LEN 300 // mm, longest segment between neighbouring image points, see prep_lines()
 
+#ifdef LIDAR_CORR_OFFLINE
 /*
- Lidar-based 2D MAP on uart:
-
-num_bytes
- 1	uint8 start byte
- 1	uint7 status
- 1      uint7 id to identify when new robot coordinates have been applied.
- 2	int14 cur_ang (at the middle point of the lidar scan)  (not used for turning the image, just to include robot coords)
- 5	int32 cur_x   ( " " )
- 5	int32 cur_y   ( " " )
- 1	int7  correction return value
- 2	int14 ang_corr (for information only)
- 2	int14 x_corr (for information only)
- 2	int14 y_corr (for information only) 
-1440	360 * point
-	  2	int14  x referenced to cur_x
-	  2	int14  y referenced to cur_y
-
-	Total: 1461
-	Time to tx at 115200: ~130 ms
+	Nearest neighbour index over img1 for calc_match_lvl(), built once per match by nn_build()
+
+	img1 points are bucketed by NN_CELL mm cells, counting-sorted into nn_img so that each bucket is a run of
+	consecutive points. The cells are hashed to NN_BUCKETS buckets so that horizontally neighbouring cells are
+	neighbouring buckets: the 3x3 cells around a query are three runs of nn_img, typically 10..15 points in total.
+	Hash collisions only add points to look at. Everything within NN_CELL of the query is found; when nothing is,
+	the distance is taken as NN_CELL, where the score is nearly flat anyway.
 
+	Unlike index windows, this doesn't assume anything about the order of the points.
 */
 
-static void send_2d_live_to_uart(live_lidar_scan_t* in, point_t* point2d /*for valid fields*/, int significant_for_mapping)
-{
-	uint8_t* buf = txbuf;
-
-	int a_mid = in->pos[45].ang>>16;
-	int x_mid = in->pos[45].x;
-	int y_mid = in->pos[45].y;
-
-	*(buf++) = 0x84;
-	*(buf++) = ((in->status&LIVELIDAR_INVALID)?4:0) | (significant_for_mapping&0b11);
-	*(buf++) = in->id&0x7f;
-
-	*(buf++) = I16_MS(a_mid);
-	*(buf++) = I16_LS(a_mid);
-	*(buf++) = I32_I7_4(x_mid);
-	*(buf++) = I32_I7_3(x_mid);
-	*(buf++) = I32_I7_2(x_mid);
-	*(buf++) = I32_I7_1(x_mid);
-	*(buf++) = I32_I7_0(x_mid);
-	*(buf++) = I32_I7_4(y_mid);
-	*(buf++) = I32_I7_3(y_mid);
-	*(buf++) = I32_I7_2(y_mid);
-	*(buf++) = I32_I7_1(y_mid);
-	*(buf++) = I32_I7_0(y_mid);
-
-	*(buf++) = latest_corr_ret;
-	int tmp = latest_corr.ang>>16;
-	*(buf++) = I16_MS(tmp);
-	*(buf++) = I16_LS(tmp);
-	tmp = latest_corr.x<<2;
-	*(buf++) = I16_MS(tmp);
-	*(buf++) = I16_LS(tmp);
-	tmp = latest_corr.y<<2;
-	*(buf++) = I16_MS(tmp);
-	*(buf++) = I16_LS(tmp);
-
-
-	for(int i = 0; i < 360; i++)
-	{
-		if(point2d[i].valid)
-		{
-			int pos_idx = i>>2;
-			uint32_t angle = (uint32_t)in->pos[pos_idx].ang + (uint32_t)i*(uint32_t)ANG_1_DEG;
-			int y_idx = (angle)>>SIN_LUT_SHIFT;
-			int x_idx = (1073741824-angle)>>SIN_LUT_SHIFT;
-			int x = in->pos[pos_idx].x + (((int32_t)sin_lut[x_idx] * (int32_t)in->scan[i])>>15)  - x_mid;
-			int y = in->pos[pos_idx].y + (((int32_t)sin_lut[y_idx] * (int32_t)in->scan[i])>>15)  - y_mid;
-
-			*(buf++) = I16_MS(x<<2);
-			*(buf++) = I16_LS(x<<2);
-			*(buf++) = I16_MS(y<<2);
-			*(buf++) = I16_LS(y<<2);
-		}
-		else
-		{
-			*(buf++) = 0;
-			*(buf++) = 0;
-			*(buf++) = 0;
-			*(buf++) = 0;
-		}
-	}
+#define NN_CELL_SHIFT 8
+#define NN_REACH      1 // Cells searched around the query cell; everything within NN_REACH*NN_CELL is found
+#define NN_CELL       (1<<NN_CELL_SHIFT)
+#define NN_BUCKETS    512
+#define NN_ROW_MUL    37
 
-	send_uart(1460);
-}
+static CORR_TLS img_t nn_img;
+static CORR_TLS uint16_t nn_start[NN_BUCKETS+1];
 
+static int nn_bucket(int cx, int cy)
+{
+	return (cx + cy*NN_ROW_MUL) & (NN_BUCKETS-1);
+}
 
-static int scan_num_points(point_t* img)
+static void nn_build(img_t* img1)
 {
-	int n = 0;
+	for(int b = 0; b <= NN_BUCKETS; b++)
+		nn_start[b] = 0;
+
 	for(int i = 0; i < 256; i++)
 	{
-		if(img[i].valid) n++;
+		if(!IMG_VALID(img1, i)) continue;
+		nn_start[nn_bucket(img1->x[i]>>NN_CELL_SHIFT, img1->y[i]>>NN_CELL_SHIFT)]++;
 	}
-	return n;
-}
 
-/*
+	// Bucket ends, then filled backwards so that they become the starts.
+	for(int b = 1; b <= NN_BUCKETS; b++)
+		nn_start[b] += nn_start[b-1];
 
-*/
-void pre_search(point_t* img1, point_t* img2)
-{
-	int num_opers = 0;
-	int num_img1_masked = 0;
 	for(int i = 0; i < 256; i++)
 	{
-		if(!img1[i].valid) continue;
+		if(!IMG_VALID(img1, i)) continue;
+		int idx = --nn_start[nn_bucket(img1->x[i]>>NN_CELL_SHIFT, img1->y[i]>>NN_CELL_SHIFT)];
+		nn_img.x[idx] = img1->x[i];
+		nn_img.y[idx] = img1->y[i];
+	}
+}
 
-		int o_smallest = 1000;
-		int o_biggest = -1000;
+// The runs are a few points each, too short for min_dist_sq() to pay off.
+static int32_t nn_nearest_sq(int px, int py)
+{
+	int32_t smallest = sq(NN_REACH*NN_CELL);
+	int cx = px>>NN_CELL_SHIFT;
+	int cy = py>>NN_CELL_SHIFT;
 
-		for(int o = 0; o < 256; o++)
+	for(int row = cy-NN_REACH; row <= cy+NN_REACH; row++)
+	{
+		int b = nn_bucket(cx-NN_REACH, row);
+		int e = b + 2*NN_REACH+1;
+		int i = nn_start[b];
+		int end = nn_start[(e <= NN_BUCKETS) ? e : NN_BUCKETS];
+		for(;;)
 		{
-			if(!img2[o].valid) continue;
-			int dx = img2[o].x - img1[i].x;
-			int dy = img2[o].y - img1[i].y;
-			int dist = sq(dx) + sq(dy);
-
-			/*
-				We want to log minimum and maximum o index so that we can only scan the relevant possible area.
-			*/
-			if(dist < 400*400)
+			for(; i < end; i++)
 			{
-				int o_aligned = (o<128)?o:o-256; // We want to have negative numbers from the high range, so that looking for min/max works.
-				if(o_aligned < o_smallest) o_smallest = o_aligned;
-				if(o_aligned > o_biggest) o_biggest = o_aligned;
+				int32_t dist = sq(nn_img.x[i] - px) + sq(nn_img.y[i] - py);
+				if(dist < smallest) smallest = dist;
 			}
+			if(e <= NN_BUCKETS)
+				break;
+			// Wrapped around
+			i = 0;
+			end = nn_start[e-NN_BUCKETS];
+			e = 0;
 		}
-
-		/*
-			img1 is always the same; img2 is adjusted.
-			If, without the adjustments, the nearest img2 point is very far away, it
-			will be far away even with any adjustments, and thus, does not contribute.
-			Masking it away makes the calculation significantly quicker.
-		*/
-		if(o_smallest == 1000) // not found
-		{
-			num_img1_masked++;
-			img1[i].valid = 0;
-		}
-		else
-		{
-			o_smallest -= 2;
-			int o_range = o_biggest-o_smallest+2;
-			if(o_smallest < 0) o_smallest+=256;
-			o_starts[i] = o_smallest;
-			o_ranges[i] = o_range;
-			num_opers += o_range;
-		}
-
 	}
-//	dbg[8] = num_img1_masked;
+	return smallest;
 }
 
-// returns 256..14656, bigger = better
-int32_t calc_match_lvl(point_t* img1, point_t* img2)
+// returns 0..34389, bigger = better. img1 is only used through the index, generated by nn_build().
+int32_t calc_match_lvl(img_t* img1, img_t* img2, int32_t off_x, int32_t off_y)
 {
 	/*
-	For each point in the first image, search the nearest point in the second image; any valid point will do.
+	For each point in the second image, search the nearest point in the first image.
 
 	Use 1/x function to scale the distance so that small distances are more meaningfull than large distances;
 	this is to ignore objects that are really different between the images, trying to account for objects common
 	for both images.
 
 	Sum up the distances.
-
-	Finally, divide by the number of points to get comparable value regardless of num of valid points.
 	*/
 
 	int32_t dist_sum = 0;
-	for(int i = 0; i < 256; i++)
+	int o;
+	if(match_bound) match_rem_counts(img2);
+	for(o = 0; o < 256; o += match_stride)
 	{
-		if(!img1[i].valid) continue;
-
-		int smallest = 1000*1000;
-		uint8_t odx = o_starts[i];
-		int range = o_ranges[i];
+		if(match_bound && !(o&31) && ((dist_sum + match_rem[o>>5]*MATCH_PT_MAX)>>8) < match_bound)
+			break;
 
-		for(int o = 0; o < range; o++)
-		{
-			odx++;
-			if(!img2[odx].valid) continue;
-			int dx = img2[odx].x - img1[i].x;
-			int dy = img2[odx].y - img1[i].y;
-			int dist = sq(dx) + sq(dy);
-			if(dist < smallest)
-			{
-				smallest = dist;
-			}
-		}
+		if(!IMG_VALID(img2, o)) continue;
 
-		// Non-optimized code going through all points:
-/*
-		for(int o = 0; o < 256; o++)
-		{
-			if(!img2[o].valid) continue;
-			int dx = img2[o].x - img1[i].x;
-			int dy = img2[o].y - img1[i].y;
-			int dist = sq(dx) + sq(dy);
-			if(dist < smallest)
-			{
-				smallest = dist;
-			}
-		}
-*/
+		int32_t smallest = nn_nearest_sq(img2->x[o] + off_x, img2->y[o] + off_y);
 
 		// Divider offset: (to avoid division by zero and numbers too huge)
 		// 50 breaks the results down
@@ -426,299 +458,1425 @@ int32_t calc_match_lvl(point_t* img1, point_t* img2)
 		// 3200 shows very, very small degradation in trivial cases - slight undercorrection. Still very good.
 		// 6400: about the same.
 
-		/*
-			dist	dist_scaled
-			0mm	14656
-			1mm	14646
-			2mm	14691
-			10mm	13793
-			100mm	2021
-			300mm	256
-		*/
-
-		int32_t dist_scaled = (256*(400*400+1200))/(smallest+1200);
+		int32_t dist_scaled = (256*(400*400+MATCH_DIV))/(smallest+MATCH_DIV);
 		dist_sum += dist_scaled;
 	}
 
+	lidar_corr_pts += o/match_stride;
 	return dist_sum>>8;
 }
 
 
 
 /*
-	Specifically optimized version for live scans (scans 200ms apart, so smaller differences, but 360 points)
+	Point-to-line scoring
 
-	in 200ms, robot can:
-	* (turn 18 degrees at 4 sec/360deg., which is irrelevant since we know how much we have turned.)
-	* go 33 cm at 6 km/h (1.67 m/s)
+	As explained in lidar.c, matching img2 points to the discrete img1 points gives good scores to wrong
+	shifts along smooth walls. Here, each img2 point is matched against the line segments between neighbouring
+	img1 points instead.
 
-	So, I decided looking at points for +/- 10 deg is ok when slow robot speed is assumed (based on wheels/gyro)
-	When higher speed is detected, PASS4 is skipped to give more time for slightly less final resolution, and
-	+/- 13 deg search range is used instead.
-*/
+	The segments are precomputed once per match in prep_lines(): unit direction u (Q14), and the offsets of the
+	segment start point p0 along the normal n = (-uy, ux) and along u. Then, for any point p:
 
-int angle_optim; // must be smaller than SEARCH_RANGE
+		d = n.p - n.p0   distance from the line
+		t = u.p - u.p0   position along the line, 0..len within the segment
 
-#define SEARCH_RANGE 10
-#define SEARCH_RANGE_HI 13
+		dist = d^2 + (t<0 ? t^2 : 0) + (t>len ? (t-len)^2 : 0)
 
-// 100 causes severe jumping
-// 200 causes some jumping every now and then
-// 400 works well.
-#define MATCH_DIV_OFFSET 800
-#define MATCH_DIV_OFFSET_HI 800
+	so the inner loop has no divisions or square roots. Far-apart neighbours are not connected
+	(they are most likely different objects); such img1 points become zero-length segments, scoring
+	just like in calc_match_lvl().
+*/
 
-int32_t calc_match_lvl_live(point_t* img1, point_t* img2)
+typedef struct
 {
-	int32_t dist_sum = 0;
-	for(int i = 0; i < 360; i++)
-	{
-		if(!img1[i].valid) continue;
-		// GCC didn't figure out this trivial optimization.
-		// Only load img1[i].x and .y from memory when the i has changed.
-		register int i1x = img1[i].x;
-		register int i1y = img1[i].y;
+	int valid;
+	int16_t ux;  // Q14 unit direction
+	int16_t uy;
+	int32_t n0;  // n.p0, Q14
+	int32_t t0;  // u.p0, Q14
+	int32_t len; // segment length, Q14
+} line_t;
+
+CORR_TLS line_t lines1[256];
+
+// For optimization purposes: img1 segment search window for each img2 point
+CORR_TLS uint8_t l_starts[256];
+CORR_TLS uint8_t l_ranges[256];
+#endif
 
-		int smallest = 500*500;
-		int o = i-SEARCH_RANGE+angle_optim;
-		if(o < 0) o+=360;
-		int o_end = o+2*SEARCH_RANGE;
+static uint32_t isqrt(uint32_t x)
+{
+	uint32_t res = 0;
+	uint32_t bit = 1UL<<30;
 
-		// let o run [i-SEARCH_RANGE..i+SEARCH_RANGE], with wrapping from 359->0.
-		// Two separate loops prevent wrapping condition on each inner loop.
-		if(o_end > 360)
+	while(bit > x) bit >>= 2;
+
+	while(bit)
+	{
+		if(x >= res + bit)
 		{
-			o_end -= 360;
-			for(; o < 360; o++)
-			{
-				if(!img2[o].valid) continue;
-				int dx = img2[o].x - i1x;
-				int dy = img2[o].y - i1y;
-				int dist = sq(dx) + sq(dy);
-				if(dist < smallest) smallest = dist;
-			}
-			o = 0;
+			x -= res + bit;
+			res = (res>>1) + bit;
 		}
+		else
+			res >>= 1;
+		bit >>= 2;
+	}
+	return res;
+}
+
+#ifdef LIDAR_CORR_OFFLINE
+void prep_lines(img_t* img1)
+{
+	for(int i = 0; i < 256; i++)
+	{
+		lines1[i].valid = IMG_VALID(img1, i) != 0;
+		if(!IMG_VALID(img1, i)) continue;
+
+		int next = (i+1)&255;
+		int dx = img1->x[next] - img1->x[i];
+		int dy = img1->y[next] - img1->y[i];
+		int len_sq = sq(dx) + sq(dy);
 
-		for(; o < o_end; o++)
+		int ux = 1<<14, uy = 0, len = 0;
+		if(IMG_VALID(img1, next) && len_sq > 0 && len_sq < sq(LINE_MAX_LEN))
 		{
-			if(!img2[o].valid) continue;
-			int dx = img2[o].x - i1x;
-			int dy = img2[o].y - i1y;
-			int dist = sq(dx) + sq(dy);
-			if(dist < smallest) smallest = dist;
+			len = isqrt(len_sq);
+			ux = (dx<<14)/len;
+			uy = (dy<<14)/len;
 		}
 
-
-		int32_t dist_scaled = (256*(200*200+MATCH_DIV_OFFSET))/(smallest+MATCH_DIV_OFFSET);
-		dist_sum += dist_scaled;
+		lines1[i].ux = ux;
+		lines1[i].uy = uy;
+		lines1[i].n0 = -uy*img1->x[i] + ux*img1->y[i];
+		lines1[i].t0 =  ux*img1->x[i] + uy*img1->y[i];
+		lines1[i].len = len<<14;
 	}
-
-	return dist_sum>>8;
 }
 
-
-int32_t calc_match_lvl_live_high_movement(point_t* img1, point_t* img2)
+/*
+	For each img2 point, the window of img1 segments to look at: those with an end point within 400 mm, by index
+	(the points are in angular order). img2 points with nothing near are masked away.
+*/
+void pre_search_lines(img_t* img1, img_t* img2)
 {
-	int32_t dist_sum = 0;
-	for(int i = 0; i < 360; i++)
+	for(int o = 0; o < 256; o++)
 	{
-		if(!img1[i].valid) continue;
-		// GCC didn't figure out this trivial optimization.
-		// Only load img1[i].x and .y from memory when the i has changed.
-		register int i1x = img1[i].x;
-		register int i1y = img1[i].y;
+		if(!IMG_VALID(img2, o)) continue;
 
-		int smallest = 500*500;
-		int o = i-SEARCH_RANGE_HI+angle_optim;
-		if(o < 0) o+=360;
-		int o_end = o+2*SEARCH_RANGE_HI;
+		int i_smallest = 1000;
+		int i_biggest = -1000;
 
-		// let o run [i-SEARCH_RANGE..i+SEARCH_RANGE], with wrapping from 359->0.
-		// Two separate loops prevent wrapping condition on each inner loop.
-		if(o_end > 360)
+		for(int i = 0; i < 256; i++)
 		{
-			o_end -= 360;
-			for(; o < 360; o++)
+			if(!IMG_VALID(img1, i)) continue;
+			int dx = img2->x[o] - img1->x[i];
+			int dy = img2->y[o] - img1->y[i];
+			int dist = sq(dx) + sq(dy);
+
+			if(dist < 400*400)
 			{
-				if(!img2[o].valid) continue;
-				int dx = img2[o].x - i1x;
-				int dy = img2[o].y - i1y;
-				int dist = sq(dx) + sq(dy);
-				if(dist < smallest) smallest = dist;
+				int i_aligned = (i<128)?i:i-256;
+				if(i_aligned < i_smallest) i_smallest = i_aligned;
+				if(i_aligned > i_biggest) i_biggest = i_aligned;
 			}
-			o = 0;
 		}
 
-		for(; o < o_end; o++)
+		if(i_smallest == 1000)
 		{
-			if(!img2[o].valid) continue;
-			int dx = img2[o].x - i1x;
-			int dy = img2[o].y - i1y;
-			int dist = sq(dx) + sq(dy);
-			if(dist < smallest) smallest = dist;
+			IMG_SET_INVALID(img2, o);
+		}
+		else
+		{
+			// The segment before the nearest point matters, too.
+			i_smallest -= 3;
+			int i_range = i_biggest-i_smallest+2;
+			if(i_smallest < 0) i_smallest+=256;
+			l_starts[o] = i_smallest;
+			l_ranges[o] = i_range;
 		}
+	}
+}
+
+// returns 256..14656, bigger = better, like calc_match_lvl(). img1 is only used through lines1, generated by prep_lines().
+int32_t calc_match_lvl_lines(img_t* img1, img_t* img2, int32_t off_x, int32_t off_y)
+{
+	int32_t dist_sum = 0;
+	int o;
+	if(match_bound) match_rem_counts(img2);
+	for(o = 0; o < 256; o += match_stride)
+	{
+		if(match_bound && !(o&31) && ((dist_sum + match_rem[o>>5]*MATCH_PT_MAX)>>8) < match_bound)
+			break;
+
+		if(!IMG_VALID(img2, o)) continue;
+
+		register int px = img2->x[o] + off_x;
+		register int py = img2->y[o] + off_y;
 
+		int smallest = 1000*1000;
+		uint8_t idx = l_starts[o];
+		int range = l_ranges[o];
+
+		for(int i = 0; i < range; i++)
+		{
+			idx++;
+			line_t* l = &lines1[idx];
+			if(!l->valid) continue;
+
+			int d = (-l->uy*px + l->ux*py - l->n0)>>14;
+			int t =  l->ux*px + l->uy*py - l->t0;
+			int dist = sq(d);
+			if(t < 0)
+				dist += sq(t>>14);
+			else if(t > l->len)
+				dist += sq((t - l->len)>>14);
+
+			if(dist < smallest) smallest = dist;
+		}
 
-		int32_t dist_scaled = (256*(200*200+MATCH_DIV_OFFSET_HI))/(smallest+MATCH_DIV_OFFSET_HI);
+		int32_t dist_scaled = (256*(400*400+MATCH_DIV))/(smallest+MATCH_DIV);
 		dist_sum += dist_scaled;
 	}
 
+	lidar_corr_pts += o/match_stride;
 	return dist_sum>>8;
 }
 
 
 
 /*
+	Distance transform grid scoring
 
-	scan1, scan2: before and after lidar scans, with pos fields set as correctly as possible
-	corr: pointer to pos_t; corrections are written there. You can apply them. Will be written zero in case of failure.
+	img1 is rasterised once per match into a robot-centred grid, each cell holding a precomputed score
+	based on the distance to the nearest img1 segment (same segments as in prep_lines()). Scoring a
+	candidate pose is then a single table lookup per img2 point - no nearest neighbour search at all.
 
-	Return:
-	0 on success
-	>0 on failure
+	Distances are generated by a two-pass 3-4 chamfer transform (in 1/3 cell units), then converted to
+	8-bit scores with the usual 1/(dist^2+offset) shaping. The offset is bigger than in the other
+	kernels, to keep the score landscape smooth over the cell size.
 
+	32 mm cells, 192*192 cells = 36 KB, reaching +/- 3 m around scan2. Points outside the grid don't score.
 */
 
-extern void dev_send_hommel(lidar_scan_t* p1, lidar_scan_t* p2, int bonus);
-extern void dev_send_jutsk(point_t* img, int id);
+#define GRID_CELL_SHIFT 5
+#define GRID_SIZE 192
+#define MATCH_GRID_OFFSET TUNE(grid_div, 3200)
 
-extern void delay_ms(uint32_t i);
+CORR_TLS uint8_t match_grid[GRID_SIZE*GRID_SIZE];
+static CORR_TLS int32_t grid_x0, grid_y0; // img coordinates of the grid corner
 
+static CORR_TLS uint8_t grid_score_lut[256];
 
-int do_lidar_corr(lidar_scan_t* scan1, lidar_scan_t* scan2, pos_t* corr)
+static void grid_plot_segment(int x1, int y1, int x2, int y2)
 {
-	// scan1 stays the same. scan2 goes through pos modifications and scan_to_2d is called again every time.
-
-	/*
-	Step 1:
-	Convert lidar scans to absolute x,y coordinates on the same map, assuming that the original
-	coordinates are right.
-	*/
-
-	corr->ang = 0;
-	corr->x = 0;
-	corr->y = 0;
+	// Cell coordinates in 1/256 cell units
+	int fx = (x1-grid_x0)<<(8-GRID_CELL_SHIFT);
+	int fy = (y1-grid_y0)<<(8-GRID_CELL_SHIFT);
+	int dx = (x2-x1)<<(8-GRID_CELL_SHIFT);
+	int dy = (y2-y1)<<(8-GRID_CELL_SHIFT);
 
-	scan_to_2d_pre(scan1, img1);
-	scan_to_2d    (scan1, img1);
+	int steps = ((dx<0?-dx:dx) + (dy<0?-dy:dy))>>7; // at least two steps per cell
+	int inc_x = dx/(steps+1);
+	int inc_y = dy/(steps+1);
 
-	scan_to_2d_pre(scan2, img2);
-	scan_to_2d    (scan2, img2);
+	for(int s = 0; s <= steps+1; s++)
+	{
+		unsigned int cx = fx>>8;
+		unsigned int cy = fy>>8;
+		if(cx < GRID_SIZE && cy < GRID_SIZE)
+			match_grid[cy*GRID_SIZE+cx] = 0;
+		fx += inc_x;
+		fy += inc_y;
+	}
+}
 
-	/*
-	Step 2:
-	Process both lidar scans to remove any points that are out of visible range seen from the other scan.
-	LIDAR_RANGE must be slightly smaller than in real life, since we are assuming zero error in robot coordinates.
-	*/
+#define CHAMFER(cur, neigh, add) do{ int v_ = (neigh)+(add); if(v_ < (cur)) (cur) = v_; } while(0)
 
-	for(int i = 0; i < 256; i++)
+void prep_grid(img_t* img1, int32_t center_x, int32_t center_y)
+{
+	static CORR_TLS int lut_offset;
+	if(lut_offset != MATCH_GRID_OFFSET)
 	{
-		int32_t dist_img1_to_scan2_origin = sq(img1[i].x - scan2->pos.x) + sq(img1[i].y - scan2->pos.y);
-		int32_t dist_img2_to_scan1_origin = sq(img2[i].x - scan1->pos.x) + sq(img2[i].y - scan2->pos.y);
-
-		if(dist_img1_to_scan2_origin > sq(LIDAR_RANGE))
-			img1[i].valid = 0;
-		if(dist_img2_to_scan1_origin > sq(LIDAR_RANGE))
-			img2[i].valid = 0;
+		for(int i = 0; i < 256; i++)
+		{
+			int d_mm = (i<<GRID_CELL_SHIFT)/3;
+			grid_score_lut[i] = (255*MATCH_GRID_OFFSET)/(sq(d_mm)+MATCH_GRID_OFFSET);
+		}
+		lut_offset = MATCH_GRID_OFFSET;
 	}
 
-	/*
-	Step 3:
-	For optimization, run one full "slow" image matching round, generating optimization tables.
-	*/
-	pre_search(img1, img2);
-
-	int points1 = scan_num_points(img1);
-	int points2 = scan_num_points(img2);
+	grid_x0 = center_x - ((GRID_SIZE/2)<<GRID_CELL_SHIFT);
+	grid_y0 = center_y - ((GRID_SIZE/2)<<GRID_CELL_SHIFT);
 
-	//dbg[6] = points1;
-	//dbg[7] = points2;
+	memset(match_grid, 255, sizeof(match_grid));
 
-	if(points1 < 40 || points2 < 40)
+	for(int i = 0; i < 256; i++)
 	{
-		return 1;
+		if(!IMG_VALID(img1, i)) continue;
+		int next = (i+1)&255;
+		if(IMG_VALID(img1, next) && sq(img1->x[next]-img1->x[i]) + sq(img1->y[next]-img1->y[i]) < sq(LINE_MAX_LEN))
+			grid_plot_segment(img1->x[i], img1->y[i], img1->x[next], img1->y[next]);
+		else
+			grid_plot_segment(img1->x[i], img1->y[i], img1->x[i], img1->y[i]);
 	}
-	
-	// scan2 position is modified during processing. Instead of memcpying the whole scan2, we just store and restore the pos.
-	pos_t scan2_very_orig_pos;
-	pos_t orig_pos;
-	COPY_POS(scan2_very_orig_pos, scan2->pos);
-	COPY_POS(orig_pos, scan2->pos);
 
-	// Run PASS 1
-
-	int biggest_lvl = 0;
-	int best_a, best_x, best_y;
-	for(int a_corr = 0; a_corr < PASS1_NUM_A; a_corr++)
+	// Forward pass
+	for(int y = 0; y < GRID_SIZE; y++)
 	{
-		scan2->pos.ang = orig_pos.ang + PASS1_A[a_corr];
-		for(int x_corr = 0; x_corr < PASS1_NUM_X; x_corr++)
+		uint8_t* row = &match_grid[y*GRID_SIZE];
+		uint8_t* prev_row = row - GRID_SIZE;
+		for(int x = 0; x < GRID_SIZE; x++)
 		{
-			scan2->pos.x = orig_pos.x + PASS1_X[x_corr];
-			for(int y_corr = 0; y_corr < PASS1_NUM_Y; y_corr++)
+			int v = row[x];
+			if(x > 0) CHAMFER(v, row[x-1], 3);
+			if(y > 0)
 			{
-				scan2->pos.y = orig_pos.y + PASS1_Y[y_corr];
-
-				scan_to_2d(scan2, img2);
-
-//				dev_send_jutsk(img1, 0);
-//				dev_send_jutsk(img2, 1);
-
-				int lvl = calc_match_lvl(img1, img2);
-				lvl = lvl * PASS1_A_WEIGH[a_corr] * PASS1_X_WEIGH[x_corr] * PASS1_Y_WEIGH[y_corr];
-//				dev_send_hommel(scan1, scan2, lvl);
-
-				if(lvl > biggest_lvl)
-				{
-					biggest_lvl = lvl;
-					best_a = a_corr;
-					best_x = x_corr;
-					best_y = y_corr;
-				}
+				CHAMFER(v, prev_row[x], 3);
+				if(x > 0) CHAMFER(v, prev_row[x-1], 4);
+				if(x < GRID_SIZE-1) CHAMFER(v, prev_row[x+1], 4);
 			}
+			row[x] = v;
 		}
 	}
 
-	if(biggest_lvl == 0)
+	// Backward pass. Row y+1 is not needed anymore after row y is done: convert it to scores.
+	for(int y = GRID_SIZE-1; y >= 0; y--)
 	{
-		COPY_POS(scan2->pos, scan2_very_orig_pos);
-		return 2;
+		uint8_t* row = &match_grid[y*GRID_SIZE];
+		uint8_t* next_row = row + GRID_SIZE;
+		for(int x = GRID_SIZE-1; x >= 0; x--)
+		{
+			int v = row[x];
+			if(x < GRID_SIZE-1) CHAMFER(v, row[x+1], 3);
+			if(y < GRID_SIZE-1)
+			{
+				CHAMFER(v, next_row[x], 3);
+				if(x < GRID_SIZE-1) CHAMFER(v, next_row[x+1], 4);
+				if(x > 0) CHAMFER(v, next_row[x-1], 4);
+			}
+			row[x] = v;
+		}
+
+		if(y < GRID_SIZE-1)
+		{
+			for(int x = 0; x < GRID_SIZE; x++)
+				next_row[x] = grid_score_lut[next_row[x]];
+		}
 	}
 
-	// Correct orig_pos to the best match.
-	orig_pos.ang += PASS1_A[best_a];
-	orig_pos.x   += PASS1_X[best_x];
-	orig_pos.y   += PASS1_Y[best_y];
-	corr->ang    += PASS1_A[best_a];
-	corr->x      += PASS1_X[best_x];
-	corr->y      += PASS1_Y[best_y];
+	for(int x = 0; x < GRID_SIZE; x++)
+		match_grid[x] = grid_score_lut[match_grid[x]];
+}
 
-//	COPY_POS(scan2->pos, orig_pos);
-//	dev_send_hommel(scan1, scan2, biggest_lvl);
-//	delay_ms(5000);
+// returns 0..65280, bigger = better. img1 is only used through match_grid, generated by prep_grid().
+int32_t calc_match_lvl_grid(img_t* img1, img_t* img2, int32_t off_x, int32_t off_y)
+{
+	int32_t x0 = grid_x0 - off_x;
+	int32_t y0 = grid_y0 - off_y;
+	int32_t score_sum = 0;
+	int o;
+	if(match_bound) match_rem_counts(img2);
+	for(o = 0; o < 256; o += match_stride)
+	{
+		if(match_bound && !(o&31) && score_sum + match_rem[o>>5]*255 < match_bound)
+			break;
 
-	// Run pass 2
+		if(!IMG_VALID(img2, o)) continue;
 
-	biggest_lvl = 0;
+		unsigned int cx = (img2->x[o] - x0)>>GRID_CELL_SHIFT;
+		unsigned int cy = (img2->y[o] - y0)>>GRID_CELL_SHIFT;
+		if(cx >= GRID_SIZE || cy >= GRID_SIZE) continue;
 
-	for(int a_corr = 0; a_corr < PASS2_NUM_A; a_corr++)
-	{
-		scan2->pos.ang = orig_pos.ang + PASS2_A[a_corr];
-		for(int x_corr = 0; x_corr < PASS2_NUM_X; x_corr++)
-		{
-			scan2->pos.x = orig_pos.x + PASS2_X[x_corr];
-			for(int y_corr = 0; y_corr < PASS2_NUM_Y; y_corr++)
-			{
-				scan2->pos.y = orig_pos.y + PASS2_Y[y_corr];
+		score_sum += match_grid[cy*GRID_SIZE+cx];
+	}
 
-				scan_to_2d(scan2, img2);
+	lidar_corr_pts += o/match_stride;
+	return score_sum;
+}
+#endif
 
-//				dev_send_jutsk(img1, 0);
-//				dev_send_jutsk(img2, 1);
 
-				int lvl = calc_match_lvl(img1, img2);
-//				dev_send_hommel(scan1, scan2, lvl);
+/*
+	Specifically optimized version for live scans (consecutive scans, so smaller differences, but 360 points)
+
+	Points are indexed by their world-frame bearing from the sensor (see scan_to_live_bins()), so turning doesn't
+	move the indeces at all; only moving does, and in 200ms, robot can:
+	* go 33 cm at 6 km/h (1.67 m/s)
+
+	So, I decided looking at points for +/- 10 deg is ok when slow robot speed is assumed (based on wheels/gyro)
+	When higher speed is detected, +/- 13 deg search range is used instead.
+*/
+
+
+#define SEARCH_RANGE 10
+#define SEARCH_RANGE_HI 13
+
+// 100 causes severe jumping
+// 200 causes some jumping every now and then
+// 400 works well.
+#define MATCH_DIV_OFFSET TUNE(live_div, 800)
+#define MATCH_DIV_OFFSET_HI TUNE(live_div_hi, 800)
+
+/*
+	The live kernels are generated by LIVE_KERNEL() for each search window, so that the range and the score
+	constant are compile-time constants. img1 bin i is compared with img2 bins i-range..i+range-1:
+
+	* bins range..360-range have their whole window in order, and the window is scanned with a fully unrolled
+	  LIVE_WIN() block, with no loop or wrap test;
+	* the 2*range bins near 0 and 360 wrap around, and go through live_wrapped_sum().
+
+	LIVE_WIN_<range> has to exist for each range used.
+*/
+
+#define LIVE_SCORE(smallest, div_offset) ((256*(200*200+(div_offset)))/((smallest)+(div_offset)))
+
+// Bins first..last of the kernel with the given window, wrapping from 359 to 0.
+static int32_t live_wrapped_sum(img_t* img1, img_t* img2, int32_t off_x, int32_t off_y, int first, int last, int range,
+	int div_offset)
+{
+	int32_t dist_sum = 0;
+	for(int i = first; i <= last; i++)
+	{
+		if(!IMG_VALID(img1, i)) continue;
+		int i1x = img1->x[i] - off_x;
+		int i1y = img1->y[i] - off_y;
+
+		int smallest = 500*500;
+		int o = i-range;
+		if(o < 0) o+=360;
+		int o_end = o+2*range;
+
+		// Two separate runs prevent wrapping condition on each inner loop.
+		if(o_end > 360)
+		{
+			smallest = min_dist_sq(img2, o, 360-o, i1x, i1y, smallest);
+			o = 0;
+			o_end -= 360;
+		}
+
+		smallest = min_dist_sq(img2, o, o_end-o, i1x, i1y, smallest);
+		dist_sum += LIVE_SCORE(smallest, div_offset);
+	}
+	return dist_sum;
+}
+
+#define LIVE_PT(k) { int d_ = sq(xs[k] - i1x) + sq(ys[k] - i1y); if(d_ < smallest) smallest = d_; }
+#define LIVE_REP2(k)  LIVE_PT(k) LIVE_PT((k)+1)
+#define LIVE_REP4(k)  LIVE_REP2(k) LIVE_REP2((k)+2)
+#define LIVE_REP8(k)  LIVE_REP4(k) LIVE_REP4((k)+4)
+#define LIVE_REP16(k) LIVE_REP8(k) LIVE_REP8((k)+8)
+
+#define LIVE_WIN_10 LIVE_REP16(0) LIVE_REP4(16)
+#define LIVE_WIN_13 LIVE_REP16(0) LIVE_REP8(16) LIVE_REP2(24)
+
+#ifdef __SSE4_1__
+// 8 points per step: the SIMD loop with a constant count does better than the unrolled scalar block.
+#define LIVE_WIN(range) smallest = min_dist_sq(img2, i-(range), 2*(range), i1x, i1y, smallest);
+#else
+#define LIVE_WIN(range) LIVE_WIN_EXP(range)
+#define LIVE_WIN_EXP(range) { int16_t* xs = &img2->x[i-(range)]; int16_t* ys = &img2->y[i-(range)]; LIVE_WIN_##range }
+#endif
+
+#define LIVE_KERNEL(name, range, div_offset) \
+int32_t name(img_t* img1, img_t* img2, int32_t off_x, int32_t off_y) \
+{ \
+	int32_t dist_sum = live_wrapped_sum(img1, img2, off_x, off_y, 0, (range)-1, (range), (div_offset)); \
+	for(int i = (range); i <= 360-(range); i++) \
+	{ \
+		if(!IMG_VALID(img1, i)) continue; \
+		int i1x = img1->x[i] - off_x; \
+		int i1y = img1->y[i] - off_y; \
+		int smallest = 500*500; \
+		LIVE_WIN(range) \
+		dist_sum += LIVE_SCORE(smallest, (div_offset)); \
+	} \
+	dist_sum += live_wrapped_sum(img1, img2, off_x, off_y, 360-(range)+1, 359, (range), (div_offset)); \
+	return dist_sum>>8; \
+}
+
+LIVE_KERNEL(calc_match_lvl_live, SEARCH_RANGE, MATCH_DIV_OFFSET)
+LIVE_KERNEL(calc_match_lvl_live_high_movement, SEARCH_RANGE_HI, MATCH_DIV_OFFSET_HI)
+
+
+
+#ifdef LIDAR_CORR_OFFLINE
+/*
+
+	scan1, scan2: before and after lidar scans, with pos fields set as correctly as possible
+	corr: pointer to pos_t; corrections are written there. You can apply them. Will be written zero in case of failure.
+
+	Return:
+	0 on success
+	>0 on failure
+
+*/
+
+extern void dev_send_hommel(lidar_scan_t* p1, lidar_scan_t* p2, int bonus);
+extern void dev_send_jutsk(img_t* img, int id);
+
+extern void delay_ms(uint32_t i);
+
+
+CORR_TLS int lidar_corr_mode = LIDAR_CORR_MODE_LINES;
+#endif
+
+CORR_TLS int lidar_corr_evals; // Number of candidate poses scored (and Gauss-Newton iterations) by the latest do_lidar_corr() or live search.
+CORR_TLS corr_cov_t lidar_corr_cov; // Covariance of the latest do_lidar_corr(), do_lidar_corr_bnb() or livelidar_finish() result.
+
+#ifdef LIDAR_CORR_OFFLINE
+// The scans being matched by do_lidar_corr() and do_lidar_corr_bnb(); the live matcher has its own.
+CORR_TLS img_t img1;
+CORR_TLS img_t img2;
+
+/*
+	Steps 1 and 2, common to all the matchers. Returns 1 if there is too little overlap, 0 otherwise.
+	mid2 gets scan2's mid pose, in img coordinates.
+*/
+static int prep_images(lidar_scan_t* scan1, lidar_scan_t* scan2, pos_t* mid2)
+{
+	/*
+	Step 1:
+	Convert lidar scans to x,y coordinates on the same map, assuming that the original
+	coordinates are right.
+	*/
+
+	img_origin.x = scan1->refxy.x;
+	img_origin.y = scan1->refxy.y;
+
+	scan_to_2d_pre(scan1, &img1);
+	scan_to_2d    (scan1, &img1, 0, 0, 0);
+
+	scan_to_2d_pre(scan2, &img2);
+	scan_to_2d    (scan2, &img2, 0, 0, 0);
+
+	/*
+	Step 2:
+	Process both lidar scans to remove any points that are out of visible range seen from the other scan.
+	LIDAR_RANGE must be slightly smaller than in real life, since we are assuming zero error in robot coordinates.
+	*/
+
+	pos_t mid1;
+	scan_mid_pos(scan1, &mid1);
+	scan_mid_pos(scan2, mid2);
+	mid1.x -= img_origin.x; mid1.y -= img_origin.y;
+	mid2->x -= img_origin.x; mid2->y -= img_origin.y;
+
+	// Both images are limited by both origins: if the visible areas differed, the unmatched ends of
+	// the images would bias the result on featureless walls.
+	for(int i = 0; i < 256; i++)
+	{
+		if(sq(img1.x[i] - mid1.x) + sq(img1.y[i] - mid1.y) > sq(LIDAR_RANGE) ||
+		   sq(img1.x[i] - mid2->x) + sq(img1.y[i] - mid2->y) > sq(LIDAR_RANGE))
+			IMG_SET_INVALID(&img1, i);
+		if(sq(img2.x[i] - mid1.x) + sq(img2.y[i] - mid1.y) > sq(LIDAR_RANGE) ||
+		   sq(img2.x[i] - mid2->x) + sq(img2.y[i] - mid2->y) > sq(LIDAR_RANGE))
+			IMG_SET_INVALID(&img2, i);
+	}
+
+	int points1 = scan_num_points(&img1);
+	int points2 = scan_num_points(&img2);
+
+	//dbg[6] = points1;
+	//dbg[7] = points2;
+
+	if(points1 < 40 || points2 < 40)
+	{
+		return 1;
+	}
+
+	return 0;
+}
+#endif
+
+/*
+	Gauss-Newton fine alignment
+
+	The grid searches only need to get within a few mm and a fraction of a degree; the final resolution comes
+	from a few Gauss-Newton iterations instead. Each img2 point is paired with its nearest reference segment
+	(or point) and contributes the point-to-line distance as a residual; linearizing the residuals around the
+	current pose gives a 3x3 system for the pose step. Pairs farther than GN_GATE are left out.
+
+	Everything is fixed point: Jacobian rows and residuals are Q10, the pose step comes out with the rotation
+	(around the scan's middle position, like the searches) in 2^-19 rad and the translation in 1/256 mm. A
+	little damping keeps directions with no information (a long corridor) from moving.
+
+	Iteration stops when the step gets small, after GN_MAX_ITER steps, or when the mean squared residual grows,
+	going back to the previous pose. If the pose ends up farther than GN_MAX_SHIFT / GN_MAX_ANG from the
+	start, the refinement is considered diverged, and the search winner is used as is.
+*/
+
+#define GN_MAX_ITER  5
+#define GN_GATE      60  // mm
+#define GN_SOFT      15  // mm
+#define GN_MIN_ROWS  40
+#define GN_MAX_SHIFT 40  // mm, the PASS2 window
+#define GN_MAX_ANG   ANG_0_5_DEG
+#define GN_DONE_XY   64  // 1/256 mm
+#define GN_DONE_ANG  ANG_0_01_DEG
+
+typedef struct
+{
+	int64_t h[3][3]; // J'J, upper triangle
+	int64_t b[3];    // -J'r
+	int64_t err;     // Sum of squared residuals
+	int n;           // Number of rows
+} gn_sys_t;
+
+typedef struct
+{
+	int32_t ang;  // Current pose; x, y in 1/256 mm
+	int32_t x, y;
+	int32_t prev_ang, prev_x, prev_y;
+	int64_t prev_err; // Mean squared residual at prev_*
+	int32_t start_ang, start_x, start_y;
+	int iter;
+	int ret; // 1 when failed: use the start pose
+} gn_t;
+
+/*
+	Adds one row: residual r (Q10 mm) along the unit normal (nx, ny) (Q14), for a point at (vx, vy) mm from
+	the rotation center. Rows are weighed down with 1/(1+(r/GN_SOFT)^2), so that the few pairs near the gate
+	(usually wrong ones) can't pull the solution.
+*/
+static void gn_add(gn_sys_t* s, int32_t nx, int32_t ny, int32_t vx, int32_t vy, int32_t r)
+{
+	int32_t j[3];
+	j[0] = (-nx*vy + ny*vx)>>15; // per 2^-11 rad
+	j[1] = nx>>4;
+	j[2] = ny>>4;
+
+	int32_t r_mm = r>>10;
+	int32_t w = (256*sq(GN_SOFT))/(sq(GN_SOFT) + sq(r_mm)); // Q8
+
+	for(int a = 0; a < 3; a++)
+	{
+		for(int c = a; c < 3; c++)
+			s->h[a][c] += ((int64_t)j[a]*j[c]*w)>>8;
+		s->b[a] -= ((int64_t)j[a]*r*w)>>8;
+	}
+	s->err += ((int64_t)r*r*w)>>8;
+	s->n++;
+}
+
+// Point-to-point pair: residual (rx, ry), Q10 mm.
+static void gn_add_point(gn_sys_t* s, int32_t vx, int32_t vy, int32_t rx, int32_t ry)
+{
+	gn_add(s, 1<<14, 0, vx, vy, rx);
+	gn_add(s, 0, 1<<14, vx, vy, ry);
+}
+
+/*
+	Copy of the n x n normal matrix, damped by max_diag>>damp_shift and scaled down to keep the elimination
+	products in int64.
+	Returns the scaling shift, or -1 if there's nothing to solve.
+*/
+static int gn_matrix(gn_sys_t* s, int n, int damp_shift, int64_t h[3][3])
+{
+	int64_t max_diag = 0;
+
+	for(int a = 0; a < n; a++)
+	{
+		for(int c = a; c < n; c++)
+			h[a][c] = h[c][a] = s->h[a][c];
+		if(h[a][a] > max_diag) max_diag = h[a][a];
+	}
+
+	if(max_diag == 0)
+		return -1;
+
+	int shift = 0;
+	while((max_diag>>shift) > (1LL<<30)) shift++;
+
+	for(int a = 0; a < n; a++)
+	{
+		for(int c = 0; c < n; c++)
+			h[a][c] >>= shift;
+		h[a][a] += (max_diag>>shift)>>damp_shift;
+	}
+
+	return shift;
+}
+
+// Gaussian elimination of h*x = b (h and b are destroyed); x gets frac_bits fractional bits, clamped to +/- max.
+static void gn_eliminate(int64_t h[3][3], int64_t b[3], int n, int64_t x[3], int frac_bits, int64_t max)
+{
+	for(int k = 0; k < n; k++)
+	{
+		for(int i = k+1; i < n; i++)
+		{
+			int64_t f = (h[i][k]<<16)/h[k][k];
+			for(int c = k; c < n; c++)
+				h[i][c] -= (f*h[k][c])>>16;
+			b[i] -= (f*b[k])>>16;
+		}
+	}
+
+	for(int k = n-1; k >= 0; k--)
+	{
+		int64_t acc = b[k]<<frac_bits;
+		for(int c = k+1; c < n; c++)
+			acc -= h[k][c]*x[c];
+		x[k] = acc/h[k][k];
+		if(x[k] > max) x[k] = max;
+		if(x[k] < -max) x[k] = -max;
+	}
+}
+
+/*
+	Solves the normal equations for the pose step. With only_ang, only the rotation is solved.
+	Returns 1 if there's nothing to solve.
+*/
+static int gn_solve(gn_sys_t* s, int only_ang, int32_t* d_ang, int32_t* d_x, int32_t* d_y)
+{
+	int64_t h[3][3], b[3];
+	int64_t x[3] = {0, 0, 0};
+	int n = only_ang ? 1 : 3;
+
+	int shift = gn_matrix(s, n, 8, h);
+	if(shift < 0)
+		return 1;
+
+	for(int a = 0; a < n; a++)
+		b[a] = s->b[a]>>shift;
+
+	gn_eliminate(h, b, n, x, 8, 1<<20);
+
+	// 2^-19 rad to pos_t angle units (2^32 per turn)
+	*d_ang = (x[0]*683565276LL)>>19;
+	*d_x = x[1];
+	*d_y = x[2];
+	return 0;
+}
+
+static void cov_set_unknown(corr_cov_t* cov)
+{
+	cov->aa = cov->xx = cov->yy = COV_UNKNOWN;
+	cov->ax = cov->ay = cov->xy = 0;
+}
+
+static int32_t cov_sat(int64_t v)
+{
+	if(v > COV_UNKNOWN) return COV_UNKNOWN;
+	if(v < -COV_UNKNOWN) return -COV_UNKNOWN;
+	return v;
+}
+
+/*
+	Covariance of the pose at the rows in s: the mean squared residual times the inverse of the normal
+	matrix. Neighbouring scan points aren't independent, so this is on the optimistic side. With only_ang,
+	the translation is unknown.
+*/
+static void gn_cov(gn_sys_t* s, int only_ang, corr_cov_t* cov)
+{
+	int64_t c[3][3];
+	int n = only_ang ? 1 : 3;
+
+	cov_set_unknown(cov);
+
+	if(s->n < GN_MIN_ROWS)
+		return;
+
+	int64_t var = s->err / s->n; // Q20 mm^2
+
+	for(int k = 0; k < n; k++)
+	{
+		int64_t h[3][3], b[3] = {0, 0, 0};
+		int64_t x[3] = {0, 0, 0};
+		// Hardly any damping: unobserved directions should come out large.
+		int shift = gn_matrix(s, n, 16, h);
+		if(shift < 0)
+			return;
+
+		// Column k of the inverse, times 2^(40+shift)
+		b[k] = 1LL<<32;
+		gn_eliminate(h, b, n, x, 8, 1LL<<30);
+		for(int i = 0; i < n; i++)
+			c[i][k] = (var*x[i])>>(32+shift); // Q8
+	}
+
+	// Rotation is in 2^-11 rad in the rows: to mrad.
+	cov->aa = cov_sat((c[0][0]*1000000)>>22);
+	if(only_ang)
+		return;
+	cov->ax = cov_sat((c[0][1]*1000)>>11);
+	cov->ay = cov_sat((c[0][2]*1000)>>11);
+	cov->xx = cov_sat(c[1][1]);
+	cov->xy = cov_sat(c[1][2]);
+	cov->yy = cov_sat(c[2][2]);
+}
+
+static void gn_init(gn_t* g, int32_t ang, int32_t x, int32_t y)
+{
+	g->ang = g->start_ang = g->prev_ang = ang;
+	g->x = g->start_x = g->prev_x = x;
+	g->y = g->start_y = g->prev_y = y;
+	g->prev_err = 0;
+	g->iter = 0;
+	g->ret = 0;
+}
+
+/*
+	s has the rows at the current pose (g->ang, g->x, g->y). Takes one step; returns 1 when finished, with the
+	result in (g->ang, g->x, g->y), or g->ret = 1.
+*/
+static int gn_step(gn_t* g, gn_sys_t* s, int only_ang)
+{
+	if(s->n < GN_MIN_ROWS)
+	{
+		g->ret = 1;
+		return 1;
+	}
+
+	// The pairs change between iterations, so the mean residual is noisy: only a clear increase counts.
+	int64_t err = s->err / s->n;
+	if(g->iter > 0 && err > g->prev_err + (g->prev_err>>2))
+	{
+		g->ang = g->prev_ang;
+		g->x = g->prev_x;
+		g->y = g->prev_y;
+		return 1;
+	}
+
+	if(g->iter >= GN_MAX_ITER)
+		return 1;
+
+	int32_t d_ang, d_x, d_y;
+	if(gn_solve(s, only_ang, &d_ang, &d_x, &d_y))
+	{
+		g->ret = 1;
+		return 1;
+	}
+
+	g->prev_ang = g->ang;
+	g->prev_x = g->x;
+	g->prev_y = g->y;
+	g->prev_err = err;
+	g->ang = (uint32_t)g->ang + (uint32_t)d_ang;
+	g->x += d_x;
+	g->y += d_y;
+	g->iter++;
+
+	int32_t tot_ang = (uint32_t)g->ang - (uint32_t)g->start_ang;
+	if(tot_ang < -GN_MAX_ANG || tot_ang > GN_MAX_ANG ||
+	   g->x - g->start_x < -(GN_MAX_SHIFT<<8) || g->x - g->start_x > (GN_MAX_SHIFT<<8) ||
+	   g->y - g->start_y < -(GN_MAX_SHIFT<<8) || g->y - g->start_y > (GN_MAX_SHIFT<<8))
+	{
+		g->ret = 1;
+		return 1;
+	}
+
+	if(d_ang > -GN_DONE_ANG && d_ang < GN_DONE_ANG &&
+	   d_x > -GN_DONE_XY && d_x < GN_DONE_XY &&
+	   d_y > -GN_DONE_XY && d_y < GN_DONE_XY)
+		return 1;
+
+	return 0;
+}
+
+#ifdef LIDAR_CORR_OFFLINE
+/*
+	Normal (Q14) of the chord over up to GN_COV_SPAN connected segments on both sides of segment i: the
+	single segment normals are mostly point noise at this sample spacing, and would make every direction
+	look observed.
+*/
+#define GN_COV_SPAN 4
+
+static int chord_normal(int i, int32_t* nx, int32_t* ny)
+{
+	int a = i, b = (i+1)&255;
+	for(int k = 0; k < GN_COV_SPAN; k++)
+	{
+		int prev = (a-1)&255;
+		if(!lines1[prev].valid || lines1[prev].len == 0) break;
+		a = prev;
+	}
+	for(int k = 0; k < GN_COV_SPAN; k++)
+	{
+		if(!lines1[b].valid || lines1[b].len == 0) break;
+		b = (b+1)&255;
+	}
+
+	int32_t dx = img1.x[b] - img1.x[a];
+	int32_t dy = img1.y[b] - img1.y[a];
+	if(dx < -30000 || dx > 30000 || dy < -30000 || dy > 30000)
+		return 0;
+	int32_t len = isqrt(sq(dx) + sq(dy));
+	if(len == 0)
+		return 0;
+	*nx = (-dy<<14)/len;
+	*ny = (dx<<14)/len;
+	return 1;
+}
+
+/*
+	Rows for do_lidar_corr(): each img2 point (rotated by scan_to_2d(), then moved by (tx, ty) in 1/256 mm)
+	against its nearest img1 segment from prep_lines(), searched in the pre_search_lines() window. When the
+	nearest spot is a segment end, or the segment has zero length, the pair is point-to-point.
+
+	With cov, for gn_cov(): only the point-to-line pairs, along chord_normal().
+*/
+static void gn_collect_lines(gn_sys_t* s, pos_t* mid2, int32_t tx, int32_t ty, int cov)
+{
+	memset(s, 0, sizeof(*s));
+
+	for(int o = 0; o < 256; o++)
+	{
+		if(!IMG_VALID(&img2, o)) continue;
+
+		int32_t px8 = (img2.x[o]<<8) + tx;
+		int32_t py8 = (img2.y[o]<<8) + ty;
+		int px = (px8+128)>>8;
+		int py = (py8+128)>>8;
+
+		int smallest = sq(GN_GATE);
+		int best = -1, best_t = 0;
+		uint8_t idx = l_starts[o];
+		int range = l_ranges[o];
+
+		for(int i = 0; i < range; i++)
+		{
+			idx++;
+			line_t* l = &lines1[idx];
+			if(!l->valid) continue;
+
+			int d = (-l->uy*px + l->ux*py - l->n0)>>14;
+			int t =  l->ux*px + l->uy*py - l->t0;
+			int dist = sq(d);
+			if(t < 0)
+				dist += sq(t>>14);
+			else if(t > l->len)
+				dist += sq((t - l->len)>>14);
+
+			if(dist < smallest)
+			{
+				smallest = dist;
+				best = idx;
+				best_t = t;
+			}
+		}
+
+		if(best < 0) continue;
+
+		line_t* l = &lines1[best];
+		int32_t vx = img2.x[o] - mid2->x;
+		int32_t vy = img2.y[o] - mid2->y;
+
+		if(l->len > 0 && best_t >= 0 && best_t <= l->len)
+		{
+			int32_t nx, ny;
+			if(!cov)
+			{
+				int32_t r = ((int64_t)-l->uy*px8 + (int64_t)l->ux*py8 - ((int64_t)l->n0<<8))>>12;
+				gn_add(s, -l->uy, l->ux, vx, vy, r);
+			}
+			else if(chord_normal(best, &nx, &ny))
+			{
+				int32_t r = ((int64_t)nx*(px8 - (img1.x[best]<<8)) + (int64_t)ny*(py8 - (img1.y[best]<<8)))>>12;
+				gn_add(s, nx, ny, vx, vy, r);
+			}
+		}
+		else if(!cov)
+		{
+			int e = (l->len > 0 && best_t > l->len) ? ((best+1)&255) : best;
+			gn_add_point(s, vx, vy, (px8 - (img1.x[e]<<8))<<2, (py8 - (img1.y[e]<<8))<<2);
+		}
+	}
+}
+
+/*
+	Step 5: Gauss-Newton refinement of corr, against the img1 segments. mid2 is from prep_images().
+	Returns 0 on success, 1 if it failed; corr is then untouched. Either way, lidar_corr_cov gets the
+	covariance of the result.
+*/
+static int refine_lines(lidar_scan_t* scan2, pos_t* mid2, pos_t* corr)
+{
+	// Segment search windows at the search winner
+	scan_to_2d_pre(scan2, &img2);
+	scan_to_2d(scan2, &img2, corr->ang, corr->x, corr->y);
+	prep_lines(&img1);
+	pre_search_lines(&img1, &img2);
+
+	gn_t g;
+	gn_sys_t s;
+	gn_init(&g, corr->ang, corr->x<<8, corr->y<<8);
+	do
+	{
+		scan_to_2d(scan2, &img2, g.ang, 0, 0);
+		gn_collect_lines(&s, mid2, g.x, g.y, 0);
+		lidar_corr_evals++;
+	} while(!gn_step(&g, &s, 0));
+
+	/*
+		Covariance at the result (at the search winner if the refinement failed). The segment ends are mostly
+		scan gaps and shadows, not corners, and would make the direction along a corridor look well known.
+	*/
+	scan_to_2d(scan2, &img2, g.ret ? corr->ang : g.ang, 0, 0);
+	gn_collect_lines(&s, mid2, g.ret ? corr->x<<8 : g.x, g.ret ? corr->y<<8 : g.y, 1);
+	gn_cov(&s, 0, &lidar_corr_cov);
+	lidar_corr_evals++;
+
+	if(g.ret)
+		return 1;
+
+	corr->ang = g.ang;
+	corr->x = (g.x+128)>>8;
+	corr->y = (g.y+128)>>8;
+	return 0;
+}
+#endif
+
+/*
+	Orientation histograms, for a rotation estimate before the search.
+
+	Each pair of valid image points HIST_SPAN indeces apart (and closer than HIST_SPAN*LINE_MAX_LEN) votes for
+	the direction of the chord between them, folded to 0..180 degrees and split linearly between the two nearest
+	of HIST_BINS bins; walls give peaks. Rotating a scan shifts its histogram circularly, and moving it doesn't
+	change it at all, so the rotation between two scans is where the circular cross-correlation of their
+	histograms peaks, whatever the translation. Only +/- HIST_MAX_SHIFT bins are looked at: the histogram of a
+	rectangular room repeats every 90 degrees.
+
+	The estimate recentres the first angle pass (PASS1_A, LIVE_PASS1_A) when the peak is inside the window, and
+	either next to zero or clearly better than no rotation.
+*/
+
+#define HIST_BINS      90 // 2 degrees
+#define HIST_SPAN      3
+#define HIST_MAX_SHIFT 6
+
+CORR_TLS int lidar_corr_orient_hist = 1;
+
+static CORR_TLS uint16_t orient_hist1[HIST_BINS];
+static CORR_TLS uint16_t orient_hist2[HIST_BINS];
+
+// Bearing of (x,y) in 1/256 degrees, 0..360*256-1 counterclockwise from the x axis. Error is below 0.3 degrees.
+static int32_t bearing_256(int32_t x, int32_t y)
+{
+	uint32_t ax = (x<0)?-x:x;
+	uint32_t ay = (y<0)?-y:y;
+
+	if(ax == 0 && ay == 0)
+		return 0;
+
+	// atan(t) ~= 45*t + 15.64*t*(1-t) degrees for t = 0..1. t is Q15.
+	uint32_t t = (ax >= ay) ? (ay<<15)/ax : (ax<<15)/ay;
+	int32_t a = (11520*t + 4004*((t*(32768-t))>>15))>>15;
+
+	if(ax < ay) a = 90*256 - a;
+	if(x < 0) a = 180*256 - a;
+	if(y < 0) a = 360*256 - a;
+
+	if(a >= 360*256) a -= 360*256;
+	return a;
+}
+
+// Bearing of (x,y) in whole degrees, 0..359.
+static int bearing_deg(int32_t x, int32_t y)
+{
+	int a = (bearing_256(x, y)+128)>>8;
+	if(a >= 360) a -= 360;
+	return a;
+}
+
+// Votes are 0..64, so that 360 points fit in uint16.
+static void orient_hist(img_t* img, int n, uint16_t* hist)
+{
+	for(int h = 0; h < HIST_BINS; h++)
+		hist[h] = 0;
+
+	for(int i = 0; i < n; i++)
+	{
+		int j = i + HIST_SPAN;
+		if(j >= n) j -= n;
+		if(!IMG_VALID(img, i) || !IMG_VALID(img, j)) continue;
+
+		int32_t dx = img->x[j] - img->x[i];
+		int32_t dy = img->y[j] - img->y[i];
+		if(sq(dx) + sq(dy) > sq(HIST_SPAN*LINE_MAX_LEN)) continue;
+
+		int32_t a = bearing_256(dx, dy);
+		if(a >= 180*256) a -= 180*256;
+
+		// 512 units per bin
+		int h = a>>9;
+		int frac = (a&511)>>3;
+		hist[h] += 64 - frac;
+		hist[(h+1)%HIST_BINS] += frac;
+	}
+}
+
+// Rotation correction (2^32 per turn) for img2 to line up with img1, both n-point images; 0 without a good estimate.
+static int32_t orient_hist_rotation(img_t* img1, img_t* img2, int n)
+{
+	uint32_t c[2*HIST_MAX_SHIFT+1];
+	int best = HIST_MAX_SHIFT;
+
+	orient_hist(img1, n, orient_hist1);
+	orient_hist(img2, n, orient_hist2);
+
+	for(int s = 0; s < 2*HIST_MAX_SHIFT+1; s++)
+	{
+		uint32_t sum = 0;
+		int k2 = s - HIST_MAX_SHIFT + HIST_BINS;
+		for(int k = 0; k < HIST_BINS; k++)
+		{
+			if(k2 >= HIST_BINS) k2 -= HIST_BINS;
+			sum += orient_hist1[k]*orient_hist2[k2];
+			k2++;
+		}
+		c[s] = sum;
+		if(sum > c[best]) best = s;
+	}
+
+	if(best == 0 || best == 2*HIST_MAX_SHIFT)
+		return 0;
+
+	if((best < HIST_MAX_SHIFT-1 || best > HIST_MAX_SHIFT+1) && (uint64_t)c[best]*8 < (uint64_t)c[HIST_MAX_SHIFT]*9)
+		return 0;
+
+	// Parabola through the peak and its neighbours; shift in 1/256 bins.
+	int64_t den = 2*(int64_t)c[best] - c[best-1] - c[best+1];
+	int32_t shift = (best - HIST_MAX_SHIFT)<<8;
+	if(den > 0)
+		shift += (((int64_t)c[best+1] - c[best-1])<<7)/den;
+
+	// img2 is rotated by the shift (2 degrees per bin); undo it.
+	return -(((int64_t)shift*2*ANG_1_DEG)>>8);
+}
+
+/*
+	Degeneracy: which translations the reference image constrains at all.
+
+	Each wall point constrains the translation along its surface normal only. The normal scatter matrix
+	sum(n*n^T) over the HIST_SPAN chords of orient_hist() tells how well each direction is covered: in a long
+	corridor, its smaller eigenvalue is next to zero, and the score is a flat ridge along the corridor (see the
+	development history in lidar.c). Any shift found along the ridge is made up by the point sampling.
+
+	With unit chord directions (c, s), the scatter matrix is n/2*I + 1/2*[C S; S -C] with C = sum(c^2-s^2),
+	S = sum(2cs), so the eigenvalues are (n +/- r)/2, r = sqrt(C^2+S^2), and the walls run at half the
+	angle of (C, S). No trigonometry needed.
+
+	When the smaller eigenvalue is below 1/DEGEN_RATIO of the bigger one, the searches only try translations
+	along the constrained direction, and the result has nothing along the other one: degen_project() removes
+	it and gives it the variance COV_UNOBSERVED, so the correction never moves the robot along the corridor.
+
+	The live matcher only searches x,y with livelidar_xy set, which is off by default: the firmware still corrects
+	the angle only, and does without this until x,y is validated on the robot.
+*/
+
+#define DEGEN_RATIO      12
+#define DEGEN_MIN_CHORDS 40
+
+CORR_TLS int lidar_corr_degen_check = 1;
+CORR_TLS int lidar_corr_degen; // The latest match only had one translation direction; see degen_project()
+
+typedef struct
+{
+	int on;
+	int32_t nx, ny; // Q14 unit vector along the constrained direction
+} degen_t;
+
+#ifdef LIDAR_CORR_OFFLINE
+static CORR_TLS degen_t corr_degen; // do_lidar_corr(), do_lidar_corr_bnb()
+#endif
+
+// Fills in d from the n-point image img. Returns d->on.
+static int degen_check(img_t* img, int n, degen_t* d)
+{
+	int32_t c = 0, s = 0; // Q10
+	int chords = 0;
+
+	d->on = 0;
+
+	for(int i = 0; i < n; i++)
+	{
+		int j = i + HIST_SPAN;
+		if(j >= n) j -= n;
+		if(!IMG_VALID(img, i) || !IMG_VALID(img, j)) continue;
+
+		int32_t dx = img->x[j] - img->x[i];
+		int32_t dy = img->y[j] - img->y[i];
+		int32_t len_sq = sq(dx) + sq(dy);
+		if(len_sq == 0 || len_sq > sq(HIST_SPAN*LINE_MAX_LEN)) continue;
+
+		c += ((sq(dx) - sq(dy))<<10)/len_sq;
+		s += ((2*dx*dy)<<10)/len_sq;
+		chords++;
+	}
+
+	if(chords < DEGEN_MIN_CHORDS)
+		return 0;
+
+	// Q6 from here on, so that the squares fit.
+	c >>= 4;
+	s >>= 4;
+	int32_t r = isqrt(sq(c) + sq(s));
+	int32_t all = chords<<6;
+	if((all - r)*DEGEN_RATIO >= all + r)
+		return 0;
+
+	// Direction of the walls: half the angle of (c, s).
+	int32_t ux, uy;
+	if(c >= 0)
+	{
+		ux = r + c;
+		uy = s;
+	}
+	else
+	{
+		ux = s;
+		uy = r - c;
+	}
+	int32_t len = isqrt(sq(ux) + sq(uy));
+	if(len == 0)
+		return 0;
+
+	d->nx = (-uy<<14)/len;
+	d->ny = (ux<<14)/len;
+	d->on = 1;
+	return 1;
+}
+
+// Translation of search candidate (t, u). When degenerate, t is along the constrained direction, and only u = 0 is searched.
+static void degen_offset(degen_t* d, int32_t t, int32_t u, int32_t* x, int32_t* y)
+{
+	if(!d->on)
+	{
+		*x = t;
+		*y = u;
+		return;
+	}
+	*x = (t*d->nx + (1<<13))>>14;
+	*y = (t*d->ny + (1<<13))>>14;
+}
+
+// Search table index range for u, num entries with 0 in the middle.
+#define DEGEN_U_FIRST(d, num) ((d)->on ? (num)/2 : 0)
+#define DEGEN_U_END(d, num)   ((d)->on ? (num)/2+1 : (num))
+
+// Removes the unconstrained part of the translation in corr, and marks it unknown in cov.
+static void degen_project(degen_t* d, pos_t* corr, corr_cov_t* cov)
+{
+	if(!d->on)
+		return;
+
+	int32_t nx = d->nx, ny = d->ny;
+	int32_t t = ((int64_t)corr->x*nx + (int64_t)corr->y*ny + (1<<13))>>14;
+	corr->x = (t*nx + (1<<13))>>14;
+	corr->y = (t*ny + (1<<13))>>14;
+
+	if(cov->xx == COV_UNKNOWN || cov->yy == COV_UNKNOWN)
+		return;
+
+	int64_t var_n = ((int64_t)cov->xx*nx*nx + 2*(int64_t)cov->xy*nx*ny + (int64_t)cov->yy*ny*ny)>>28;
+	int64_t var_u = COV_UNOBSERVED;
+	cov->xx = cov_sat((var_n*nx*nx + var_u*ny*ny)>>28);
+	cov->yy = cov_sat((var_n*ny*ny + var_u*nx*nx)>>28);
+	cov->xy = cov_sat(((var_n - var_u)*nx*ny)>>28);
+
+	int64_t c_an = ((int64_t)cov->ax*nx + (int64_t)cov->ay*ny)>>14;
+	cov->ax = cov_sat((c_an*nx)>>14);
+	cov->ay = cov_sat((c_an*ny)>>14);
+}
+
+#ifdef LIDAR_CORR_OFFLINE
+/*
+	PASS1, coarse-to-fine: every candidate is scored on every COARSE_STRIDE-th point only, and the COARSE_TOP_K
+	best ones are rescored on all points, best first, each one given up as soon as it can't win anymore.
+*/
+
+#define COARSE_STRIDE 4
+#define COARSE_TOP_K  12
+
+static void pass1_coarse_to_fine(lidar_scan_t* scan2, int32_t ang, int32_t (*p_calc_f)(img_t*, img_t*, int32_t, int32_t),
+	int* biggest_lvl, int* best_a, int* best_x, int* best_y)
+{
+	int32_t top_lvl[COARSE_TOP_K];
+	uint16_t top_cand[COARSE_TOP_K]; // (a*PASS1_NUM_X + x)*PASS1_NUM_Y + y
+	int n_top = 0;
+
+	match_stride = COARSE_STRIDE;
+	for(int a_corr = 0; a_corr < PASS1_NUM_A; a_corr++)
+	{
+		scan_to_2d(scan2, &img2, ang + PASS1_A[a_corr], 0, 0);
+
+		for(int x_corr = 0; x_corr < PASS1_NUM_X; x_corr++)
+		{
+			for(int y_corr = DEGEN_U_FIRST(&corr_degen, PASS1_NUM_Y); y_corr < DEGEN_U_END(&corr_degen, PASS1_NUM_Y); y_corr++)
+			{
+				int32_t ox, oy;
+				degen_offset(&corr_degen, PASS1_T(PASS1_X[x_corr]), PASS1_T(PASS1_Y[y_corr]), &ox, &oy);
+				int lvl = p_calc_f(&img1, &img2, ox, oy);
+				lvl = lvl * PASS1_W(PASS1_A_WEIGH[a_corr] * PASS1_X_WEIGH[x_corr] * PASS1_Y_WEIGH[y_corr]);
+				lidar_corr_evals++;
+
+				if(n_top == COARSE_TOP_K && lvl <= top_lvl[n_top-1])
+					continue;
+
+				int i = (n_top < COARSE_TOP_K) ? n_top++ : n_top-1;
+				while(i > 0 && top_lvl[i-1] < lvl)
+				{
+					top_lvl[i] = top_lvl[i-1];
+					top_cand[i] = top_cand[i-1];
+					i--;
+				}
+				top_lvl[i] = lvl;
+				top_cand[i] = (a_corr*PASS1_NUM_X + x_corr)*PASS1_NUM_Y + y_corr;
+			}
+		}
+	}
+	match_stride = 1;
+
+	int cur_a = -1;
+	for(int i = 0; i < n_top; i++)
+	{
+		int a_corr = top_cand[i] / (PASS1_NUM_X*PASS1_NUM_Y);
+		int x_corr = (top_cand[i] / PASS1_NUM_Y) % PASS1_NUM_X;
+		int y_corr = top_cand[i] % PASS1_NUM_Y;
+
+		if(a_corr != cur_a)
+		{
+			scan_to_2d(scan2, &img2, ang + PASS1_A[a_corr], 0, 0);
+			cur_a = a_corr;
+		}
+
+		int w = PASS1_W(PASS1_A_WEIGH[a_corr] * PASS1_X_WEIGH[x_corr] * PASS1_Y_WEIGH[y_corr]);
+		int32_t ox, oy;
+		degen_offset(&corr_degen, PASS1_T(PASS1_X[x_corr]), PASS1_T(PASS1_Y[y_corr]), &ox, &oy);
+		match_bound = *biggest_lvl/w + 1;
+		int lvl = p_calc_f(&img1, &img2, ox, oy) * w;
+		lidar_corr_evals++;
+
+		if(lvl > *biggest_lvl)
+		{
+			*biggest_lvl = lvl;
+			*best_a = a_corr;
+			*best_x = x_corr;
+			*best_y = y_corr;
+		}
+	}
+	match_bound = 0;
+}
+
+int do_lidar_corr(lidar_scan_t* scan1, lidar_scan_t* scan2, pos_t* corr)
+{
+	// scan1 stays the same. scan2 goes through pose corrections and scan_to_2d is called again every time.
+
+	corr->ang = 0;
+	corr->x = 0;
+	corr->y = 0;
+	lidar_corr_evals = 0;
+	lidar_corr_pts = 0;
+	lidar_corr_degen = 0;
+	cov_set_unknown(&lidar_corr_cov);
+
+	pos_t mid2;
+	if(prep_images(scan1, scan2, &mid2))
+		return 1;
+
+	corr_degen.on = 0;
+	if(lidar_corr_degen_check)
+		degen_check(&img1, 256, &corr_degen);
+
+	// Start the search from the orientation histogram estimate.
+	if(lidar_corr_orient_hist)
+	{
+		corr->ang = orient_hist_rotation(&img1, &img2, 256);
+		scan_to_2d(scan2, &img2, corr->ang, 0, 0);
+	}
+
+	/*
+	Step 3:
+	For optimization, run one full "slow" image matching round, generating optimization tables.
+	*/
+
+	int32_t (*p_calc_f)(img_t*, img_t*, int32_t, int32_t);
+
+	if(lidar_corr_mode == LIDAR_CORR_MODE_LINES)
+	{
+		prep_lines(&img1);
+		pre_search_lines(&img1, &img2);
+		p_calc_f = &calc_match_lvl_lines;
+	}
+	else if(lidar_corr_mode == LIDAR_CORR_MODE_GRID)
+	{
+		prep_grid(&img1, mid2.x, mid2.y);
+		p_calc_f = &calc_match_lvl_grid;
+	}
+	else
+	{
+		nn_build(&img1);
+		p_calc_f = &calc_match_lvl;
+	}
+
+	// Run PASS 1
+
+	int biggest_lvl = 0;
+	int best_a = 0, best_x = 0, best_y = 0;
+	int32_t ox, oy;
+	if(lidar_corr_coarse)
+	{
+		pass1_coarse_to_fine(scan2, corr->ang, p_calc_f, &biggest_lvl, &best_a, &best_x, &best_y);
+	}
+	else
+	{
+		for(int a_corr = 0; a_corr < PASS1_NUM_A; a_corr++)
+		{
+			scan_to_2d(scan2, &img2, corr->ang + PASS1_A[a_corr], 0, 0);
+
+			for(int x_corr = 0; x_corr < PASS1_NUM_X; x_corr++)
+			{
+				for(int y_corr = DEGEN_U_FIRST(&corr_degen, PASS1_NUM_Y); y_corr < DEGEN_U_END(&corr_degen, PASS1_NUM_Y); y_corr++)
+				{
+//					dev_send_jutsk(img1, 0);
+//					dev_send_jutsk(img2, 1);
+
+					degen_offset(&corr_degen, PASS1_T(PASS1_X[x_corr]), PASS1_T(PASS1_Y[y_corr]), &ox, &oy);
+					int lvl = p_calc_f(&img1, &img2, ox, oy);
+					lvl = lvl * PASS1_W(PASS1_A_WEIGH[a_corr] * PASS1_X_WEIGH[x_corr] * PASS1_Y_WEIGH[y_corr]);
+					lidar_corr_evals++;
+//					dev_send_hommel(scan1, scan2, lvl);
+
+					if(lvl > biggest_lvl)
+					{
+						biggest_lvl = lvl;
+						best_a = a_corr;
+						best_x = x_corr;
+						best_y = y_corr;
+					}
+				}
+			}
+		}
+	}
+
+	if(biggest_lvl == 0)
+	{
+		return 2;
+	}
+
+	// Correct to the best match.
+	degen_offset(&corr_degen, PASS1_T(PASS1_X[best_x]), PASS1_T(PASS1_Y[best_y]), &ox, &oy);
+	corr->ang    += PASS1_A[best_a];
+	corr->x      += ox;
+	corr->y      += oy;
+
+	// Run pass 2
+
+	biggest_lvl = 0;
+
+	for(int a_corr = 0; a_corr < PASS2_NUM_A; a_corr++)
+	{
+		scan_to_2d(scan2, &img2, corr->ang + PASS2_A[a_corr], 0, 0);
+
+		for(int x_corr = 0; x_corr < PASS2_NUM_X; x_corr++)
+		{
+			for(int y_corr = DEGEN_U_FIRST(&corr_degen, PASS2_NUM_Y); y_corr < DEGEN_U_END(&corr_degen, PASS2_NUM_Y); y_corr++)
+			{
+				degen_offset(&corr_degen, PASS2_X[x_corr], PASS2_Y[y_corr], &ox, &oy);
+				if(lidar_corr_coarse) match_bound = biggest_lvl + 1;
+				int lvl = p_calc_f(&img1, &img2, corr->x + ox, corr->y + oy);
+				lidar_corr_evals++;
 
 				if(lvl > biggest_lvl)
 				{
@@ -732,45 +1890,43 @@ int do_lidar_corr(lidar_scan_t* scan1, lidar_scan_t* scan2, pos_t* corr)
 	}
 
 
+	match_bound = 0;
+
 	if(biggest_lvl == 0)
 	{
-		COPY_POS(scan2->pos, scan2_very_orig_pos);
 		return 3;
 	}
 
-	// Correct orig_pos to the best match.
-	orig_pos.ang += PASS2_A[best_a];
-	orig_pos.x   += PASS2_X[best_x];
-	orig_pos.y   += PASS2_Y[best_y];
+	// Correct to the best match.
+	degen_offset(&corr_degen, PASS2_X[best_x], PASS2_Y[best_y], &ox, &oy);
 	corr->ang    += PASS2_A[best_a];
-	corr->x      += PASS2_X[best_x];
-	corr->y      += PASS2_Y[best_y];
+	corr->x      += ox;
+	corr->y      += oy;
 
-//	COPY_POS(scan2->pos, orig_pos);
-//	dev_send_hommel(scan1, scan2, biggest_lvl);
-//	delay_ms(5000);
-	
+	// Fine alignment. The PASS3 grid is only run if the refinement fails.
+
+	if(!refine_lines(scan2, &mid2, corr))
+	{
+		degen_project(&corr_degen, corr, &lidar_corr_cov);
+		lidar_corr_degen = corr_degen.on;
+		return 0;
+	}
 
 	// Run pass 3
 
 	biggest_lvl = 0;
 	for(int a_corr = 0; a_corr < PASS3_NUM_A; a_corr++)
 	{
-		scan2->pos.ang = orig_pos.ang + PASS3_A[a_corr];
+		scan_to_2d(scan2, &img2, corr->ang + PASS3_A[a_corr], 0, 0);
+
 		for(int x_corr = 0; x_corr < PASS3_NUM_X; x_corr++)
 		{
-			scan2->pos.x = orig_pos.x + PASS3_X[x_corr];
-			for(int y_corr = 0; y_corr < PASS3_NUM_Y; y_corr++)
+			for(int y_corr = DEGEN_U_FIRST(&corr_degen, PASS3_NUM_Y); y_corr < DEGEN_U_END(&corr_degen, PASS3_NUM_Y); y_corr++)
 			{
-				scan2->pos.y = orig_pos.y + PASS3_Y[y_corr];
-
-				scan_to_2d(scan2, img2);
-
-//				dev_send_jutsk(img1, 0);
-//				dev_send_jutsk(img2, 1);
-
-				int lvl = calc_match_lvl(img1, img2);
-//				dev_send_hommel(scan1, scan2, lvl);
+				degen_offset(&corr_degen, PASS3_X[x_corr], PASS3_Y[y_corr], &ox, &oy);
+				if(lidar_corr_coarse) match_bound = biggest_lvl + 1;
+				int lvl = p_calc_f(&img1, &img2, corr->x + ox, corr->y + oy);
+				lidar_corr_evals++;
 
 				if(lvl > biggest_lvl)
 				{
@@ -783,186 +1939,868 @@ int do_lidar_corr(lidar_scan_t* scan1, lidar_scan_t* scan2, pos_t* corr)
 		}
 	}
 
+	match_bound = 0;
+
 	if(biggest_lvl == 0)
 	{
-		COPY_POS(scan2->pos, scan2_very_orig_pos);
 		return 4;
 	}
 
-	// Correct orig_pos to the best match.
-	orig_pos.ang += PASS3_A[best_a];
-	orig_pos.x   += PASS3_X[best_x];
-	orig_pos.y   += PASS3_Y[best_y];
+	// Correct to the best match.
+	degen_offset(&corr_degen, PASS3_X[best_x], PASS3_Y[best_y], &ox, &oy);
 	corr->ang    += PASS3_A[best_a];
-	corr->x      += PASS3_X[best_x];
-	corr->y      += PASS3_Y[best_y];
+	corr->x      += ox;
+	corr->y      += oy;
+
+	degen_project(&corr_degen, corr, &lidar_corr_cov);
+	lidar_corr_degen = corr_degen.on;
+	return 0;
+}
+
+
+#ifdef LIDAR_CORR_BNB
+
+/*
+	Branch-and-bound search over the grid generated by prep_grid().
+
+	Instead of the fixed coarse-to-fine passes, which can lock onto a wrong local maximum in PASS1, this
+	returns the best (ang,x,y) on the whole search lattice: 16 mm (half grid cell) translation steps within
+	+/- 192 mm, and 0.25 deg angle steps within +/- 3 deg. The winner is then refined off the lattice with
+	refine_lines().
+
+	A node is a 2^k x 2^k square of translations at one angle. Its upper bound is the sum over img2 points
+	of the biggest grid value the point can hit anywhere in the square. The bounds come from max-pooled copies
+	of the grid, level l having one byte per 2^l x 2^l cells: the cells a point can hit span at most 2x2
+	level k-1 blocks, so the bound is 4 lookups per point. Nodes whose bound doesn't beat the best score
+	found so far are dropped without looking inside.
+*/
+
+#define BNB_LAT_SHIFT (GRID_CELL_SHIFT-1) // translation lattice step = 16 mm
+#define BNB_DEPTH 5   // Root squares are 32x32 lattice points
+#define BNB_T_RANGE 12 // -12..+12 lattice points = +/- 192 mm
+#define BNB_NUM_A 25
+#define BNB_A_STEP ANG_0_25_DEG
+
+static CORR_TLS uint8_t bnb_pyramid_buf[(GRID_SIZE/2)*(GRID_SIZE/2) + (GRID_SIZE/4)*(GRID_SIZE/4) + (GRID_SIZE/8)*(GRID_SIZE/8) + (GRID_SIZE/16)*(GRID_SIZE/16)];
+static CORR_TLS uint8_t* bnb_pyramid[BNB_DEPTH];
+
+// img2 points in lattice units relative to the grid corner, invalid points left out.
+static CORR_TLS int16_t bnb_qx[256], bnb_qy[256];
+static CORR_TLS int bnb_n;
+
+typedef struct
+{
+	int16_t tx;
+	int16_t ty;
+	int16_t k;
+	int32_t bound;
+} bnb_node_t;
+
+// Each expansion pops one node and pushes at most four.
+static CORR_TLS bnb_node_t bnb_stack[3*BNB_DEPTH+1];
+
+#define MAX(a,b) (((a)>(b))?(a):(b))
+
+static void prep_bnb_pyramid()
+{
+	uint8_t* p = bnb_pyramid_buf;
+	bnb_pyramid[0] = match_grid;
+	for(int l = 1; l < BNB_DEPTH; l++)
+	{
+		int s = GRID_SIZE>>l;
+		uint8_t* src = bnb_pyramid[l-1];
+		bnb_pyramid[l] = p;
+		for(int y = 0; y < s; y++)
+		{
+			for(int x = 0; x < s; x++)
+			{
+				uint8_t* a = &src[(2*y)*(2*s) + 2*x];
+				p[y*s+x] = MAX(MAX(a[0], a[1]), MAX(a[2*s], a[2*s+1]));
+			}
+		}
+		p += s*s;
+	}
+}
+
+static void bnb_rotate(lidar_scan_t* scan2, int32_t ang)
+{
+	scan_to_2d(scan2, &img2, ang, 0, 0);
+	bnb_n = 0;
+	for(int i = 0; i < 256; i++)
+	{
+		if(!IMG_VALID(&img2, i)) continue;
+		bnb_qx[bnb_n] = (img2.x[i] - grid_x0)>>BNB_LAT_SHIFT;
+		bnb_qy[bnb_n] = (img2.y[i] - grid_y0)>>BNB_LAT_SHIFT;
+		bnb_n++;
+	}
+}
+
+// Exact score at translation (tx,ty); same as calc_match_lvl_grid() with img2 moved by (tx,ty)<<BNB_LAT_SHIFT.
+static int32_t bnb_score(int tx, int ty)
+{
+	int32_t sum = 0;
+	for(int i = 0; i < bnb_n; i++)
+	{
+		unsigned int cx = (bnb_qx[i]+tx)>>1;
+		unsigned int cy = (bnb_qy[i]+ty)>>1;
+		if(cx >= GRID_SIZE || cy >= GRID_SIZE) continue;
+		sum += match_grid[cy*GRID_SIZE+cx];
+	}
+	lidar_corr_evals++;
+	return sum;
+}
+
+// Upper bound of bnb_score() for translations tx..tx+2^k-1, ty..ty+2^k-1. k >= 1.
+static int32_t bnb_bound(int tx, int ty, int k)
+{
+	uint8_t* g = bnb_pyramid[k-1];
+	unsigned int s = GRID_SIZE>>(k-1);
+	int span = (1<<k)-1;
+	int32_t sum = 0;
+	for(int i = 0; i < bnb_n; i++)
+	{
+		int x = bnb_qx[i]+tx;
+		int y = bnb_qy[i]+ty;
+		unsigned int bx0 = x>>k, bx1 = (x+span)>>k;
+		unsigned int by0 = y>>k, by1 = (y+span)>>k;
+		int best = 0;
+		if(by0 < s)
+		{
+			if(bx0 < s) best = MAX(best, g[by0*s+bx0]);
+			if(bx1 < s) best = MAX(best, g[by0*s+bx1]);
+		}
+		if(by1 < s)
+		{
+			if(bx0 < s) best = MAX(best, g[by1*s+bx0]);
+			if(bx1 < s) best = MAX(best, g[by1*s+bx1]);
+		}
+		sum += best;
+	}
+	lidar_corr_evals++;
+	return sum;
+}
+
+/*
+	Depth-first search of the translation squares at the current angle (bnb_rotate() already called), best child first.
+	Updates *best_lvl, *best_x, *best_y when a better leaf is found.
+*/
+static void bnb_search_translations(int32_t root_bound, int32_t* best_lvl, int* best_x, int* best_y)
+{
+	int sp = 0;
+	bnb_stack[sp].tx = -(1<<(BNB_DEPTH-1));
+	bnb_stack[sp].ty = -(1<<(BNB_DEPTH-1));
+	bnb_stack[sp].k = BNB_DEPTH;
+	bnb_stack[sp].bound = root_bound;
+	sp++;
+
+	while(sp)
+	{
+		bnb_node_t node = bnb_stack[--sp];
+		if(node.bound <= *best_lvl)
+			continue;
+
+		if(node.k == 0)
+		{
+			*best_lvl = node.bound;
+			*best_x = node.tx;
+			*best_y = node.ty;
+			continue;
+		}
+
+		int half = 1<<(node.k-1);
+		bnb_node_t children[4];
+		int n_children = 0;
+		for(int c = 0; c < 4; c++)
+		{
+			int tx = node.tx + ((c&1)?half:0);
+			int ty = node.ty + ((c&2)?half:0);
+			if(tx > BNB_T_RANGE || ty > BNB_T_RANGE || tx+half-1 < -BNB_T_RANGE || ty+half-1 < -BNB_T_RANGE)
+				continue;
+
+			int32_t bound = (node.k == 1) ? bnb_score(tx, ty) : bnb_bound(tx, ty, node.k-1);
+			if(bound <= *best_lvl)
+				continue;
+
+			// Insertion sort, ascending bound: the best child ends up on the top of the stack.
+			int i = n_children++;
+			while(i > 0 && children[i-1].bound > bound)
+			{
+				children[i] = children[i-1];
+				i--;
+			}
+			children[i].tx = tx;
+			children[i].ty = ty;
+			children[i].k = node.k-1;
+			children[i].bound = bound;
+		}
+
+		for(int i = 0; i < n_children; i++)
+			bnb_stack[sp++] = children[i];
+	}
+}
+
+int do_lidar_corr_bnb(lidar_scan_t* scan1, lidar_scan_t* scan2, pos_t* corr)
+{
+	corr->ang = 0;
+	corr->x = 0;
+	corr->y = 0;
+	lidar_corr_evals = 0;
+	lidar_corr_degen = 0;
+	cov_set_unknown(&lidar_corr_cov);
+
+	pos_t mid2;
+	if(prep_images(scan1, scan2, &mid2))
+		return 1;
+
+	corr_degen.on = 0;
+	if(lidar_corr_degen_check)
+		degen_check(&img1, 256, &corr_degen);
+
+	prep_grid(&img1, mid2.x, mid2.y);
+	prep_bnb_pyramid();
+
+	// The angle window is centred on the orientation histogram estimate.
+	int32_t a0 = lidar_corr_orient_hist ? orient_hist_rotation(&img1, &img2, 256) : 0;
+
+	// Start from the uncorrected pose (or the estimate), so that equal scores elsewhere don't move the result.
+	int32_t best_lvl;
+	int best_a = BNB_NUM_A/2, best_x = 0, best_y = 0;
+	bnb_rotate(scan2, a0);
+	best_lvl = bnb_score(0, 0);
+
+	// Root bounds for all angles, then search the angles in the order of decreasing bound.
+	int32_t root_bounds[BNB_NUM_A];
+	uint8_t order[BNB_NUM_A];
+	for(int a = 0; a < BNB_NUM_A; a++)
+	{
+		bnb_rotate(scan2, a0 + (a-BNB_NUM_A/2)*BNB_A_STEP);
+		int32_t bound = bnb_bound(-(1<<(BNB_DEPTH-1)), -(1<<(BNB_DEPTH-1)), BNB_DEPTH);
+
+		int i = a;
+		while(i > 0 && root_bounds[order[i-1]] < bound)
+		{
+			order[i] = order[i-1];
+			i--;
+		}
+		order[i] = a;
+		root_bounds[a] = bound;
+	}
+
+	for(int i = 0; i < BNB_NUM_A; i++)
+	{
+		int a = order[i];
+		if(root_bounds[a] <= best_lvl)
+			break;
+
+		bnb_rotate(scan2, a0 + (a-BNB_NUM_A/2)*BNB_A_STEP);
+		int32_t lvl = best_lvl;
+		int x = 0, y = 0;
+		bnb_search_translations(root_bounds[a], &lvl, &x, &y);
+		if(lvl > best_lvl)
+		{
+			best_lvl = lvl;
+			best_a = a;
+			best_x = x;
+			best_y = y;
+		}
+	}
+
+	if(best_lvl == 0)
+	{
+		return 2;
+	}
+
+	corr->ang = a0 + (best_a-BNB_NUM_A/2)*BNB_A_STEP;
+	corr->x = best_x<<BNB_LAT_SHIFT;
+	corr->y = best_y<<BNB_LAT_SHIFT;
 
-//	COPY_POS(scan2->pos, orig_pos);
-//	dev_send_hommel(scan1, scan2, biggest_lvl);
-//	delay_ms(5000);
+	// Off the lattice; if the refinement fails, the lattice point is good enough.
+	refine_lines(scan2, &mid2, corr);
 
-	COPY_POS(scan2->pos, scan2_very_orig_pos);
+	// The branch-and-bound still searches both directions; the ridge is only cut off from the result.
+	degen_project(&corr_degen, corr, &lidar_corr_cov);
+	lidar_corr_degen = corr_degen.on;
 	return 0;
 }
 
+#endif
+#endif
+
+
+/*
+	Live scan matching, on the MCU.
+
+	The matcher is anytime: livelidar_start() takes a new scan, livelidar_run() continues the search for a given
+	time budget, and can be called whenever the main loop has nothing else to do. The best pose found so far is
+	kept in live_search, with its quality. livelidar_finish() ends the search, at the latest when the next scan is
+	ready, and uses the best pose so far: a late match gives a coarser correction, not nothing.
+
+	The new scan is matched against a reference: with LIVELIDAR_MODE_SUBMAP, the rolling submap of the earlier
+	corrected scans (see submap_insert()); with LIVELIDAR_MODE_SCAN, the previous scan with its correction
+	applied, or an older one when the robot has hardly moved (see livelidar_finish()). The correction is given to
+	lidar_correct_pose(), which applies it to the robot pose at the next scan boundary. Scans started before that
+	don't have it, and get it in livelidar_start(): lidar_scan_corr_seq() tells which corrections a scan has.
+
+	The live kernels only compare points with similar indeces. Both scans are binned to LIVE_BINS one-degree bins
+	by the world-frame bearing of each point, seen from where the sensor was when the point was sampled (the pose
+	is interpolated between pos_at_start and pos_at_end). The nearest point wins its bin.
+*/
+
+#define LIVE_BINS 360
+
+static CORR_TLS lidar_scan_t livelidar_ref; // Reference scan, corrected
+static CORR_TLS lidar_scan_t livelidar_cur; // Copy of the scan being matched
+static CORR_TLS int livelidar_ref_ok;
+
+static CORR_TLS img_t livelid2d_img1; // Reference
+static CORR_TLS img_t livelid2d_img2; // New scan
+
+// Scan point index in each bin
+static CORR_TLS int16_t livelid2d_idx1[LIVE_BINS];
+static CORR_TLS int16_t livelid2d_idx2[LIVE_BINS];
+
+static CORR_TLS uint32_t live_bin_dist[LIVE_BINS];
+
+// Live images are referenced to live_origin (the reference scan's middle position) to fit in int16.
+static CORR_TLS xy_i32_t live_origin;
+
+img_t lidar_collision_avoidance;
+extern volatile int lidar_collision_avoidance_new;
+
+// Incremented by reset_lidar_corr_images() (from interrupts), followed on the main thread.
+static CORR_TLS volatile int reset_cnt;
+static CORR_TLS int reset_cnt_seen;
+
+// Corrections given to lidar_correct_pose(), numbered from 0 like lidar_scan_corr_seq() counts them.
+#define LIVE_SENT_LEN 4
+static CORR_TLS pos_t live_sent_mid[LIVE_SENT_LEN];
+static CORR_TLS pos_t live_sent_corr[LIVE_SENT_LEN];
+static CORR_TLS int live_sent_cnt;
+
+CORR_TLS livelidar_report_t livelidar_report;
+
+void reset_lidar_corr_images()
+{
+	reset_cnt++;
+}
+
+/*
+	Bins the scan points by bearing as described above; idx gets the point index per bin, and img the validness.
+	Points are within +/- 30000 mm of refxy, so the squared distances fit in uint32.
+*/
+static void scan_to_live_bins(lidar_scan_t* in, int16_t* idx, img_t* img, int from_mid)
+{
+	int n = in->n_points;
+	int32_t sx = in->pos_at_start.x - in->refxy.x;
+	int32_t sy = in->pos_at_start.y - in->refxy.y;
+	int32_t mx = in->pos_at_end.x - in->pos_at_start.x;
+	int32_t my = in->pos_at_end.y - in->pos_at_start.y;
+	if(from_mid)
+	{
+		sx += mx/2;
+		sy += my/2;
+		mx = my = 0;
+	}
+
+	for(int b = 0; b < LIVE_BINS; b++)
+	{
+		idx[b] = -1;
+		live_bin_dist[b] = 0xffffffff;
+	}
+
+	for(int i = 0; i < n; i++)
+	{
+		int32_t dx = in->scan[i].x - (sx + mx*i/n);
+		int32_t dy = in->scan[i].y - (sy + my*i/n);
+		uint32_t dist = sq(dx) + sq(dy);
+		int b = bearing_deg(dx, dy);
+		if(dist < live_bin_dist[b])
+		{
+			live_bin_dist[b] = dist;
+			idx[b] = i;
+		}
+	}
+
+	for(int b = 0; b < LIVE_BINS; b++)
+	{
+		if(idx[b] >= 0)
+			IMG_SET_VALID(img, b);
+		else
+			IMG_SET_INVALID(img, b);
+	}
+}
+
+// Converts the binned points to live_origin referenced coordinates, rotated by corr_a around the scan's middle
+// position, and moved by (corr_x, corr_y). Only valid bins are converted; points outside +/- IMG_COORD_MAX are
+// marked invalid.
+static void scan_to_2d_live(lidar_scan_t* in, int16_t* idx, img_t* out, int32_t corr_a, int32_t corr_x, int32_t corr_y)
+{
+	pos_t mid;
+	scan_mid_pos(in, &mid);
+	int32_t cx = mid.x - live_origin.x;
+	int32_t cy = mid.y - live_origin.y;
+	int32_t ox = in->refxy.x - mid.x;
+	int32_t oy = in->refxy.y - mid.y;
+
+	int32_t sin_a = sin_interp(corr_a);
+	int32_t cos_a = sin_interp(1073741824-(uint32_t)corr_a);
+
+	for(int b = 0; b < LIVE_BINS; b++)
+	{
+		if(!IMG_VALID(out, b)) continue;
+		int32_t dx = ox + in->scan[idx[b]].x;
+		int32_t dy = oy + in->scan[idx[b]].y;
+		int32_t x = cx + corr_x + ((dx*cos_a - dy*sin_a + (1<<14))>>15);
+		int32_t y = cy + corr_y + ((dx*sin_a + dy*cos_a + (1<<14))>>15);
+		if(x < -IMG_COORD_MAX || x > IMG_COORD_MAX || y < -IMG_COORD_MAX || y > IMG_COORD_MAX)
+		{
+			IMG_SET_INVALID(out, b);
+			continue;
+		}
+		out->x[b] = x;
+		out->y[b] = y;
+	}
+}
+
+#ifndef LIDAR_CORR_THREADS // For navig.c only; not per thread in the host tools
+// lidar_collision_avoidance gets the nearest point per degree in the robot coordinate frame at the end of the scan:
+// index 0 is straight ahead, counterclockwise.
+static void scan_to_collision_avoidance(lidar_scan_t* in)
+{
+	int32_t ex = in->pos_at_end.x - in->refxy.x;
+	int32_t ey = in->pos_at_end.y - in->refxy.y;
+	uint32_t ang = -(uint32_t)in->pos_at_end.ang;
+	int32_t sin_a = sin_lut[ang>>SIN_LUT_SHIFT];
+	int32_t cos_a = sin_lut[(1073741824-ang)>>SIN_LUT_SHIFT];
+
+	for(int b = 0; b < LIVE_BINS; b++)
+		live_bin_dist[b] = 0xffffffff;
+
+	for(int i = 0; i < in->n_points; i++)
+	{
+		int32_t dx = in->scan[i].x - ex;
+		int32_t dy = in->scan[i].y - ey;
+		int32_t x = (dx*cos_a - dy*sin_a + (1<<14))>>15;
+		int32_t y = (dx*sin_a + dy*cos_a + (1<<14))>>15;
+		if(x < -IMG_COORD_MAX || x > IMG_COORD_MAX || y < -IMG_COORD_MAX || y > IMG_COORD_MAX)
+			continue;
+		uint32_t dist = sq(x) + sq(y);
+		int b = bearing_deg(x, y);
+		if(dist < live_bin_dist[b])
+		{
+			live_bin_dist[b] = dist;
+			lidar_collision_avoidance.x[b] = x;
+			lidar_collision_avoidance.y[b] = y;
+		}
+	}
+
+	for(int b = 0; b < LIVE_BINS; b++)
+	{
+		if(live_bin_dist[b] != 0xffffffff)
+			IMG_SET_VALID(&lidar_collision_avoidance, b);
+		else
+			IMG_SET_INVALID(&lidar_collision_avoidance, b);
+	}
+}
+#endif
+
+// Applies a correction to scan points first..last-1 and to a pose: rotation by corr->ang around mid, then
+// translation by (corr->x, corr->y). Points that would go out of the int16 range are left as they are.
+static void corr_scan_points(lidar_scan_t* s, int first, int last, pos_t* mid, pos_t* corr)
+{
+	int32_t cx = mid->x - s->refxy.x;
+	int32_t cy = mid->y - s->refxy.y;
+	int32_t sin_a = sin_interp(corr->ang);
+	int32_t cos_a = sin_interp(1073741824-(uint32_t)corr->ang);
+
+	for(int i = first; i < last; i++)
+	{
+		int32_t dx = s->scan[i].x - cx;
+		int32_t dy = s->scan[i].y - cy;
+		int32_t x = cx + corr->x + ((dx*cos_a - dy*sin_a + (1<<14))>>15);
+		int32_t y = cy + corr->y + ((dx*sin_a + dy*cos_a + (1<<14))>>15);
+		if(x < -30000 || x > 30000 || y < -30000 || y > 30000)
+			continue;
+		s->scan[i].x = x;
+		s->scan[i].y = y;
+	}
+}
+
+static void corr_pose(pos_t* p, pos_t* mid, pos_t* corr)
+{
+	int32_t sin_a = sin_interp(corr->ang);
+	int32_t cos_a = sin_interp(1073741824-(uint32_t)corr->ang);
+	int32_t dx = p->x - mid->x;
+	int32_t dy = p->y - mid->y;
+	p->x = mid->x + corr->x + ((dx*cos_a - dy*sin_a + (1<<14))>>15);
+	p->y = mid->y + corr->y + ((dx*sin_a + dy*cos_a + (1<<14))>>15);
+	p->ang = (uint32_t)p->ang + (uint32_t)corr->ang;
+}
+
+// Counts valid bins on each 60 degree segment.
+static void live_segments(img_t* img, int* valid_segments, int* semivalid_segments)
+{
+	*valid_segments = 0;
+	*semivalid_segments = 0;
+	for(int s = 0; s < 6; s++)
+	{
+		int n = 0;
+		for(int b = s*60; b < s*60+60; b++)
+		{
+			if(IMG_VALID(img, b)) n++;
+		}
+		if(n > 26) (*valid_segments)++;
+		if(n > 12) (*semivalid_segments)++;
+	}
+}
 
 /*
+	Rolling submap, for LIVELIDAR_MODE_SUBMAP.
 
-State                :    0   1   2   0   1   2   0   1   2
-Lidar store          :   111 222 333 111 222 333 111 222 333
-Process img1 (before):           111 222 333 111 222 333 111
-Process img2 (after) :           222 333 111 222 333 111 222
-Apply correction to  :              2   3   1   2   3   1   2
-Apply correction to  :              3   1   2   3   1   2   3
-Apply corr to cur_pos:              x   x   x   x   x   x   x
+	Matching each scan to the previous one adds the error of every match whenever the reference is replaced.
+	Instead, the corrected scans are fused into a robot-centred occupancy grid, and each new scan is matched
+	against it: the reference image is rendered from the grid as the nearest occupied cell per bearing bin, seen
+	from the new scan's middle position, so the live kernels and the Gauss-Newton stage work as they are.
 
+	SUBMAP_N x SUBMAP_N cells of SUBMAP_CELL mm hold 2-bit counters, 16 per word (16 KB). A scan point adds
+	SUBMAP_HIT to its cell, a ray passing through takes one off; cells at 2 or more (the high bit set) are
+	occupied. The storage is toroidal, world cell (cx, cy) is at [cy&SUBMAP_MASK][cx&SUBMAP_MASK], so following
+	the robot only clears the rows and columns the window slides over.
 */
 
-void apply_corr_to_livelidar(live_lidar_scan_t* lid)
+#define SUBMAP_CELL_SHIFT 5 // 32 mm cells
+#define SUBMAP_CELL       (1<<SUBMAP_CELL_SHIFT)
+#define SUBMAP_N          256 // 8.2 m square
+#define SUBMAP_MASK       (SUBMAP_N-1)
+#define SUBMAP_WORDS      (SUBMAP_N/16) // per row
+#define SUBMAP_MARGIN     (SUBMAP_N/8)  // the window is moved when the robot is further off the centre
+#define SUBMAP_HIT        2
+#define SUBMAP_OCCUPIED   0xaaaaaaaa    // high bits of the counters
+#define SUBMAP_FREE_STOP  3             // cells before a hit that its ray doesn't clear
+
+static CORR_TLS uint32_t submap[SUBMAP_N][SUBMAP_WORDS];
+static CORR_TLS int32_t submap_x0, submap_y0; // World cell coordinates of the window's low corner
+static CORR_TLS int submap_ok; // Has a scan in it
+
+CORR_TLS int livelidar_xy = 0; // Angle only, as the firmware has always run; x,y not validated on the robot yet
+CORR_TLS int livelidar_mode = LIVELIDAR_MODE_SCAN; // Submap drifts more and takes twice the time in the match_bench drift run
+
+static int submap_in(int32_t cx, int32_t cy)
+{
+	return cx >= submap_x0 && cx < submap_x0+SUBMAP_N && cy >= submap_y0 && cy < submap_y0+SUBMAP_N;
+}
+
+// Adds d to a cell counter, saturating to 0..3.
+static void submap_add(int32_t cx, int32_t cy, int d)
+{
+	uint32_t* w = &submap[cy&SUBMAP_MASK][(cx&SUBMAP_MASK)>>4];
+	int sh = (cx&15)<<1;
+	int c = ((*w>>sh)&3) + d;
+	if(c < 0) c = 0;
+	else if(c > 3) c = 3;
+	*w = (*w & ~(3UL<<sh)) | ((uint32_t)c<<sh);
+}
+
+static void submap_clear_col(int32_t cx)
 {
-	for(int i = 0; i < 90; i++)
+	int wi = (cx&SUBMAP_MASK)>>4;
+	uint32_t mask = ~(3UL<<((cx&15)<<1));
+	for(int r = 0; r < SUBMAP_N; r++)
+		submap[r][wi] &= mask;
+}
+
+static void submap_clear_row(int32_t cy)
+{
+	memset(submap[cy&SUBMAP_MASK], 0, sizeof(submap[0]));
+}
+
+// Empties the submap, centred at (x, y) mm.
+static void submap_reset(int32_t x, int32_t y)
+{
+	memset(submap, 0, sizeof(submap));
+	submap_x0 = (x>>SUBMAP_CELL_SHIFT) - SUBMAP_N/2;
+	submap_y0 = (y>>SUBMAP_CELL_SHIFT) - SUBMAP_N/2;
+	submap_ok = 0;
+}
+
+// Slides the window, if needed, so that (x, y) mm is within SUBMAP_MARGIN cells of its centre.
+static void submap_follow(int32_t x, int32_t y)
+{
+	int32_t x0 = (x>>SUBMAP_CELL_SHIFT) - SUBMAP_N/2;
+	int32_t y0 = (y>>SUBMAP_CELL_SHIFT) - SUBMAP_N/2;
+
+	if(x0 < submap_x0-SUBMAP_N || x0 > submap_x0+SUBMAP_N || y0 < submap_y0-SUBMAP_N || y0 > submap_y0+SUBMAP_N)
+	{
+		submap_reset(x, y);
+		return;
+	}
+
+	// The column leaving the window and the one entering share the storage.
+	while(submap_x0 < x0-SUBMAP_MARGIN)
+		submap_clear_col(submap_x0++);
+	while(submap_x0 > x0+SUBMAP_MARGIN)
+		submap_clear_col(--submap_x0);
+	while(submap_y0 < y0-SUBMAP_MARGIN)
+		submap_clear_row(submap_y0++);
+	while(submap_y0 > y0+SUBMAP_MARGIN)
+		submap_clear_row(--submap_y0);
+}
+
+// Takes one off the cells from (ax, ay) towards (bx, by), stopping SUBMAP_FREE_STOP cells short. In cells.
+static void submap_ray(int32_t ax, int32_t ay, int32_t bx, int32_t by)
+{
+	int32_t dx = bx - ax, dy = by - ay;
+	int32_t adx = (dx<0)?-dx:dx;
+	int32_t ady = (dy<0)?-dy:dy;
+	int sx = (dx<0)?-1:1;
+	int sy = (dy<0)?-1:1;
+	int32_t err = adx - ady;
+	int n = ((adx>ady)?adx:ady) - SUBMAP_FREE_STOP;
+
+	for(int k = 0; k < n; k++)
+	{
+		if(submap_in(ax, ay))
+			submap_add(ax, ay, -1);
+		int32_t e2 = 2*err;
+		if(e2 > -ady)
+		{
+			err -= ady;
+			ax += sx;
+		}
+		if(e2 < adx)
+		{
+			err += adx;
+			ay += sy;
+		}
+	}
+}
+
+/*
+	Fuses a corrected scan into the submap: the rays from the sensor to the nearest point of each bearing bin
+	clear, then all points hit. Uses livelid2d_idx2.
+*/
+static void submap_insert(lidar_scan_t* in)
+{
+	int n = in->n_points;
+	int32_t sx = in->pos_at_start.x;
+	int32_t sy = in->pos_at_start.y;
+	int32_t mx = in->pos_at_end.x - in->pos_at_start.x;
+	int32_t my = in->pos_at_end.y - in->pos_at_start.y;
+
+	scan_to_live_bins(in, livelid2d_idx2, &livelid2d_img2, 0);
+
+	for(int b = 0; b < LIVE_BINS; b++)
+	{
+		int i = livelid2d_idx2[b];
+		if(i < 0) continue;
+		submap_ray((sx + mx*i/n)>>SUBMAP_CELL_SHIFT, (sy + my*i/n)>>SUBMAP_CELL_SHIFT,
+		           (in->refxy.x + in->scan[i].x)>>SUBMAP_CELL_SHIFT, (in->refxy.y + in->scan[i].y)>>SUBMAP_CELL_SHIFT);
+	}
+
+	for(int i = 0; i < n; i++)
 	{
-		lid->pos[i].ang += latest_corr.ang;
-		lid->pos[i].x   += latest_corr.x;
-		lid->pos[i].y   += latest_corr.y;
+		int32_t cx = (in->refxy.x + in->scan[i].x)>>SUBMAP_CELL_SHIFT;
+		int32_t cy = (in->refxy.y + in->scan[i].y)>>SUBMAP_CELL_SHIFT;
+		if(submap_in(cx, cy))
+			submap_add(cx, cy, SUBMAP_HIT);
 	}
+
+	submap_ok = 1;
 }
 
-live_lidar_scan_t lidlive1, lidlive2, lidlive3;
-point_t l2dlive1[360], l2dlive2[360], l2dlive3[360];
+/*
+	Renders the reference image from the submap, relative to live_origin. Walls seen from several poses are a
+	few cells thick, and their nearest cell would put them closer to the robot than they are, which looks like
+	a rotation on oblique walls: each bearing bin gets the mean of the occupied cells within SUBMAP_WALL mm
+	behind its nearest one.
+*/
+#define SUBMAP_WALL 64
 
-point_t lidar_collision_avoidance[360];
-extern volatile int lidar_collision_avoidance_new;
+static CORR_TLS int32_t submap_sum_x[LIVE_BINS];
+static CORR_TLS int32_t submap_sum_y[LIVE_BINS];
+static CORR_TLS uint8_t submap_cnt[LIVE_BINS];
 
-live_lidar_scan_t* p_livelidar_store;
-point_t*           p_livelid2d_store;
+// Pass 0 finds the nearest occupied cell per bin, pass 1 sums the cells up to live_bin_dist (then the limit).
+static void submap_render_pass(int pass)
+{
+	for(int r = 0; r < SUBMAP_N; r++)
+	{
+		int32_t cy = submap_y0 + ((r - submap_y0) & SUBMAP_MASK);
+		int32_t y = (cy<<SUBMAP_CELL_SHIFT) + SUBMAP_CELL/2 - live_origin.y;
+		if(y < -IMG_COORD_MAX || y > IMG_COORD_MAX) continue;
 
-live_lidar_scan_t* p_livelidar_img1;
-point_t*           p_livelid2d_img1;
+		for(int wi = 0; wi < SUBMAP_WORDS; wi++)
+		{
+			uint32_t w = submap[r][wi] & SUBMAP_OCCUPIED;
+			while(w)
+			{
+				int col = wi*16 + (__builtin_ctz(w)>>1);
+				w &= w-1;
+				int32_t cx = submap_x0 + ((col - submap_x0) & SUBMAP_MASK);
+				int32_t x = (cx<<SUBMAP_CELL_SHIFT) + SUBMAP_CELL/2 - live_origin.x;
+				if(x < -IMG_COORD_MAX || x > IMG_COORD_MAX) continue;
+
+				uint32_t dist = sq(x) + sq(y);
+				int b = bearing_deg(x, y);
+				if(pass == 0)
+				{
+					if(dist < live_bin_dist[b])
+						live_bin_dist[b] = dist;
+				}
+				else if(dist <= live_bin_dist[b] && submap_cnt[b] < 255)
+				{
+					submap_sum_x[b] += x;
+					submap_sum_y[b] += y;
+					submap_cnt[b]++;
+				}
+			}
+		}
+	}
+}
 
-live_lidar_scan_t* p_livelidar_img2;
-point_t*           p_livelid2d_img2;
+static void submap_to_live_img(img_t* img)
+{
+	for(int b = 0; b < LIVE_BINS; b++)
+	{
+		live_bin_dist[b] = 0xffffffff;
+		submap_sum_x[b] = 0;
+		submap_sum_y[b] = 0;
+		submap_cnt[b] = 0;
+	}
 
-live_lidar_scan_t lid_skiphold;
-point_t           l2d_skiphold[360];
-int               num_samples_skiphold[6];
+	submap_render_pass(0);
 
-// For counting validness of data for lidar-based correction.
-int num_samples1[6];
-int num_samples2[6];
-int num_samples3[6];
+	for(int b = 0; b < LIVE_BINS; b++)
+	{
+		if(live_bin_dist[b] != 0xffffffff)
+			live_bin_dist[b] = sq(isqrt(live_bin_dist[b]) + SUBMAP_WALL);
+	}
 
-int* p_livelidar_num_samples_store;
-int* p_livelidar_num_samples_img1;
-int* p_livelidar_num_samples_img2;
+	submap_render_pass(1);
 
-int live_lidar_calc_req;
-int skip;
-static int semi_significant_img;
+	for(int b = 0; b < LIVE_BINS; b++)
+	{
+		int n = submap_cnt[b];
+		if(n)
+		{
+			img->x[b] = (submap_sum_x[b] + (n>>1)*(submap_sum_x[b]<0?-1:1))/n;
+			img->y[b] = (submap_sum_y[b] + (n>>1)*(submap_sum_y[b]<0?-1:1))/n;
+			IMG_SET_VALID(img, b);
+		}
+		else
+			IMG_SET_INVALID(img, b);
+	}
+}
 
-volatile int calc_must_be_finished = 0;
+// Unit normals (Q14) of the reference image for the Gauss-Newton stage, across the neighbouring bins' points.
+// (0,0) when neither neighbour is within LINE_MAX_LEN. Rendered submap points are cell centres, too noisy
+// for the nearest neighbours: their normals span more bins.
+#define LIVE_NORMAL_SPAN_SUBMAP 3
+static CORR_TLS int16_t live_nx1[LIVE_BINS];
+static CORR_TLS int16_t live_ny1[LIVE_BINS];
 
-void reset_lidar_corr_images()
+static void live_normals(int span)
 {
-	// This prevents the running of the algorithm:
-	for(int i=0; i<6; i++) num_samples1[i] = 0;
-	for(int i=0; i<6; i++) num_samples2[i] = 0;
-	for(int i=0; i<6; i++) num_samples3[i] = 0;
+	img_t* img = &livelid2d_img1;
+	for(int b = 0; b < LIVE_BINS; b++)
+	{
+		live_nx1[b] = 0;
+		live_ny1[b] = 0;
+		if(!IMG_VALID(img, b)) continue;
 
-	lidlive1.status = 0;
-	lidlive2.status = 0;
-	lidlive3.status = 0;
+		// Chord between the ends of the chain of up to span connected bins on both sides
+		int a = b, e = b;
+		for(int k = 0; k < span; k++)
+		{
+			int prev = (a == 0) ? LIVE_BINS-1 : a-1;
+			if(!IMG_VALID(img, prev) || sq(img->x[prev]-img->x[a]) + sq(img->y[prev]-img->y[a]) >= sq(LINE_MAX_LEN))
+				break;
+			a = prev;
+		}
+		for(int k = 0; k < span; k++)
+		{
+			int next = (e == LIVE_BINS-1) ? 0 : e+1;
+			if(!IMG_VALID(img, next) || sq(img->x[next]-img->x[e]) + sq(img->y[next]-img->y[e]) >= sq(LINE_MAX_LEN))
+				break;
+			e = next;
+		}
 
-	skip = 0;
+		int32_t dx = img->x[e] - img->x[a], dy = img->y[e] - img->y[a];
+		int32_t len = isqrt(sq(dx) + sq(dy));
+		if(len == 0) continue;
+		live_nx1[b] = (-dy<<14)/len;
+		live_ny1[b] = (dx<<14)/len;
+	}
 }
 
-void livelidar_storage_finished()
+/*
+	Gauss-Newton rows: each img2 point, moved by (tx, ty) in 1/256 mm, against the nearest img1 point within
+	SEARCH_RANGE bins; point-to-line along that point's normal when it has one. c is the rotation center.
+*/
+static void gn_collect_live(gn_sys_t* s, xy_i32_t* c, int32_t tx, int32_t ty)
 {
-	static int state = 0;
+	img_t* img1 = &livelid2d_img1;
+	img_t* img2 = &livelid2d_img2;
 
-	if(state == 0)
-	{
-		for(int i=0; i<6; i++) num_samples2[i] = 0;
-		lidlive2.status = 0;
-		p_livelidar_store = &lidlive2;
-		p_livelid2d_store = l2dlive2;
-		p_livelidar_num_samples_store = num_samples2;
-		p_livelidar_img1  = &lidlive3;
-		p_livelid2d_img1  = l2dlive3;
-		p_livelidar_num_samples_img1 = num_samples3;
-		p_livelidar_img2  = &lidlive1;
-		p_livelid2d_img2  = l2dlive1;
-		p_livelidar_num_samples_img2 = num_samples1;
-		state = 1;
-	}
-	else if(state == 1)
-	{
-		for(int i=0; i<6; i++) num_samples3[i] = 0;
-		lidlive3.status = 0;
-		p_livelidar_store = &lidlive3;
-		p_livelid2d_store = l2dlive3;
-		p_livelidar_num_samples_store = num_samples3;
-		p_livelidar_img1  = &lidlive1;
-		p_livelid2d_img1  = l2dlive1;
-		p_livelidar_num_samples_img1 = num_samples1;
-		p_livelidar_img2  = &lidlive2;
-		p_livelid2d_img2  = l2dlive2;
-		p_livelidar_num_samples_img2 = num_samples2;
-		state = 2;
-	}
-	else // state == 2
-	{
-		for(int i=0; i<6; i++) num_samples1[i] = 0;
-		lidlive1.status = 0;
-		p_livelidar_store = &lidlive1;
-		p_livelid2d_store = l2dlive1;
-		p_livelidar_num_samples_store = num_samples1;
-		p_livelidar_img1  = &lidlive2;
-		p_livelid2d_img1  = l2dlive2;
-		p_livelidar_num_samples_img1 = num_samples2;
-		p_livelidar_img2  = &lidlive3;
-		p_livelid2d_img2  = l2dlive3;
-		p_livelidar_num_samples_img2 = num_samples3;
-		state = 0;
-	}
+	memset(s, 0, sizeof(*s));
 
-	if(skip)
+	for(int o = 0; o < LIVE_BINS; o++)
 	{
-		p_livelidar_img1 = &lid_skiphold;
-		p_livelid2d_img1 = l2d_skiphold;
-		p_livelidar_num_samples_img1 = num_samples_skiphold;
-	}
+		if(!IMG_VALID(img2, o)) continue;
 
-	calc_must_be_finished = 0;
-	live_lidar_calc_req = 1;
-}
+		int32_t px8 = (img2->x[o]<<8) + tx;
+		int32_t py8 = (img2->y[o]<<8) + ty;
+		int px = (px8+128)>>8;
+		int py = (py8+128)>>8;
 
-int livelidar_skip()
-{
-	return skip;
-}
+		int smallest = sq(GN_GATE);
+		int best = -1;
+		for(int k = -SEARCH_RANGE; k <= SEARCH_RANGE; k++)
+		{
+			int i = o+k;
+			if(i < 0) i += LIVE_BINS;
+			else if(i >= LIVE_BINS) i -= LIVE_BINS;
+			if(!IMG_VALID(img1, i)) continue;
+			int dist = sq(img1->x[i] - px) + sq(img1->y[i] - py);
+			if(dist < smallest)
+			{
+				smallest = dist;
+				best = i;
+			}
+		}
 
-// Don't do X,Y at all:
-#define LIVE_ONLY_ANG
+		if(best < 0) continue;
+
+		int32_t vx = img2->x[o] - c->x;
+		int32_t vy = img2->y[o] - c->y;
+		int32_t ex = px8 - (img1->x[best]<<8);
+		int32_t ey = py8 - (img1->y[best]<<8);
+
+		if(live_nx1[best] || live_ny1[best])
+			gn_add(s, live_nx1[best], live_ny1[best], vx, vy, (live_nx1[best]*ex + live_ny1[best]*ey)>>12);
+		else
+			gn_add_point(s, vx, vy, ex<<2, ey<<2);
+	}
+}
 
 
-#ifndef LIVE_ONLY_ANG
-#define LIVE_PASS1_NUM_A 3
-static int LIVE_PASS1_A[LIVE_PASS1_NUM_A] =
+// With the x,y stages, which take out some of the angle error too
+#define LIVE_PASS1_NUM_A_XY 3
+static const int LIVE_PASS1_A_XY[LIVE_PASS1_NUM_A_XY] =
 {
 	-1*ANG_1_DEG,
 	0,
 	1*ANG_1_DEG,
 };
-static int LIVE_PASS1_A_WEIGH[LIVE_PASS1_NUM_A] =
+static const int LIVE_PASS1_A_XY_WEIGH[LIVE_PASS1_NUM_A_XY] =
 {
 	3,
 	4,
 	3
 };
-#else
+
 #define LIVE_PASS1_NUM_A 5
-static int LIVE_PASS1_A[LIVE_PASS1_NUM_A] =
+static const int LIVE_PASS1_A[LIVE_PASS1_NUM_A] =
 {
 	-2*ANG_1_DEG,
 	-1*ANG_1_DEG,
@@ -970,7 +2808,7 @@ static int LIVE_PASS1_A[LIVE_PASS1_NUM_A] =
 	1*ANG_1_DEG,
 	2*ANG_1_DEG,
 };
-static int LIVE_PASS1_A_WEIGH[LIVE_PASS1_NUM_A] =
+static const int LIVE_PASS1_A_WEIGH[LIVE_PASS1_NUM_A] =
 {
 	2,
 	3,
@@ -978,10 +2816,9 @@ static int LIVE_PASS1_A_WEIGH[LIVE_PASS1_NUM_A] =
 	3,
 	2
 };
-#endif
 
 #define LIVE_PASS1_NUM_X 5
-static int LIVE_PASS1_X[LIVE_PASS1_NUM_X] =
+static const int LIVE_PASS1_X[LIVE_PASS1_NUM_X] =
 {
 	-60,
 	-30,
@@ -989,7 +2826,7 @@ static int LIVE_PASS1_X[LIVE_PASS1_NUM_X] =
 	30,
 	60
 };
-static int LIVE_PASS1_X_WEIGH[LIVE_PASS1_NUM_X] =
+static const int LIVE_PASS1_X_WEIGH[LIVE_PASS1_NUM_X] =
 {
 	5,
 	6,
@@ -1000,7 +2837,7 @@ static int LIVE_PASS1_X_WEIGH[LIVE_PASS1_NUM_X] =
 
 
 #define LIVE_PASS2_NUM_A 5
-static int LIVE_PASS2_A[LIVE_PASS2_NUM_A] =
+static const int LIVE_PASS2_A[LIVE_PASS2_NUM_A] =
 {
 	-2*ANG_0_5_DEG,
 	-1*ANG_0_5_DEG,
@@ -1010,7 +2847,7 @@ static int LIVE_PASS2_A[LIVE_PASS2_NUM_A] =
 };
 
 #define LIVE_PASS2_NUM_X 5
-static int LIVE_PASS2_X[LIVE_PASS2_NUM_X] =
+static const int LIVE_PASS2_X[LIVE_PASS2_NUM_X] =
 {
 	-20,
 	-10,
@@ -1019,9 +2856,8 @@ static int LIVE_PASS2_X[LIVE_PASS2_NUM_X] =
 	20,
 };
 
-#ifndef LIVE_ONLY_ANG
 #define LIVE_PASS3_NUM_A 5
-static int LIVE_PASS3_A[LIVE_PASS3_NUM_A] =
+static const int LIVE_PASS3_A[LIVE_PASS3_NUM_A] =
 {
 	-2*ANG_0_25_DEG,
 	-1*ANG_0_25_DEG,
@@ -1029,27 +2865,10 @@ static int LIVE_PASS3_A[LIVE_PASS3_NUM_A] =
 	1*ANG_0_25_DEG,
 	2*ANG_0_25_DEG
 };
-#else
-#define LIVE_PASS3_NUM_A 11
-static int LIVE_PASS3_A[LIVE_PASS3_NUM_A] =
-{
-	-5*ANG_0_1_DEG,
-	-4*ANG_0_1_DEG,
-	-3*ANG_0_1_DEG,
-	-2*ANG_0_1_DEG,
-	-1*ANG_0_1_DEG,
-	0,
-	1*ANG_0_1_DEG,
-	2*ANG_0_1_DEG,
-	3*ANG_0_1_DEG,
-	4*ANG_0_1_DEG,
-	5*ANG_0_1_DEG
-};
-#endif
 
 
 #define LIVE_PASS3_NUM_X 5
-static int LIVE_PASS3_X[LIVE_PASS3_NUM_X] =
+static const int LIVE_PASS3_X[LIVE_PASS3_NUM_X] =
 {
 	-10,
 	-5,
@@ -1058,31 +2877,7 @@ static int LIVE_PASS3_X[LIVE_PASS3_NUM_X] =
 	10
 };
 
-// Pass4 goes X,Y,A instead of (X,Y),A
-
-#define LIVE_PASS4_NUM_A 9
-static int LIVE_PASS4_A[LIVE_PASS4_NUM_A] =
-{
-	-4*ANG_0_05_DEG,
-	-3*ANG_0_05_DEG,
-	-2*ANG_0_05_DEG,
-	-1*ANG_0_05_DEG,
-	0,
-	1*ANG_0_05_DEG,
-	2*ANG_0_05_DEG,
-	3*ANG_0_05_DEG,
-	4*ANG_0_05_DEG
-};
-
-#define LIVE_PASS4_NUM_X 5
-static int LIVE_PASS4_X[LIVE_PASS4_NUM_X] =
-{
-	-4,
-	-2,
-	0,
-	2,
-	4,
-};
+// The final resolution comes from the Gauss-Newton stage.
 
 
 // Use the same tables for X & Y
@@ -1093,438 +2888,496 @@ static int LIVE_PASS4_X[LIVE_PASS4_NUM_X] =
 #define LIVE_PASS2_Y LIVE_PASS2_X
 #define LIVE_PASS3_NUM_Y LIVE_PASS3_NUM_X
 #define LIVE_PASS3_Y LIVE_PASS3_X
-#define LIVE_PASS4_NUM_Y LIVE_PASS4_NUM_X
-#define LIVE_PASS4_Y LIVE_PASS4_X
-
-void live_lidar_calc_must_be_finished()
-{
-	calc_must_be_finished = 1;
-}
 
-extern volatile int us100;
 
-int do_livelidar_corr()
-{
-	latest_corr.ang = 0;
-	latest_corr.x = 0;
-	latest_corr.y = 0;
 
-	// Do a copy for collision avoidance:
-	for(int i = 0; i < 360; i++) lidar_collision_avoidance[i].valid = p_livelid2d_img2[i].valid;
-	scan_to_2d_live_robot_coord_frame(p_livelidar_img2, lidar_collision_avoidance);
-	lidar_collision_avoidance_new = 1;
+/*
+	The search is a sequence of stages, each going through a set of candidates around the best pose of the
+	previous stage: PASSn_XY goes through (x,y) pairs, PASSn_A through angles. The last stage refines the pose
+	with Gauss-Newton iterations (gn_step()), one per candidate slot.
+*/
 
-	return 0;
+#define LIVE_STAGE_A  0
+#define LIVE_STAGE_XY 1
+#define LIVE_STAGE_GN 2
 
-	// Require enough valid samples on at least four of six 60deg segments,
-	// and some valid samples on either remaining segment.
-	int valid_segments_img1 = 0, valid_segments_img2 = 0;
-	int semivalid_segments_img1 = 0, semivalid_segments_img2 = 0;
-	for(int i = 0; i < 6; i++)
-	{
-		if(p_livelidar_num_samples_img1[i] > 26)
-			valid_segments_img1++;
-		if(p_livelidar_num_samples_img1[i] > 12)
-			semivalid_segments_img1++;
+typedef struct
+{
+	int what;
+	int n;      // Number of steps (per axis for LIVE_STAGE_XY), maximum number of iterations for LIVE_STAGE_GN
+	const int* steps;
+	const int* weigh; // NULL for no weighing
+} live_stage_t;
+
+// livelidar_xy
+static const live_stage_t live_stages_xy[] =
+{
+	{LIVE_STAGE_XY, LIVE_PASS1_NUM_X,    LIVE_PASS1_X,    LIVE_PASS1_X_WEIGH},
+	{LIVE_STAGE_A,  LIVE_PASS1_NUM_A_XY, LIVE_PASS1_A_XY, LIVE_PASS1_A_XY_WEIGH},
+	{LIVE_STAGE_XY, LIVE_PASS2_NUM_X,    LIVE_PASS2_X,    0},
+	{LIVE_STAGE_A,  LIVE_PASS2_NUM_A,    LIVE_PASS2_A,    0},
+	{LIVE_STAGE_XY, LIVE_PASS3_NUM_X,    LIVE_PASS3_X,    0},
+	{LIVE_STAGE_A,  LIVE_PASS3_NUM_A,    LIVE_PASS3_A,    0},
+	{LIVE_STAGE_GN, GN_MAX_ITER+1,       0,               0},
+};
 
-		if(p_livelidar_num_samples_img2[i] > 26)
-			valid_segments_img2++;
-		if(p_livelidar_num_samples_img2[i] > 12)
-			semivalid_segments_img2++;
-	}
+// Angle only
+static const live_stage_t live_stages_ang[] =
+{
+	{LIVE_STAGE_A,  LIVE_PASS1_NUM_A, LIVE_PASS1_A, LIVE_PASS1_A_WEIGH},
+	{LIVE_STAGE_A,  LIVE_PASS2_NUM_A, LIVE_PASS2_A, 0},
+	{LIVE_STAGE_A,  LIVE_PASS3_NUM_A, LIVE_PASS3_A, 0},
+	{LIVE_STAGE_GN, GN_MAX_ITER+1,    0,            0},
+};
 
+#define LIVE_S_IDLE      0
+#define LIVE_S_SEARCHING 1
+#define LIVE_S_DONE      2
 
-	if(valid_segments_img1 < 4 || semivalid_segments_img1 < 5)
-		return 1;
+typedef struct
+{
+	int state;
+	int ret;
+	int reset_cnt_at_start;
+	uint32_t time_us;
+
+	int32_t (*p_calc_f)(img_t*, img_t*, int32_t, int32_t);
+	int xy;      // livelidar_xy at livelidar_start()
+	const live_stage_t* stages;
+	int n_stages;
+	int high_movement_mode;
+	int32_t supposed_a_diff, supposed_x_diff, supposed_y_diff;
+	int n_ref_points;
+
+	int stage;
+	int cand;
+	int32_t stage_lvl; // Weighed score of stage_best
+	int32_t stage_raw; // Unweighed
+	pos_t stage_best;
+
+	// Best pose from the finished stages, around livelidar_cur's middle position; the search continues from here.
+	int stages_done;
+	pos_t best;
+	int32_t best_raw;
+
+	gn_t gn;
+	corr_cov_t cov; // Of best, from the Gauss-Newton stage
+	degen_t degen;  // Of the reference
+} live_search_t;
+
+static CORR_TLS live_search_t live_search;
+
+static int live_stage_num_cands(live_search_t* s, const live_stage_t* st)
+{
+	return (st->what == LIVE_STAGE_XY && !s->degen.on) ? st->n*st->n : st->n;
+}
 
-	if(valid_segments_img2 < 4 || semivalid_segments_img2 < 5)
-		return 2;
-	
-	int32_t supposed_a_diff = p_livelidar_img2->pos[45].ang - p_livelidar_img1->pos[45].ang;
-	int32_t supposed_x_diff = p_livelidar_img2->pos[45].x - p_livelidar_img1->pos[45].x;
-	int32_t supposed_y_diff = p_livelidar_img2->pos[45].y - p_livelidar_img1->pos[45].y;
+static void live_stage_done(live_search_t* s)
+{
+	if(s->stage_lvl == 0)
+	{
+		s->ret = 3 + s->stage;
+		s->state = LIVE_S_DONE;
+		return;
+	}
 
+	s->best = s->stage_best;
+	s->best_raw = s->stage_raw;
+	s->stages_done++;
 
-	int high_movement_mode = 0;
-	int32_t (*p_calc_f)(point_t*, point_t*) = &calc_match_lvl_live;
+	s->stage++;
+	s->cand = 0;
+	s->stage_lvl = 0;
 
-	#ifndef LIVE_ONLY_ANG
-	if(supposed_a_diff < -9*ANG_1_DEG || supposed_a_diff > 9*ANG_1_DEG ||
-	   supposed_x_diff < -160 || supposed_x_diff > 160 ||
-	   supposed_y_diff < -160 || supposed_y_diff > 160)
-	#endif
-	// If ONLY_ANG, always use high movement mode since we have a lot of time.
+	if(s->stage >= s->n_stages)
 	{
-		high_movement_mode = 1;
-		p_calc_f = &calc_match_lvl_live_high_movement;
+		s->ret = 0;
+		s->state = LIVE_S_DONE;
 	}
+}
 
-	angle_optim = supposed_a_diff/-ANG_1_DEG;
-
-	// Convert img1, which stays fixed during the tests.
-	scan_to_2d_live(p_livelidar_img1, p_livelid2d_img1, 0, 0, 0);
+// One Gauss-Newton iteration. A failed refinement leaves the pose from the previous stages.
+static void live_eval_gn(live_search_t* s)
+{
+	if(s->cand == 0)
+	{
+		live_normals((livelidar_mode == LIVELIDAR_MODE_SUBMAP) ? LIVE_NORMAL_SPAN_SUBMAP : 1);
+		gn_init(&s->gn, s->best.ang, s->best.x<<8, s->best.y<<8);
+	}
 
-	// Run PASS 1
+	pos_t mid;
+	xy_i32_t c;
+	scan_mid_pos(&livelidar_cur, &mid);
+	c.x = mid.x - live_origin.x;
+	c.y = mid.y - live_origin.y;
 
-	int biggest_lvl = 0;
-	int best1_a=0, best1_x=0, best1_y=0;
+	gn_sys_t sys;
+	scan_to_2d_live(&livelidar_cur, livelid2d_idx2, &livelid2d_img2, s->gn.ang, 0, 0);
+	gn_collect_live(&sys, &c, s->gn.x, s->gn.y);
+	lidar_corr_evals++;
+	s->cand++;
 
-	#ifndef LIVE_ONLY_ANG
+	if(!gn_step(&s->gn, &sys, !s->xy))
+		return;
 
-	for(int x_corr = 0; x_corr < LIVE_PASS1_NUM_X; x_corr++)
+	// At the refined pose, or at the previous stages' pose if the refinement failed.
+	if(s->gn.ret)
 	{
-		for(int y_corr = 0; y_corr < LIVE_PASS1_NUM_Y; y_corr++)
-		{
-			int a = 0;
-			int x = LIVE_PASS1_X[x_corr];
-			int y = LIVE_PASS1_Y[y_corr];
-			scan_to_2d_live(p_livelidar_img2, p_livelid2d_img2, a, x, y);
-			int lvl = p_calc_f(p_livelid2d_img1, p_livelid2d_img2);
-			lvl = lvl * LIVE_PASS1_X_WEIGH[x_corr] * LIVE_PASS1_Y_WEIGH[y_corr];
-
-			if(lvl > biggest_lvl)
-			{
-				biggest_lvl = lvl;
-				best1_x = x;
-				best1_y = y;
-			}
-		}
-		if(calc_must_be_finished) return 20;
+		scan_to_2d_live(&livelidar_cur, livelid2d_idx2, &livelid2d_img2, s->best.ang, 0, 0);
+		gn_collect_live(&sys, &c, s->best.x<<8, s->best.y<<8);
 	}
+	gn_cov(&sys, !s->xy, &s->cov);
 
-	if(biggest_lvl == 0)
+	s->stage_lvl = 1;
+	s->stage_raw = s->best_raw;
+	s->stage_best = s->best;
+	if(!s->gn.ret)
 	{
-		return 3;
+		s->stage_best.ang = s->gn.ang;
+		s->stage_best.x = (s->gn.x+128)>>8;
+		s->stage_best.y = (s->gn.y+128)>>8;
 	}
+	live_stage_done(s);
+}
 
-	#else
-
-	best1_x = 0;
-	best1_y = 0;
+// Scores the next candidate.
+static void live_eval(live_search_t* s)
+{
+	const live_stage_t* st = &s->stages[s->stage];
+	int32_t a = s->best.ang, x = s->best.x, y = s->best.y;
+	int w = 1;
 
-	#endif
+	if(st->what == LIVE_STAGE_GN)
+	{
+		live_eval_gn(s);
+		return;
+	}
 
+	if(st->what == LIVE_STAGE_A)
+	{
+		a = (uint32_t)a + (uint32_t)st->steps[s->cand];
+		if(st->weigh) w = st->weigh[s->cand];
+		scan_to_2d_live(&livelidar_cur, livelid2d_idx2, &livelid2d_img2, a, 0, 0);
+	}
+	else
+	{
+		if(s->cand == 0)
+			scan_to_2d_live(&livelidar_cur, livelid2d_idx2, &livelid2d_img2, a, 0, 0);
+
+		// Along the constrained direction only, when degenerate.
+		int xi = s->degen.on ? s->cand : s->cand / st->n;
+		int yi = s->degen.on ? st->n/2 : s->cand % st->n;
+		int32_t ox, oy;
+		degen_offset(&s->degen, st->steps[xi], st->steps[yi], &ox, &oy);
+		x += ox;
+		y += oy;
+		if(st->weigh) w = st->weigh[xi] * st->weigh[yi];
+	}
 
-	biggest_lvl = 0;
+	int32_t raw = s->p_calc_f(&livelid2d_img1, &livelid2d_img2, x, y);
+	lidar_corr_evals++;
 
-	for(int a_corr = 0; a_corr < LIVE_PASS1_NUM_A; a_corr++)
+	if(raw*w > s->stage_lvl)
 	{
-		int a = LIVE_PASS1_A[a_corr];
-		int x = best1_x;
-		int y = best1_y;
-		scan_to_2d_live(p_livelidar_img2, p_livelid2d_img2, a, x, y);
-		int lvl = p_calc_f(p_livelid2d_img1, p_livelid2d_img2);
-		lvl = lvl * LIVE_PASS1_A_WEIGH[a_corr];
+		s->stage_lvl = raw*w;
+		s->stage_raw = raw;
+		s->stage_best.ang = a;
+		s->stage_best.x = x;
+		s->stage_best.y = y;
+	}
 
-		if(lvl > biggest_lvl)
-		{
-			biggest_lvl = lvl;
-			best1_a = a;
-		}
+	if(++s->cand >= live_stage_num_cands(s, st))
+		live_stage_done(s);
+}
 
-		if(calc_must_be_finished) return 21;
-	}
+extern uint32_t timestamp_us();
 
-	if(biggest_lvl == 0)
+// Prepares the images and the search. Returns -1 if there is a search to do, livelidar_finish() return value otherwise.
+static int live_prepare(live_search_t* s)
+{
+	lidar_scan_t* ref = &livelidar_ref;
+	lidar_scan_t* cur = &livelidar_cur;
+
+	if(s->reset_cnt_at_start != reset_cnt_seen)
 	{
-		return 4;
+		// The pose may have been changed in the middle of this scan.
+		reset_cnt_seen = s->reset_cnt_at_start;
+		livelidar_ref_ok = 0;
+		submap_ok = 0;
+		return 32;
 	}
 
-	// Run pass 2
-
-	biggest_lvl = 0;
-
-	int best2_a=0, best2_x=0, best2_y=0;
+	if(cur->status & LIVELIDAR_INVALID)
+		return 30;
 
-	#ifndef LIVE_ONLY_ANG
+	pos_t mid1, mid2;
+	scan_mid_pos(cur, &mid2);
 
-	for(int x_corr = 0; x_corr < LIVE_PASS2_NUM_X; x_corr++)
+	// Convert img1, which stays fixed during the search.
+	if(livelidar_mode == LIVELIDAR_MODE_SUBMAP)
 	{
-		for(int y_corr = 0; y_corr < LIVE_PASS2_NUM_Y; y_corr++)
-		{
-			int a = best1_a;
-			int x = best1_x + LIVE_PASS2_X[x_corr];
-			int y = best1_y + LIVE_PASS2_Y[y_corr];
-			scan_to_2d_live(p_livelidar_img2, p_livelid2d_img2, a, x, y);
-			int lvl = p_calc_f(p_livelid2d_img1, p_livelid2d_img2);
-
-			if(lvl > biggest_lvl)
-			{
-				biggest_lvl = lvl;
-				best2_x = x;
-				best2_y = y;
-			}
-		}
-		if(calc_must_be_finished) return 22;
+		if(submap_ok)
+			submap_follow(mid2.x, mid2.y);
+		if(!submap_ok)
+			return 31;
+
+		mid1 = mid2;
+		live_origin.x = mid2.x;
+		live_origin.y = mid2.y;
+		submap_to_live_img(&livelid2d_img1);
 	}
-
-	if(biggest_lvl == 0)
+	else
 	{
-		return 5;
+		if(!livelidar_ref_ok)
+			return 31;
+
+		scan_mid_pos(ref, &mid1);
+		live_origin.x = mid1.x;
+		live_origin.y = mid1.y;
+		scan_to_live_bins(ref, livelid2d_idx1, &livelid2d_img1, 0);
+		scan_to_2d_live(ref, livelid2d_idx1, &livelid2d_img1, 0, 0, 0);
 	}
 
-	#else
+	scan_to_live_bins(cur, livelid2d_idx2, &livelid2d_img2, livelidar_mode == LIVELIDAR_MODE_SUBMAP);
+	scan_to_2d_live(cur, livelid2d_idx2, &livelid2d_img2, 0, 0, 0);
 
-	best2_x = 0;
-	best2_y = 0;
+	// Require enough valid samples on at least four of six 60deg segments,
+	// and some valid samples on either remaining segment.
+	int valid_segments_img1, valid_segments_img2;
+	int semivalid_segments_img1, semivalid_segments_img2;
+	live_segments(&livelid2d_img1, &valid_segments_img1, &semivalid_segments_img1);
+	live_segments(&livelid2d_img2, &valid_segments_img2, &semivalid_segments_img2);
 
-	#endif
+	if(valid_segments_img1 < 4 || semivalid_segments_img1 < 5)
+		return 1;
 
-	biggest_lvl = 0;
+	if(valid_segments_img2 < 4 || semivalid_segments_img2 < 5)
+		return 2;
 
-	for(int a_corr = 0; a_corr < LIVE_PASS2_NUM_A; a_corr++)
+	for(int b = 0; b < LIVE_BINS; b++)
 	{
-		int a = (uint32_t)best1_a + (uint32_t)LIVE_PASS2_A[a_corr];
-
-		int x = best2_x;
-		int y = best2_y;
-		scan_to_2d_live(p_livelidar_img2, p_livelid2d_img2, a, x, y);
-		int lvl = p_calc_f(p_livelid2d_img1, p_livelid2d_img2);
-
-		if(lvl > biggest_lvl)
-		{
-			biggest_lvl = lvl;
-			best2_a = a;
-		}
-		if(calc_must_be_finished) return 23;
+		if(IMG_VALID(&livelid2d_img1, b)) s->n_ref_points++;
 	}
 
-	if(biggest_lvl == 0)
-	{
-		return 6;
-	}
+	if(s->xy && lidar_corr_degen_check)
+		degen_check(&livelid2d_img1, LIVE_BINS, &s->degen);
 
-	// Run pass 3
-	biggest_lvl = 0;
+	s->supposed_a_diff = (uint32_t)mid2.ang - (uint32_t)mid1.ang;
+	s->supposed_x_diff = mid2.x - mid1.x;
+	s->supposed_y_diff = mid2.y - mid1.y;
 
-	int best3_a=0, best3_x=0, best3_y=0;
+	// Start the angle search from the orientation histogram estimate.
+	if(lidar_corr_orient_hist)
+		s->best.ang = orient_hist_rotation(&livelid2d_img1, &livelid2d_img2, LIVE_BINS);
 
-	#ifndef LIVE_ONLY_ANG
+	s->p_calc_f = &calc_match_lvl_live;
 
-	for(int x_corr = 0; x_corr < LIVE_PASS3_NUM_X; x_corr++)
+	// Angle only: always use high movement mode since we have a lot of time.
+	if(!s->xy ||
+	   s->supposed_a_diff < -9*ANG_1_DEG || s->supposed_a_diff > 9*ANG_1_DEG ||
+	   s->supposed_x_diff < -160 || s->supposed_x_diff > 160 ||
+	   s->supposed_y_diff < -160 || s->supposed_y_diff > 160)
 	{
-		for(int y_corr = 0; y_corr < LIVE_PASS3_NUM_Y; y_corr++)
-		{
-			int a = best2_a;
-			int x = best2_x + LIVE_PASS3_X[x_corr];
-			int y = best2_y + LIVE_PASS3_Y[y_corr];
-			scan_to_2d_live(p_livelidar_img2, p_livelid2d_img2, a, x, y);
-			int lvl = p_calc_f(p_livelid2d_img1, p_livelid2d_img2);
-
-			if(lvl > biggest_lvl)
-			{
-				biggest_lvl = lvl;
-				best3_x = x;
-				best3_y = y;
-			}
-		}
-		if(calc_must_be_finished) return 24;
+		s->high_movement_mode = 1;
+		s->p_calc_f = &calc_match_lvl_live_high_movement;
 	}
 
-	if(biggest_lvl == 0)
+	return -1;
+}
+
+/*
+	Takes a new scan (from lidar_acquire_scan(), as soon as it's available) and prepares the search; fills in
+	lidar_collision_avoidance. The scan is copied, so the buffer can be reused right away.
+*/
+void livelidar_start(lidar_scan_t* in)
+{
+	live_search_t* s = &live_search;
+	uint32_t start_time = timestamp_us();
+
+	memset(s, 0, sizeof(*s));
+	cov_set_unknown(&s->cov);
+	s->xy = livelidar_xy;
+	s->stages = s->xy ? live_stages_xy : live_stages_ang;
+	s->n_stages = s->xy ? sizeof(live_stages_xy)/sizeof(live_stages_xy[0]) : sizeof(live_stages_ang)/sizeof(live_stages_ang[0]);
+	s->reset_cnt_at_start = reset_cnt;
+	lidar_corr_evals = 0;
+
+	lidar_scan_t* cur = &livelidar_cur;
+	memcpy(cur, in, LIDAR_SIZEOF(*in));
+
+	// Our corrections applied to the robot pose after this scan was started.
+	int missing = live_sent_cnt - lidar_scan_corr_seq(in);
+	if(missing > LIVE_SENT_LEN)
 	{
-		return 7;
+		missing = 0;
+		reset_cnt_seen = -1; // Too old to fix; start over.
+	}
+	for(int i = live_sent_cnt - missing; i < live_sent_cnt; i++)
+	{
+		pos_t* mid = &live_sent_mid[i%LIVE_SENT_LEN];
+		pos_t* corr = &live_sent_corr[i%LIVE_SENT_LEN];
+		corr_scan_points(cur, 0, cur->n_points, mid, corr);
+		corr_pose(&cur->pos_at_start, mid, corr);
+		corr_pose(&cur->pos_at_end, mid, corr);
 	}
 
-	#else
+	#ifndef LIDAR_CORR_THREADS
+	scan_to_collision_avoidance(cur);
+	lidar_collision_avoidance_new = 1;
+	#endif
 
-	best3_x = 0;
-	best3_y = 0;
+	s->ret = live_prepare(s);
+	s->state = (s->ret < 0) ? LIVE_S_SEARCHING : LIVE_S_DONE;
+	s->time_us = timestamp_us() - start_time;
+}
 
-	#endif
+// Continues the search for about budget_us (one candidate is always scored). Returns 1 if there is more to do.
+int livelidar_run(int budget_us)
+{
+	live_search_t* s = &live_search;
 
-	biggest_lvl = 0;
+	if(s->state != LIVE_S_SEARCHING)
+		return 0;
 
-	for(int a_corr = 0; a_corr < LIVE_PASS3_NUM_A; a_corr++)
+	uint32_t start_time = timestamp_us();
+	uint32_t elapsed;
+	do
 	{
-		int a = best2_a + LIVE_PASS3_A[a_corr];
-		int x = best3_x;
-		int y = best3_y;
-		scan_to_2d_live(p_livelidar_img2, p_livelid2d_img2, a, x, y);
-		int lvl = p_calc_f(p_livelid2d_img1, p_livelid2d_img2);
+		live_eval(s);
+		elapsed = timestamp_us() - start_time;
+	} while(s->state == LIVE_S_SEARCHING && elapsed < (uint32_t)budget_us);
 
-		if(lvl > biggest_lvl)
-		{
-			biggest_lvl = lvl;
-			best3_a = a;
-		}
-		if(calc_must_be_finished) return 25;
-	}
+	s->time_us += elapsed;
 
-	if(biggest_lvl == 0)
-	{
-		return 8;
-	}
+	return s->state == LIVE_S_SEARCHING;
+}
 
-	// Run pass 4, which goes x,y,a instead of (x,y),a
+/*
+	Ends the search, with the best pose found so far; corrects the robot pose, and fills in livelidar_report.
+	Call before livelidar_start() of the next scan.
 
-	int best4_a=0, best4_x=0, best4_y=0;
+	Return:
+	-1 if there was no search to finish
+	0 on success, the scan is the new reference (fused into the submap)
+	100 on success, robot has moved very little and the reference is kept (LIVELIDAR_MODE_SCAN only)
+	1..2 on too few points, 3.. when stage (ret-3) found no match at all: the scan is the new reference uncorrected
+	     (the submap is started over from it)
+	20 when no stage was finished in time: the scan is the new reference uncorrected (the submap is kept as it is)
+	30 when the scan is marked invalid; it's not used
+	31 when there is no reference yet; the scan is the new reference (starts the submap)
+	32 after reset_lidar_corr_images(): the reference is dropped, and the scan is not used
+*/
+int livelidar_finish()
+{
+	live_search_t* s = &live_search;
+	lidar_scan_t* cur = &livelidar_cur;
 
-	#ifndef LIVE_ONLY_ANG
+	if(s->state == LIVE_S_IDLE)
+		return -1;
 
-	if(!high_movement_mode)
-	{
+	int ret = s->ret;
+	if(s->state == LIVE_S_SEARCHING)
+		ret = s->stages_done ? 0 : 20;
+	s->state = LIVE_S_IDLE;
 
-		biggest_lvl = 0;
+	latest_corr.ang = 0;
+	latest_corr.x = 0;
+	latest_corr.y = 0;
 
-		for(int y_corr = 0; y_corr < LIVE_PASS4_NUM_Y; y_corr++)
+	if(ret == 0 && reset_cnt != s->reset_cnt_at_start)
+	{
+		// Pose was changed during the search; the result is useless.
+		ret = 32;
+	}
+	else if(ret == 0)
+	{
+		degen_project(&s->degen, &s->best, &s->cov);
+		latest_corr = s->best;
+
+		if(livelidar_mode == LIVELIDAR_MODE_SCAN &&
+		   latest_corr.ang > -2*ANG_1_DEG && latest_corr.ang < 2*ANG_1_DEG &&
+		   latest_corr.x > -30  &&  latest_corr.x < 30  &&
+		   latest_corr.y > -30  &&  latest_corr.y < 30  &&
+		   s->supposed_a_diff > -40*ANG_1_DEG && s->supposed_a_diff < 40*ANG_1_DEG &&
+		   s->supposed_x_diff > -120 && s->supposed_x_diff < 120 &&
+		   s->supposed_y_diff > -120 && s->supposed_y_diff < 120)
 		{
-			int a = best3_a;
-			int x = best3_x;
-			int y = best3_y + LIVE_PASS4_Y[y_corr];
-			scan_to_2d_live(p_livelidar_img2, p_livelid2d_img2, a, x, y);
-			int lvl = p_calc_f(p_livelid2d_img1, p_livelid2d_img2);
+			/*
+				Based on both information provided by feedback.c, and our lidar_corr,
+				robot has moved very little.
 
-			if(lvl > biggest_lvl)
-			{
-				biggest_lvl = lvl;
-				best4_y = y;
-			}
+				As the lidar information is quantized (especially in angular 360-step resolution),
+				error would accumulate. So, we keep the reference scan, and only correct the robot pose.
+			*/
+			ret = 100;
 		}
-		if(calc_must_be_finished) return 26;
 
-		if(biggest_lvl == 0) return 9;
-		biggest_lvl = 0;
+		pos_t mid;
+		scan_mid_pos(cur, &mid);
 
-		for(int x_corr = 0; x_corr < LIVE_PASS4_NUM_X; x_corr++)
-		{
-			int a = best3_a;
-			int x = best3_x + LIVE_PASS4_X[x_corr];
-			int y = best4_y;
-			scan_to_2d_live(p_livelidar_img2, p_livelid2d_img2, a, x, y);
-			int lvl = p_calc_f(p_livelid2d_img1, p_livelid2d_img2);
+		// The robot pose gets the correction weighed against its own uncertainty; so does the reference.
+		pos_t applied = latest_corr;
+		weigh_correction(&applied, &s->cov);
 
-			if(lvl > biggest_lvl)
+		int corrected = 1;
+		if(latest_corr.ang != 0 || latest_corr.x != 0 || latest_corr.y != 0)
+		{
+			if(lidar_correct_pose(&mid, &latest_corr, &s->cov))
 			{
-				biggest_lvl = lvl;
-				best4_x = x;
+				corrected = 0; // Previous one still pending
+			}
+			else
+			{
+				live_sent_mid[live_sent_cnt%LIVE_SENT_LEN] = mid;
+				live_sent_corr[live_sent_cnt%LIVE_SENT_LEN] = applied;
+				live_sent_cnt++;
 			}
 		}
-		if(calc_must_be_finished) return 27;
-
-		if(biggest_lvl == 0) return 10;
-		biggest_lvl = 0;
 
-
-		for(int a_corr = 0; a_corr < LIVE_PASS4_NUM_A; a_corr++)
+		if(ret == 0)
 		{
-			int a = best3_a + LIVE_PASS4_A[a_corr];
-			int x = best4_x;
-			int y = best4_y;
-			scan_to_2d_live(p_livelidar_img2, p_livelid2d_img2, a, x, y);
-			int lvl = p_calc_f(p_livelid2d_img1, p_livelid2d_img2);
-
-			if(lvl > biggest_lvl)
+			if(corrected)
 			{
-				biggest_lvl = lvl;
-				best4_a = a;
+				corr_scan_points(cur, 0, cur->n_points, &mid, &applied);
+				corr_pose(&cur->pos_at_start, &mid, &applied);
+				corr_pose(&cur->pos_at_end, &mid, &applied);
 			}
-		}
-		if(calc_must_be_finished) return 28;
-
-		if(biggest_lvl == 0) return 11;
-	}
-	else
-	#endif
-	{
-		best4_a = best3_a;
-		best4_x = best3_x;
-		best4_y = best3_y;
-	}
-
-
-	latest_corr.ang = best4_a;
-	latest_corr.x = best4_x;
-	latest_corr.y = best4_y;	
-
-	if(best4_a > -2*ANG_1_DEG && best4_a < 2*ANG_1_DEG &&
-	   best4_x > -30  &&  best4_x < 30  &&
-	   best4_y > -30  &&  best4_y < 30  &&
-	   supposed_a_diff > -40*ANG_1_DEG && supposed_a_diff < 40*ANG_1_DEG &&
-	   supposed_x_diff > -120 && supposed_x_diff < 120 &&
-	   supposed_y_diff > -120 && supposed_y_diff < 120)
-	{
-		/*
-			Based on both information provided by feedback.c, and our lidar_corr,
-			robot has moved very little.
-
-			As the lidar information is quantized (especially in angular 360-step resolution),
-			error would accumulate. So, we instruct not to swap buffers, but overwrite img2,
-			while keeping img1 the same.
-		*/
-
-		skip = 1;
-
-		memcpy(&lid_skiphold, p_livelidar_img1, sizeof(live_lidar_scan_t));
-		memcpy(l2d_skiphold, p_livelid2d_img1, 360*sizeof(point_t));
-		memcpy(num_samples_skiphold, p_livelidar_num_samples_img1, 6*sizeof(int));
 
-
-		if(best4_a < -1*ANG_1_DEG || best4_a > 1*ANG_1_DEG ||
-		   best4_x < -15 || best4_x > 15 ||
-		   best4_y < -15 || best4_y > 15 ||
-		   supposed_a_diff < -20*ANG_1_DEG || supposed_a_diff > 20*ANG_1_DEG ||
-		   supposed_x_diff < -60 || supposed_x_diff > 60 ||
-		   supposed_y_diff < -60 || supposed_y_diff > 60)
-		{
-			// when semi_significant_img == 1, we are halfway distance to a non-skipping significant image;
-			// or we have half of the error required to mark the image significant.
-			semi_significant_img++;
+			if(livelidar_mode == LIVELIDAR_MODE_SUBMAP)
+			{
+				// Not in the robot's frame without the correction.
+				if(corrected)
+					submap_insert(cur);
+			}
+			else
+				memcpy(&livelidar_ref, cur, LIDAR_SIZEOF(*cur));
 		}
-		else
-			semi_significant_img = 0;
 	}
-	else
+	else if(livelidar_mode == LIVELIDAR_MODE_SUBMAP && (ret < 20 || ret == 31))
 	{
-		skip = 0;
-		semi_significant_img = 0;
+		pos_t mid;
+		scan_mid_pos(cur, &mid);
+		submap_reset(mid.x, mid.y);
+		submap_insert(cur);
 	}
-
-	// We apply the correction to img2, which will be img1 on the next round (unless we skip).
-	// In addition, we still need to apply the correction to the new lidar scan just being finished,
-	// and to the robot coordinates as well (just before starting a new lidar scan)
-	apply_corr_to_livelidar(p_livelidar_img2);
-
-	if(skip)
+	else if(livelidar_mode == LIVELIDAR_MODE_SCAN && (ret < 30 || ret == 31))
 	{
-		return 100;
+		memcpy(&livelidar_ref, cur, LIDAR_SIZEOF(*cur));
+		livelidar_ref_ok = 1;
 	}
 
-	return 0;
-}
-
-// Run this continuosly on the main thread.
-// if allowed_to_send_lidar, and the time is right to send the previous lidar image, it's sent, and 1 is returned.
-// if allowed_to_send_lidar == 0, sending is just skipped, and the image will be missed by the host.
+	latest_corr_ret = ret;
 
-
-int livelidar_fsm(int allowed_to_send_lidar)
-{
-	int ret = 0;
-	if(live_lidar_calc_req)
-	{
-		live_lidar_calc_req = 0;
-		// Before starting calculating the new images, copy the result of previous scan for sending, and send it.
-		if(allowed_to_send_lidar && !uart_busy())
-		{
-			if(skip)
-			{
-				// Just the newest image, robot has moved quite little.
-				send_2d_live_to_uart(p_livelidar_img2, p_livelid2d_img2, (semi_significant_img==1)?2:0);
-			}
-			else
-			{
-				// This was img2 just a moment ago; it has been corrected for position, and it's significant:
-				int significant = 0;
-				if(latest_corr_ret == 100 || latest_corr_ret == 0) significant = 1;
-				send_2d_live_to_uart(p_livelidar_img1, p_livelid2d_img1, significant); 
-			}
-			ret = 1;
-		}
-		// Start correcting img1,img2.
-		latest_corr_ret = do_livelidar_corr();
-	}
+	livelidar_report.id = cur->id; // The scan just matched, not the one livelidar_start() gets next
+	livelidar_report.ret = ret;
+	livelidar_report.stages = s->stages_done;
+	livelidar_report.quality = s->n_ref_points ? (s->best_raw<<8)/s->n_ref_points : 0;
+	livelidar_report.time = s->time_us;
+	livelidar_report.evals = lidar_corr_evals;
+	livelidar_report.corr = latest_corr;
+	livelidar_report.cov = s->cov;
+	lidar_corr_cov = s->cov;
+	lidar_corr_degen = s->degen.on;
 
 	return ret;
 }
-
@@ -3,16 +3,94 @@
 
 #include "lidar.h"
 
+#ifdef LIDAR_CORR_OFFLINE
+/*
+	Offline matchers, for the host tools only: their buffers (the 36 KB distance transform grid alone) don't
+	fit the MCU next to everything else. The firmware only has the live matcher.
+*/
+
 int do_lidar_corr(lidar_scan_t* scan1, lidar_scan_t* scan2, pos_t* corr);
 
-void live_lidar_calc_must_be_finished();
-void apply_corr_to_livelidar(live_lidar_scan_t* lid);
-void livelidar_storage_finished();
-int livelidar_fsm(int allowed_to_send_lidar);
+// Scoring used by do_lidar_corr():
+#define LIDAR_CORR_MODE_POINTS 0 // img2 points to nearest img1 points
+#define LIDAR_CORR_MODE_LINES  1 // img2 points to the segments between neighbouring img1 points
+#define LIDAR_CORR_MODE_GRID   2 // Like LINES, but through a precomputed distance transform grid: one lookup per point
+
+extern CORR_TLS int lidar_corr_mode;
+
+// do_lidar_corr() PASS1 scores all candidates on a subset of the points, then the best ones on all points;
+// the later passes drop candidates as soon as they can't win (see lidar_corr.c).
+extern CORR_TLS int lidar_corr_coarse;
+extern CORR_TLS int lidar_corr_pts; // Image points visited by the kernels during the latest do_lidar_corr()
+#endif
+
+// Recentre the first angle pass on the orientation histogram estimate (do_lidar_corr() and the live matcher).
+extern CORR_TLS int lidar_corr_orient_hist;
+
+// Search only the constrained direction when the reference constrains one translation direction only (a corridor),
+// and leave the other one out of the result, see degen_project().
+extern CORR_TLS int lidar_corr_degen_check;
+extern CORR_TLS int lidar_corr_degen; // The latest match was such
+extern CORR_TLS int lidar_corr_evals;
+extern CORR_TLS corr_cov_t lidar_corr_cov;
+
+#if defined(LIDAR_CORR_OFFLINE) && defined(LIDAR_CORR_BNB)
+// Exhaustive-equivalent search of the PASS1 window in one go (branch-and-bound over the distance transform grid),
+// scoring like LIDAR_CORR_MODE_GRID, then refined off the 16 mm, 0.25 deg lattice.
+int do_lidar_corr_bnb(lidar_scan_t* scan1, lidar_scan_t* scan2, pos_t* corr);
+#endif
 
-int livelidar_skip();
+// Live matching of consecutive scans on the MCU, see lidar_corr.c.
+void livelidar_start(lidar_scan_t* in);
+int livelidar_run(int budget_us);
+int livelidar_finish();
 
+// Reference the live matcher aligns new scans with:
+#define LIVELIDAR_MODE_SCAN   0 // The previous scan (or an older one when the robot hardly moved)
+#define LIVELIDAR_MODE_SUBMAP 1 // Occupancy grid of the latest scans around the robot
+
+extern CORR_TLS int livelidar_mode;
+
+/*
+	1: the live matcher searches x,y too, only along the constrained direction in corridors (see degen_check()).
+	0 (default): angle only; x,y of the correction stay 0, and its covariance has COV_UNKNOWN for them. Read at
+	livelidar_start().
+*/
+extern CORR_TLS int livelidar_xy;
 void reset_lidar_corr_images();
 
+// Result of the latest livelidar_finish(), sent to the host (0xa6) after each scan.
+typedef struct __attribute__((packed))
+{
+	uint8_t id;       // id of the scan
+	int8_t ret;       // livelidar_finish() return value
+	uint8_t stages;   // Number of search stages finished in time
+	uint16_t quality; // Score of corr: matching points per reference point, 256 = all
+	uint32_t time;    // Calculation time (sum of the slices), in us
+	uint16_t evals;   // Number of candidate poses scored
+	pos_t corr;       // Correction around the middle of the scan, before weigh_correction()
+	corr_cov_t cov;   // Covariance of corr
+} livelidar_report_t;
+
+extern CORR_TLS livelidar_report_t livelidar_report;
+
+#ifdef LIDAR_CORR_TUNE
+/*
+	Scoring and search constants as variables, for the host parameter sweep (host/sweep.c). Initialized to the
+	built-in values.
+*/
+typedef struct
+{
+	int match_div;   // calc_match_lvl(), calc_match_lvl_lines() score offset, mm^2 (MATCH_DIV)
+	int grid_div;    // calc_match_lvl_grid() (MATCH_GRID_OFFSET)
+	int live_div;    // calc_match_lvl_live() (MATCH_DIV_OFFSET)
+	int live_div_hi; // calc_match_lvl_live_high_movement() (MATCH_DIV_OFFSET_HI)
+	int pass1_step;  // do_lidar_corr() PASS1 translation steps, percent of PASS1_X
+	int pass1_weigh; // 0: PASS1 candidates are not weighed towards zero correction
+} lidar_corr_tune_t;
+
+extern CORR_TLS lidar_corr_tune_t lidar_corr_tune;
+#endif
+
 
 #endif
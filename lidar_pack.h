@@ -0,0 +1,40 @@
+#ifndef LIDAR_PACK_H
+#define LIDAR_PACK_H
+
+#include <stdint.h>
+#include "lidar.h"
+
+/*
+	Lidar scan with the points compressed for the UART, see lidar_pack.c.
+
+	Sent to the host instead of the lidar_scan_t when lidar_uart_mode says so, unless it's no smaller than the
+	lidar_scan_t would be. The reference decoder is host/lidar_unpack.c.
+*/
+
+#define LIDAR_PACK_MAX_BYTES (LIDAR_MAX_POINTS*6) // Worst case: two 3-byte codes per point
+
+typedef struct __attribute__((packed)) __attribute__((aligned(4)))
+{
+	// Copied from the lidar_scan_t
+	uint8_t status;
+	uint8_t id;
+	int16_t n_points;
+	uint32_t version;
+	pos_t pos_at_start;
+	pos_t pos_at_end;
+	pos_t corr;
+	corr_cov_t corr_cov;
+	xy_i32_t refxy;
+
+	uint16_t n_bytes;  // of data[]
+	uint8_t data[LIDAR_PACK_MAX_BYTES];
+} lidar_pack_t;
+
+#define LIDAR_PACK_HEADER_SIZE (1+1+2+4+3*sizeof(pos_t)+sizeof(corr_cov_t)+sizeof(xy_i32_t)+2)
+#define LIDAR_PACK_SIZEOF(p) (LIDAR_PACK_HEADER_SIZE+(p).n_bytes)
+
+extern lidar_pack_t lidar_pack;
+
+int lidar_pack_scan(lidar_scan_t* in, lidar_pack_t* out);
+
+#endif
@@ -0,0 +1,122 @@
+/*
+	Projection of the raw lidar samples to scan points, while sampling (lidar.c) and again afterwards with a
+	corrected pose trajectory (lidar_reproject()).
+*/
+
+#include <stdint.h>
+#include "lidar_reproject.h"
+#include "sin_lut.h"
+
+/*
+	Scan point of a sample of len mm at the sensor angle degper16, seen from the robot pose (ang, px, py).
+	Returns 1 if it doesn't fit in the scan.
+*/
+int lidar_project(uint32_t ang, int32_t px, int32_t py, int32_t degper16, int32_t len, xy_i32_t* refxy, xy_i16_t* out)
+{
+	#ifdef PROD1
+		uint32_t ang32 = ang + ANG_180_DEG - degper16*ANG_1PER16_DEG;
+	#else
+		uint32_t ang32 = ang - degper16*ANG_1PER16_DEG;
+	#endif
+	int32_t y_idx = (ang32)>>SIN_LUT_SHIFT;
+	int32_t x_idx = (1073741824-ang32)>>SIN_LUT_SHIFT;
+
+	int32_t x = px + (((int32_t)sin_lut[x_idx] * len)>>15) - refxy->x;
+	int32_t y = py + (((int32_t)sin_lut[y_idx] * len)>>15) - refxy->y;
+
+	if(x < -30000 || x > 30000 || y < -30000 || y > 30000)
+		return 1;
+
+	out->x = x;
+	out->y = y;
+	return 0;
+}
+
+// Robot pose at tick t, between the two recorded poses around it. *k is the search position in the ring, from
+// the oldest pose kept; the ticks asked for must not decrease.
+static void raw_pose_at(lidar_raw_t* raw, int32_t t, int* k, pos_t* out)
+{
+	int last = raw->n_poses-1;
+	lidar_raw_pose_t* a = &raw->poses[*k & (LIDAR_POSE_RING-1)];
+	while(*k < last && raw->poses[(*k+1) & (LIDAR_POSE_RING-1)].tick <= t)
+	{
+		(*k)++;
+		a = &raw->poses[*k & (LIDAR_POSE_RING-1)];
+	}
+
+	*out = a->pos;
+	if(*k == last || t <= a->tick)
+		return;
+
+	lidar_raw_pose_t* b = &raw->poses[(*k+1) & (LIDAR_POSE_RING-1)];
+	int32_t dt = b->tick - a->tick;
+	int32_t f = t - a->tick;
+	out->ang += ((int64_t)(int32_t)((uint32_t)b->pos.ang - (uint32_t)a->pos.ang)*f)/dt;
+	out->x += ((b->pos.x - a->pos.x)*f)/dt;
+	out->y += ((b->pos.y - a->pos.y)*f)/dt;
+}
+
+// The correction f/n of the way from c1 to c2, applied to *p like correct_location_without_moving() does.
+static void raw_correct(pos_t* p, pos_t* mid, pos_t* c1, pos_t* c2, int32_t f, int32_t n)
+{
+	pos_t c = *c1;
+	if(n > 0)
+	{
+		c.ang += ((int64_t)(int32_t)((uint32_t)c2->ang - (uint32_t)c1->ang)*f)/n;
+		c.x += ((c2->x - c1->x)*f)/n;
+		c.y += ((c2->y - c1->y)*f)/n;
+	}
+
+	if(mid)
+	{
+		int32_t sin_a = sin_lut[((uint32_t)c.ang)>>SIN_LUT_SHIFT];
+		int32_t cos_a = sin_lut[(1073741824-(uint32_t)c.ang)>>SIN_LUT_SHIFT];
+		int32_t dx = p->x - mid->x;
+		int32_t dy = p->y - mid->y;
+		c.x += ((dx*cos_a - dy*sin_a + (1<<14))>>15) - dx;
+		c.y += ((dx*sin_a + dy*cos_a + (1<<14))>>15) - dy;
+	}
+	p->x += c.x;
+	p->y += c.y;
+	p->ang += c.ang;
+}
+
+/*
+	Projects the points of a finished scan again from its raw samples, with the recorded pose trajectory
+	corrected: rotation by corr.ang around *mid (around the robot if mid is NULL), then translation by
+	(corr.x, corr.y), like correct_location_without_moving(). The correction goes linearly from *corr_start at
+	the start of the scan to *corr_end at its end: a heading error that grew during the revolution is taken
+	out sample by sample instead of turning the whole scan. corr_end == corr_start is a rigid correction.
+
+	pos_at_start and pos_at_end are corrected, too; refxy stays. A point that would no longer fit in the scan
+	keeps its old coordinates.
+
+	Nothing is projected twice while sampling for this: call it only for scans that need it. The scan must be
+	held with lidar_acquire_scan().
+*/
+void lidar_reproject(lidar_scan_t* scan, pos_t* mid, pos_t* corr_start, pos_t* corr_end)
+{
+	lidar_raw_t* raw = &lidar_raws[scan - lidar_scans];
+	if(raw->n_poses < 1)
+		return;
+
+	int k = (raw->n_poses > LIDAR_POSE_RING) ? (raw->n_poses - LIDAR_POSE_RING) : 0;
+	int32_t t_end = raw->poses[(raw->n_poses-1) & (LIDAR_POSE_RING-1)].tick;
+
+	for(int i = 0; i < scan->n_points; i++)
+	{
+		lidar_raw_sample_t* s = &raw->samples[i];
+		pos_t p;
+		raw_pose_at(raw, s->tick, &k, &p);
+		raw_correct(&p, mid, corr_start, corr_end, s->tick, t_end);
+		lidar_project(p.ang, p.x, p.y, s->degper16, s->len, &scan->refxy, &scan->scan[i]);
+	}
+
+	pos_t p = scan->pos_at_start;
+	raw_correct(&p, mid, corr_start, corr_end, 0, t_end);
+	scan->pos_at_start = p;
+	p = scan->pos_at_end;
+	raw_correct(&p, mid, corr_start, corr_end, t_end, t_end);
+	scan->pos_at_end = p;
+	scan->status |= LIDAR_REPROJECTED;
+}
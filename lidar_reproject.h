@@ -0,0 +1,10 @@
+#ifndef LIDAR_REPROJECT_H
+#define LIDAR_REPROJECT_H
+
+#include <stdint.h>
+#include "lidar.h"
+
+int lidar_project(uint32_t ang, int32_t px, int32_t py, int32_t degper16, int32_t len, xy_i32_t* refxy, xy_i16_t* out);
+void lidar_reproject(lidar_scan_t* scan, pos_t* mid, pos_t* corr_start, pos_t* corr_end);
+
+#endif
@@ -0,0 +1,48 @@
+#ifndef LIDAR_SEGS_H
+#define LIDAR_SEGS_H
+
+#include <stdint.h>
+#include "lidar.h"
+
+/*
+	Line segments fitted to a finished lidar scan, see lidar_segs.c.
+
+	Sent to the host instead of (or in addition to) the scan points, depending on lidar_uart_mode (lidar.h).
+*/
+
+#define LIDAR_MAX_SEGS 128
+
+typedef struct __attribute__((packed))
+{
+	xy_i16_t p1;       // Endpoints in scan order, referenced to refxy like the scan points
+	xy_i16_t p2;
+	uint16_t first;    // Index of the first scan point the segment was fitted to
+	uint16_t n_points;
+	uint16_t rms;      // RMS distance of the points from the line, 1/16 mm
+} lidar_seg_t;
+
+typedef struct __attribute__((packed)) __attribute__((aligned(4)))
+{
+	// Copied from the lidar_scan_t
+	uint8_t status;
+	uint8_t id;
+	int16_t n_points;
+	uint32_t version;
+	pos_t pos_at_start;
+	pos_t pos_at_end;
+	pos_t corr;
+	corr_cov_t corr_cov;
+	xy_i32_t refxy;
+
+	int16_t n_segs;
+	int16_t n_loose;   // Scan points not on any segment
+	lidar_seg_t segs[LIDAR_MAX_SEGS];
+} lidar_segs_t;
+
+#define LIDAR_SEGS_SIZEOF(s) (1+1+2+4+3*sizeof(pos_t)+sizeof(corr_cov_t)+sizeof(xy_i32_t)+2+2+sizeof(lidar_seg_t)*((s).n_segs))
+
+extern lidar_segs_t lidar_segs;
+
+int lidar_segments(lidar_scan_t* in, lidar_segs_t* out);
+
+#endif
@@ -21,6 +21,8 @@
 #include "feedbacks.h"
 #include "navig.h"
 #include "lidar_corr.h"
+#include "lidar_segs.h"
+#include "lidar_pack.h"
 #include "uart.h"
 
 #include "settings.h"
@@ -395,6 +397,22 @@ volatile int millisec;
 volatile int us100;
 extern volatile int do_compass_round;
 
+/*
+	Microseconds since boot, from us100 and the TIM6 counter (60 MHz, reloads every 100 us).
+	Only for the main thread: in a higher priority interrupt, the us100 increment may be pending.
+*/
+uint32_t timestamp_us()
+{
+	int u;
+	uint32_t cnt;
+	do
+	{
+		u = us100;
+		cnt = TIM6->CNT;
+	} while(u != us100);
+	return (uint32_t)u*100 + cnt/60;
+}
+
 void power_and_led_fsm();
 
 void timebase_10k_handler()
@@ -637,10 +655,21 @@ void power_and_led_fsm()
 
 volatile uint32_t random = 123;
 
-extern volatile int lidar_scan_ready;
 
 volatile int dbg_sending_lidar = 0;
 
+// The live scan matcher gets the main loop idle time in slices of this length.
+#define LIVELIDAR_SLICE_US 500
+
+static void wait_uart()
+{
+	while(uart_busy())
+	{
+		random++;
+		livelidar_run(LIVELIDAR_SLICE_US);
+	}
+}
+
 void uart_send_dbg_teleportation_bug()
 {
 	if(uart_busy())
@@ -657,6 +686,7 @@ void uart_send_dbg_teleportation_bug()
 }
 
 volatile int send_settings;
+volatile int gen_lidar_ignore;
 
 int main()
 {
@@ -958,26 +988,82 @@ int main()
 //		int speedy = (xcel_long_integrals[1]/**245*/)>>12;
 
 		static uint8_t sync_packet[8] = {0xff,0xff,0xff,0xff,  0xff,0xff,0x12,0xab};
-		while(uart_busy()) random++;
+		wait_uart();
 		send_uart(sync_packet, 0xaa, 8);
-		while(uart_busy()) random++;
+		wait_uart();
 
 		uart_send_dbg_teleportation_bug();
 
 		LED_ON();
-		lidar_scan_ready = 0;
-		while(!lidar_scan_ready) ;
+		while(!lidar_scan_published())
+			livelidar_run(LIVELIDAR_SLICE_US);
 		LED_OFF();
-		dbg_sending_lidar = 1;
-		send_uart(prev_lidar_scan, 0x84, LIDAR_SIZEOF(*prev_lidar_scan));
-		dbg_sending_lidar = 0;
+
+		// Take the best match found so far for the previous scan, and start with the new one.
+		// The new one stays as it is until the next lidar_acquire_scan(), while it's being sent.
+		int livelidar_ret = livelidar_finish();
+		lidar_scan_t* scan = lidar_acquire_scan(NULL);
+		int uart_mode = lidar_uart_mode;
+		int lidar_bytes = 0;
+		if(uart_mode == LIDAR_UART_POINTS || uart_mode == LIDAR_UART_BOTH)
+		{
+			dbg_sending_lidar = 1;
+			send_uart(scan, 0x84, LIDAR_SIZEOF(*scan));
+			lidar_bytes += LIDAR_SIZEOF(*scan);
+			dbg_sending_lidar = 0;
+		}
+		else if(uart_mode == LIDAR_UART_PACKED || uart_mode == LIDAR_UART_PACKED_SEGS)
+		{
+			dbg_sending_lidar = 1;
+			lidar_pack_scan(scan, &lidar_pack);
+			if(LIDAR_PACK_SIZEOF(lidar_pack) < LIDAR_SIZEOF(*scan))
+			{
+				send_uart(&lidar_pack, 0x87, LIDAR_PACK_SIZEOF(lidar_pack));
+				lidar_bytes += LIDAR_PACK_SIZEOF(lidar_pack);
+			}
+			else // Noisy scans don't pack: the raw one is no bigger.
+			{
+				send_uart(scan, 0x84, LIDAR_SIZEOF(*scan));
+				lidar_bytes += LIDAR_SIZEOF(*scan);
+			}
+			dbg_sending_lidar = 0;
+		}
+		if(uart_mode == LIDAR_UART_SEGS || uart_mode == LIDAR_UART_BOTH || uart_mode == LIDAR_UART_PACKED_SEGS)
+		{
+			lidar_segments(scan, &lidar_segs);
+			wait_uart();
+			send_uart(&lidar_segs, 0x86, LIDAR_SEGS_SIZEOF(lidar_segs));
+			lidar_bytes += LIDAR_SEGS_SIZEOF(lidar_segs);
+		}
+		lidar_auto_rate(scan, lidar_bytes);
+		livelidar_start(scan);
+
+		int ignore_ret = lidar_ignore_calib_run();
+		if(gen_lidar_ignore)
+		{
+			gen_lidar_ignore = 0;
+			ignore_ret = generate_lidar_ignore();
+		}
+		if(ignore_ret < 1)
+		{
+			static int8_t lidar_ignore_ret; // send_uart() reads it later
+			lidar_ignore_ret = ignore_ret;
+			wait_uart();
+			send_uart(&lidar_ignore_ret, 0xd3, 1);
+		}
+
+		if(livelidar_ret >= 0)
+		{
+			wait_uart();
+			send_uart(&livelidar_report, 0xa6, sizeof(livelidar_report_t));
+		}
 
 		// Send stuff required to be sent often:
-		while(uart_busy()) random++;
+		wait_uart();
 		uart_send_critical1(); 
-		while(uart_busy()) random++;
+		wait_uart();
 		uart_send_critical2(); 
-		while(uart_busy()) random++;
+		wait_uart();
 		uart_send_fsm(); // send something else.
 
 #ifdef SONARS_INSTALLED
@@ -985,30 +1071,31 @@ int main()
 			sonar_xyz_t* sonar;
 			while( (sonar = get_sonar_point()) )
 			{
-				while(uart_busy()) random++;
+				wait_uart();
 				send_uart(sonar, 0x85, sizeof(sonar_xyz_t));
 			}
 		}
 #endif
 
-		while(uart_busy()) random++;
+		wait_uart();
 		uart_send_critical1(); // Send stuff required to be sent often.
 
 
 		if(send_chafind_results)
 		{
 			send_chafind_results = 0;
-			while(uart_busy()) random++;
+			wait_uart();
 			send_uart(&chafind_results, 0x95, sizeof(chafind_results_t));
 		}
 
 		if(send_settings)
 		{
 			send_settings = 0;
-			while(uart_busy()) random++;
+			wait_uart();
 			send_uart(&settings, 0xd1, sizeof(settings_t));
 		}
 
+
 /*
 		static int sensors_stabilized = 0;
 		if(!sensors_stabilized && seconds > 10)
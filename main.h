@@ -71,6 +71,7 @@ void run_flasher();
 void mc_flasher(int mcnum);
 void delay_ms(uint32_t i);
 void delay_us(uint32_t i);
+uint32_t timestamp_us();
 
 
 extern volatile int optflow_int_x, optflow_int_y;
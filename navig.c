@@ -14,10 +14,10 @@ Collision avoidance, simple mechanical tasks.
 #include "sonar.h"
 #include "navig.h"
 #include "feedbacks.h"
-#include "lidar_corr.h" // for point_t (for lidar collision avoidance)
+#include "lidar_corr.h" // for img_t (for lidar collision avoidance)
 #include "main.h"
 
-extern point_t lidar_collision_avoidance[360];
+extern img_t lidar_collision_avoidance;
 volatile int lidar_collision_avoidance_new;
 int enable_coll_avoidance = 1;
 int collision_avoidance_on;
@@ -403,33 +403,33 @@ void daiju_meininki_fsm()
 
 		for(int i = (360-60); i < 360; i+=2)
 		{
-			if(!lidar_collision_avoidance[i].valid) continue;
+			if(!IMG_VALID(&lidar_collision_avoidance, i)) continue;
 
-			int dist_to_front = lidar_collision_avoidance[i].x - robot_origin_to_front;
+			int dist_to_front = lidar_collision_avoidance.x[i] - robot_origin_to_front;
 
-			if(lidar_collision_avoidance[i].y > -1*(robot_ys/2+10) && lidar_collision_avoidance[i].y < (robot_ys/2+10))
+			if(lidar_collision_avoidance.y[i] > -1*(robot_ys/2+10) && lidar_collision_avoidance.y[i] < (robot_ys/2+10))
 			{
 				if(dist_to_front < nearest_colliding_front) nearest_colliding_front = dist_to_front;
 			}
 		}
 		for(int i = 0; i < 60; i+=2)
 		{
-			if(!lidar_collision_avoidance[i].valid) continue;
+			if(!IMG_VALID(&lidar_collision_avoidance, i)) continue;
 
-			int dist_to_front = lidar_collision_avoidance[i].x - robot_origin_to_front;
+			int dist_to_front = lidar_collision_avoidance.x[i] - robot_origin_to_front;
 
-			if(lidar_collision_avoidance[i].y > -1*(robot_ys/2+10) && lidar_collision_avoidance[i].y < (robot_ys/2+10))
+			if(lidar_collision_avoidance.y[i] > -1*(robot_ys/2+10) && lidar_collision_avoidance.y[i] < (robot_ys/2+10))
 			{
 				if(dist_to_front < nearest_colliding_front) nearest_colliding_front = dist_to_front;
 			}
 		}
 		for(int i = 180-60; i < 180+60; i+=2)
 		{
-			if(!lidar_collision_avoidance[i].valid) continue;
+			if(!IMG_VALID(&lidar_collision_avoidance, i)) continue;
 
-			int dist_to_back  = -1*lidar_collision_avoidance[i].x - robot_origin_to_back;
+			int dist_to_back  = -1*lidar_collision_avoidance.x[i] - robot_origin_to_back;
 
-			if(lidar_collision_avoidance[i].y > -1*(robot_ys/2+0) && lidar_collision_avoidance[i].y < (robot_ys/2+0))
+			if(lidar_collision_avoidance.y[i] > -1*(robot_ys/2+0) && lidar_collision_avoidance.y[i] < (robot_ys/2+0))
 			{
 				if(dist_to_back  < nearest_colliding_back) nearest_colliding_back = dist_to_back;
 			}
@@ -444,11 +444,11 @@ void daiju_meininki_fsm()
 		// Check the arse, to avoid hitting when turning.
 		for(int i = 90-1; i < 90+35; i+=2)
 		{
-			if(!lidar_collision_avoidance[i].valid) continue;
+			if(!IMG_VALID(&lidar_collision_avoidance, i)) continue;
 
-			if(lidar_collision_avoidance[i].y < robot_ys/2+40)
+			if(lidar_collision_avoidance.y[i] < robot_ys/2+40)
 			{
-				if(lidar_collision_avoidance[i].x < 0 && lidar_collision_avoidance[i].x > -robot_origin_to_back)
+				if(lidar_collision_avoidance.x[i] < 0 && lidar_collision_avoidance.x[i] > -robot_origin_to_back)
 				{
 					can_do[TURN_LEFT] = 0;
 					break;
@@ -460,11 +460,11 @@ void daiju_meininki_fsm()
 		// Check the arse, to avoid hitting when turning.
 		for(int i = 180+35; i < 180+90+1; i+=2)
 		{
-			if(!lidar_collision_avoidance[i].valid) continue;
+			if(!IMG_VALID(&lidar_collision_avoidance, i)) continue;
 
-			if(lidar_collision_avoidance[i].y > -1*(robot_ys/2+40))
+			if(lidar_collision_avoidance.y[i] > -1*(robot_ys/2+40))
 			{
-				if(lidar_collision_avoidance[i].x < 0 && lidar_collision_avoidance[i].x > -(robot_origin_to_back+10))
+				if(lidar_collision_avoidance.x[i] < 0 && lidar_collision_avoidance.x[i] > -(robot_origin_to_back+10))
 				{
 					can_do[TURN_RIGHT] = 0;
 					break;
@@ -9,7 +9,7 @@
 settings_t settings __attribute__((section(".settings"))) =
 {
 	.magic = 0x1357acef,
-	.version = 10
+	.version = 11
 
 };
 
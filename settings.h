@@ -26,7 +26,8 @@ typedef struct
 	                        // Change the version number when the settings are incompatible with older revisions,
 	                        // e.g., if variable sizes or offsets change
 
-
+	uint32_t lidar_ignore_magic;  // LIDAR_IGNORE_MAGIC if lidar_ignore is from generate_lidar_ignore()
+	uint32_t lidar_ignore[180];   // One bit per 1/16 degree of lidar angle, see lidar.c
 	
 } settings_t;
 
@@ -15,6 +15,7 @@ extern void i2c1_inthandler();
 extern void timebase_10k_handler();
 extern void motcon_rx_done_inthandler();
 extern void lidar_rx_done_inthandler();
+extern void lidar_process_inthandler();
 
 extern unsigned int _STACKTOP;
 
@@ -35,7 +36,7 @@ unsigned int * the_nvic_vector[97] __attribute__ ((section(".nvic_vector"))) =
 /* 0x002C                    */ (unsigned int *) invalid_handler,
 /* 0x0030                    */ (unsigned int *) invalid_handler,
 /* 0x0034                    */ (unsigned int *) invalid_handler,
-/* 0x0038                    */ (unsigned int *) invalid_handler,
+/* 0x0038 PendSV             */ (unsigned int *) lidar_process_inthandler,
 /* 0x003C                    */ (unsigned int *) invalid_handler,
 /* 0x0040                    */ (unsigned int *) invalid_handler,
 /* 0x0044                    */ (unsigned int *) invalid_handler,
@@ -17,6 +17,8 @@ All uart-related message management thingies.
 #include "optflow.h"
 #include "uart.h"
 #include "sonar.h"
+#include "lidar_corr.h"
+#include "lidar.h"
 
 uint8_t txbuf[TX_BUFFER_LEN];
 
@@ -99,6 +101,7 @@ int ignore_cmds = 0;
 void handle_uart_message()
 {
 	extern volatile int send_settings;
+	extern volatile int gen_lidar_ignore;
    dbg_teleportation_bug(401);
 
 	if(!do_handle_message)
@@ -184,6 +187,7 @@ void handle_uart_message()
 			corr.y = I7I7_I16_lossy(process_rx_buf[5],process_rx_buf[6])>>2;
 			correct_location_without_moving_external(corr);
 			set_lidar_id(process_rx_buf[7]);
+			reset_lidar_corr_images();
 		}
 		break;
 
@@ -194,13 +198,18 @@ void handle_uart_message()
 			new_pos.x = I7x5_I32(process_rx_buf[3],process_rx_buf[4],process_rx_buf[5],process_rx_buf[6],process_rx_buf[7]);
 			new_pos.y = I7x5_I32(process_rx_buf[8],process_rx_buf[9],process_rx_buf[10],process_rx_buf[11],process_rx_buf[12]);
 			set_location_without_moving_external(new_pos);
-			//reset_livelidar_images(-1);
+			reset_lidar_corr_images();
 		}
 		break;
 
 
 		break;
 
+		case 0x8b:
+		if(process_rx_buf[1] <= LIDAR_UART_PACKED_SEGS)
+			lidar_uart_mode = process_rx_buf[1];
+		break;
+
 		case 0x8f:
 		if(process_rx_buf[1] == 42)
 			host_alive();
@@ -221,6 +230,11 @@ void handle_uart_message()
 		send_settings = 1;
 		break;
 
+		case 0xd3: // Stand still in the open: recalibrates the lidar ignore mask and saves the settings.
+		if(process_rx_buf[1] == 42)
+			gen_lidar_ignore = 1;
+		break;
+
 
 extern volatile uint8_t mc_pid_imax;
 extern volatile uint8_t mc_pid_feedfwd;